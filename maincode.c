@@ -7,15 +7,407 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <errno.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <dirent.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #define TABLE_MAX_PAGES 100
+#define DB_FILE_MAGIC 0x31424453  // "SDB1"
+#define PAGER_DEFAULT_EXTENT_PAGES 16
+#define DOUBLE_WRITE_MAGIC 0x31574444  // "DDW1"
+#define DB_FORMAT_VERSION 1
+#define HISTOGRAM_BUCKETS 16
+#define ANALYZE_SAMPLE_PAGES 32
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+#define KLL_K 200
+#define KLL_MAX_LEVELS 32
+#define RAFT_MAX_NODES 7
+#define RAFT_BATCH_ENTRIES 32
+#define RAFT_PIPELINE_BATCHES 4
+#define RAFT_HEARTBEAT_MS 50
+#define RAFT_ELECTION_TIMEOUT_MS 300
+#define RAFT_COMMIT_TIMEOUT_MS 2000
+#define RAFT_MAX_PENDING_READS 64
+#define REDO_THREADS 4
+#define IMPORT_THREADS 4
+#define IMPORT_BLOCK_SIZE (1 << 20)
+#define ART_KEY_BYTES 4
+#define LEARNED_MAX_ERROR 8  // Rows between a predicted and an actual position
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITSET_WORDS 1024
+#define MAX_VALUE_FILTERS 4
+#define INDEX_FILE_MAGIC 0x31584449  // "IDX1"
+#define INDEX_DEFAULT_FILL 90
+#define INDEX_SORT_THREADS 4  // Also the runs, and so the merge fan-in
+#define INDEX_MERGE_BUFFER 64     // Pairs read from a spilled run at a time
+#define SORT_THREADS 4
+#define SORT_MIN_PARTITION_ROWS 64  // Smaller sorts use fewer threads
+#define SORT_MERGE_ROWS 64          // Rows read from a spilled sort run at a time
+#define MEMORY_MAX_BUDGET (UINT64_MAX / 100)  // So that a share never overflows
+#define SCHEDULER_SLICE_MS 20       // A scan's turn before another scan may run
+#define CHECKPOINT_INTERVAL_MS 1000
+#define FINGERPRINT_SIZE 128
+#define QUERY_STATS_SLOTS 256  // Power of two
+#define QUERY_STATS_MAX 192    // Fingerprints kept before the least called goes
+#define SLOW_QUERY_DEFAULT_MS 100
+#define TOP_DEFAULT_COUNT 10
+
+// Smallest and largest id stored on one page.
+typedef struct {
+  uint32_t min_id;
+  uint32_t max_id;
+} ZoneMap;
+
+// Written by `analyze` from a sample of the table's pages.
+typedef struct {
+  uint32_t analyzed_rows;  // Table size when analyze last ran, 0 if never
+  uint32_t sampled_rows;
+  uint32_t id_bounds[HISTOGRAM_BUCKETS + 1];  // Equi-depth bucket edges
+  uint32_t distinct_ids;
+  uint32_t distinct_usernames;
+  uint32_t distinct_emails;
+} TableStats;
+
+// Stored at the start of page 0. Rows live in pages 1 and up.
+typedef struct {
+  uint32_t magic;
+  uint32_t num_rows;
+  uint32_t num_pages;        // Logical size: pages holding data, incl. header
+  uint32_t allocated_pages;  // Physical size reserved on disk via fallocate
+  uint32_t format_version;
+  uint32_t zone_map_first_page;  // Earlier pages were written without zone maps
+  uint32_t ids_sorted;           // No row has an id below one inserted before it
+  uint32_t max_id;
+  ZoneMap zone_maps[TABLE_MAX_PAGES];
+  TableStats stats;
+  uint64_t change_seq;  // Last change log record reflected in the pages
+  uint32_t partition_size;  // Ids per partition file, 0 if unpartitioned
+} FileHeader;
+
+// First page of the double-write file. The page images follow it in order.
+typedef struct {
+  uint32_t magic;
+  uint32_t num_pages;
+  uint32_t page_nums[TABLE_MAX_PAGES];
+  uint32_t checksums[TABLE_MAX_PAGES];
+  uint32_t header_checksum;  // Covers every field above
+} DoubleWriteHeader;
 
 typedef struct {
   int file_descriptor;
   uint32_t file_length;
+  uint32_t extent_pages;  // Grow the file this many pages at a time
+  char* double_write_path;
+  FileHeader header;
   void* pages[TABLE_MAX_PAGES];
+  bool dirty[TABLE_MAX_PAGES];
+  uint32_t evict_hand;  // Next page pager_trim looks at
 } Pager;
 
+// Append-only log of inserts, one fixed-size record each, kept beside the
+// database file. Sequence numbers start at 1 and have no gaps, so record
+// N lives at offset (N - 1) * CHANGE_RECORD_SIZE.
+typedef struct {
+  uint64_t seq;
+  int64_t timestamp;  // Microseconds since the epoch
+  uint32_t row_num;
+  uint32_t checksum;  // Covers the serialized row that follows
+} ChangeRecordHeader;
+
+typedef struct {
+  int file_descriptor;
+  char* path;
+  uint64_t next_seq;
+  int feed_socket;  // Listening socket for followers, -1 if none
+  char* feed_path;
+  pthread_t feed_thread;  // Accepts followers while feed_socket is open
+} ChangeLog;
+
+typedef enum { RAFT_FOLLOWER, RAFT_CANDIDATE, RAFT_LEADER } RaftRole;
+
+typedef enum { RAFT_ENTRY_NOOP, RAFT_ENTRY_INSERT } RaftEntryType;
+
+// Raft log entries are stored back to back in `<db>-raft`, each followed
+// by the serialized row it inserts. Entry N lives at (N - 1) * RAFT_ENTRY_SIZE.
+typedef struct {
+  uint64_t term;
+  uint32_t type;
+  uint32_t checksum;  // Covers the serialized row that follows
+} RaftEntryHeader;
+
+typedef enum {
+  RAFT_REQUEST_VOTE,
+  RAFT_VOTE,
+  RAFT_APPEND_ENTRIES,
+  RAFT_APPEND_REPLY,
+  RAFT_READ_INDEX,
+  RAFT_READ_INDEX_REPLY
+} RaftMessageType;
+
+// One UDP datagram; AppendEntries carries its entries right after it.
+typedef struct {
+  uint32_t type;
+  uint32_t from;
+  uint64_t term;
+  uint64_t index;     // Last log index, previous index, or match index
+  uint64_t log_term;  // Term of the entry at index
+  uint64_t commit;    // Leader commit, or the id of a read index request
+  uint64_t round;     // Leader's heartbeat round, echoed by append replies
+  uint32_t success;
+  uint32_t num_entries;
+} RaftMessage;
+
+// A follower's read index request, answered once the heartbeat round
+// started for it shows a majority still follows this leader.
+typedef struct {
+  uint32_t from;
+  uint64_t request;
+  uint64_t read_index;
+  uint64_t round;
+} RaftPendingRead;
+
+typedef struct {
+  pthread_mutex_t lock;   // Guards this struct and the table
+  pthread_cond_t changed; // Signalled on apply, role change and read replies
+  pthread_t thread;
+  bool running;
+
+  uint32_t id;  // Index of this node in peers
+  uint32_t num_nodes;
+  struct sockaddr_in peers[RAFT_MAX_NODES];
+  int socket;
+  int log_fd;
+  int state_fd;  // current_term and voted_for
+
+  RaftRole role;
+  uint64_t current_term;
+  int32_t voted_for;
+  int32_t leader_id;
+  uint32_t votes;
+
+  uint8_t* entries;
+  uint64_t num_entries;
+  uint64_t allocated_entries;
+  uint64_t synced_index;
+  uint64_t commit_index;
+  uint64_t last_applied;
+
+  uint64_t next_index[RAFT_MAX_NODES];
+  uint64_t match_index[RAFT_MAX_NODES];
+  int64_t last_ack[RAFT_MAX_NODES];
+  int64_t election_deadline;
+  int64_t next_heartbeat;
+
+  uint64_t read_request;
+  uint64_t read_reply;
+  uint64_t read_index;
+  uint64_t round;            // Last heartbeat round this leader started
+  uint64_t acked_round[RAFT_MAX_NODES];  // In the current term
+  uint64_t confirmed_round;  // Highest round a majority has acked
+  RaftPendingRead pending_reads[RAFT_MAX_PENDING_READS];
+  uint32_t num_pending_reads;
+  uint64_t random_state;
+} Raft;
+
+// Adaptive radix tree over ids, one big-endian key byte per level. Inner
+// nodes grow from 4 to 16, 48 and 256 children as they fill, and keep the
+// key bytes shared by everything below them as a prefix so that chains of
+// single-child nodes are never built.
+typedef enum { ART_NODE4, ART_NODE16, ART_NODE48, ART_NODE256 } ArtNodeType;
+
+typedef struct {
+  ArtNodeType type;
+  uint16_t num_children;
+  uint8_t prefix_length;
+  uint8_t prefix[ART_KEY_BYTES];
+} ArtNode;
+
+typedef struct {
+  ArtNode node;
+  uint8_t keys[4];  // Sorted
+  void* children[4];
+} ArtNode4;
+
+typedef struct {
+  ArtNode node;
+  uint8_t keys[16];  // Sorted
+  void* children[16];
+} ArtNode16;
+
+typedef struct {
+  ArtNode node;
+  uint8_t child_index[256];  // Slot in children plus one, 0 if absent
+  void* children[48];
+} ArtNode48;
+
+typedef struct {
+  ArtNode node;
+  void* children[256];
+} ArtNode256;
+
+// Child pointers with the low bit set point at leaves.
+typedef struct {
+  uint32_t id;
+  uint32_t num_rows;
+  uint32_t allocated;
+  uint32_t* rows;  // Row numbers holding this id, in insert order
+} ArtLeaf;
+
+// One piece of the learned id -> row model. Every row it covers lies within
+// LEARNED_MAX_ERROR rows of first_row + slope * (id - first_id) for any
+// slope between slope_low and slope_high.
+typedef struct {
+  uint32_t first_id;
+  uint32_t first_row;
+  double slope_low;
+  double slope_high;
+} LearnedSegment;
+
+typedef struct {
+  LearnedSegment* segments;
+  uint32_t num_segments;
+  uint32_t allocated;
+} LearnedIndex;
+
+// Roaring bitmap: row numbers grouped by their high 16 bits. A group is a
+// sorted array of low halves until it passes ROARING_ARRAY_MAX entries and
+// a 65536-bit bitset after that.
+typedef struct {
+  uint16_t key;
+  uint32_t cardinality;
+  uint32_t allocated;
+  uint16_t* array;   // NULL once the container is a bitset
+  uint64_t* bitset;  // ROARING_BITSET_WORDS words, NULL while an array
+} RoaringContainer;
+
+typedef struct {
+  RoaringContainer* containers;  // Sorted by key
+  uint32_t num_containers;
+} Roaring;
+
+typedef struct {
+  char* value;
+  Roaring rows;
+} BitmapEntry;
+
+// Maps each distinct value of a column to the rows holding it, in an open
+// addressing table keyed on the value's hash.
+typedef struct {
+  BitmapEntry* entries;
+  uint32_t num_entries;
+  uint32_t capacity;
+} BitmapIndex;
+
+// Rows containing one trigram, as varint-encoded gaps between row numbers.
+typedef struct {
+  bool used;
+  uint32_t trigram;
+  uint32_t num_rows;
+  uint32_t last_row;
+  uint8_t* bytes;
+  uint32_t length;
+  uint32_t allocated;
+} TrigramPostings;
+
+// Open addressing table from each three-byte substring to its postings.
+typedef struct {
+  TrigramPostings* postings;
+  uint32_t num_trigrams;
+  uint32_t capacity;
+} TrigramIndex;
+
+typedef struct {
+  uint32_t pivot;
+  uint32_t position;
+} Crack;
+
+// Copy of the id column that range queries partition in place. Each crack
+// splits it so that every id below the pivot sits before the position.
+typedef struct {
+  uint32_t* ids;
+  uint32_t* rows;  // Row number of each entry of ids
+  uint32_t count;
+  uint32_t allocated;
+  Crack* cracks;  // Sorted by pivot
+  uint32_t num_cracks;
+  uint32_t allocated_cracks;
+} CrackerColumn;
+
+// One entry of the on-disk id index. Pairs order by id, then row, so
+// every entry is unique even when ids repeat.
+typedef struct {
+  uint32_t id;
+  uint32_t row_num;
+} IndexPair;
+
+// Page 0 of the index file. The B+tree's pages follow it.
+typedef struct {
+  uint32_t magic;
+  uint32_t root;
+  uint32_t height;  // 1 while the root is a leaf
+  uint32_t num_pages;
+  uint32_t indexed_rows;  // Rows below this number are in the tree
+  uint32_t fill_percent;  // How full bulk construction packs each page
+} IndexMeta;
+
+// Leaves hold sorted pairs and link to the next leaf. Internal pages hold
+// child page numbers, with keys[i] the smallest pair under children[i + 1].
+typedef struct {
+  uint32_t is_leaf;
+  uint32_t num_entries;  // Pairs in a leaf, keys in an internal page
+  uint32_t next_leaf;    // 0 for the last leaf
+} IndexPageHeader;
+
+// The whole index is kept in memory and written back on close.
+typedef struct {
+  char* path;
+  IndexMeta meta;
+  uint8_t** pages;  // Page 0 is unused; meta stands for it
+  uint32_t allocated_pages;
+  bool dirty;
+} BTree;
+
+typedef struct Table {
+  uint32_t num_rows;
+  Pager* pager;
+  ChangeLog* changes;
+  int upstream_changes;  // Primary's change log when this is a replica, else -1
+  Raft* raft;            // NULL unless running as a cluster node
+  char* archive_dir;     // Where closed change log segments are copied, if set
+  void* id_index;        // Root of the adaptive radix tree over ids
+  LearnedIndex learned;  // Model of where each id sits, only while ids are sorted
+  BitmapIndex domain_index;
+  BitmapIndex tenant_index;
+  TrigramIndex username_trigrams;
+  TrigramIndex email_trigrams;
+  CrackerColumn* cracker;  // NULL unless adaptive cracking is on
+  BTree* btree;            // On-disk id index, NULL until one is created
+  char* filename;
+  // Open partitions in ascending order of partition number, which is
+  // id / partition_size. Only partitions that exist take a slot.
+  struct Table** partitions;
+  uint32_t* partition_numbers;
+  uint32_t num_partitions;
+  uint32_t allocated_partitions;
+} Table;
+
 typedef struct {
   Table* table;
   uint32_t row_num;
@@ -26,9 +418,37 @@ typedef struct {
   char* buffer;
   size_t buffer_length;
   ssize_t input_length;
+  size_t charged;  // Bytes charged to the connection's memory
 } InputBuffer;
 
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL } ExecuteResult;
+typedef enum {
+  EXECUTE_SUCCESS,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_READ_ONLY,
+  EXECUTE_NOT_LEADER,
+  EXECUTE_NOT_COMMITTED,
+  EXECUTE_NO_PARTITION,
+  EXECUTE_INDEX_FAILED,
+  EXECUTE_CANCELLED,
+  EXECUTE_TIMED_OUT
+} ExecuteResult;
+
+typedef enum {
+  PLAN_FULL_SCAN,
+  PLAN_PAGE_SKIP,
+  PLAN_EARLY_STOP,
+  PLAN_INDEX_LOOKUP,
+  PLAN_BITMAP,
+  PLAN_CRACKED,
+  PLAN_INDEX_RANGE
+} AccessPath;
+
+typedef struct {
+  AccessPath path;
+  uint32_t estimated_pages;
+  uint32_t estimated_rows;
+  Roaring matches;  // Rows the chosen index names, for the index paths
+} QueryPlan;
 
 typedef enum {
   META_COMMAND_SUCCESS,
@@ -43,7 +463,67 @@ typedef enum {
   PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_ANALYZE,
+  STATEMENT_DROP_PARTITION,
+  STATEMENT_CREATE_INDEX
+} StatementType;
+
+typedef enum {
+  COLUMN_ID,
+  COLUMN_USERNAME,
+  COLUMN_EMAIL,
+  COLUMN_EMAIL_DOMAIN,
+  COLUMN_TENANT  // Username up to its first underscore
+} Column;
+
+typedef enum {
+  AGGREGATE_NONE,
+  AGGREGATE_APPROX_COUNT_DISTINCT,
+  AGGREGATE_APPROX_PERCENTILE
+} AggregateType;
+
+typedef struct {
+  AggregateType type;
+  Column column;
+  double percentile;  // In [0, 1]
+} Aggregate;
+
+// HyperLogLog: each register keeps the longest run of leading zeros seen
+// among the hashes routed to it.
+typedef struct {
+  uint8_t registers[HLL_REGISTERS];
+} HyperLogLog;
+
+// KLL quantile sketch. Level h holds items standing for 2^h inputs each;
+// a full level is sorted and every other item is promoted to the next.
+typedef struct {
+  uint32_t* items[KLL_MAX_LEVELS];
+  uint32_t sizes[KLL_MAX_LEVELS];
+  uint32_t allocated[KLL_MAX_LEVELS];
+  uint32_t num_levels;
+  uint64_t count;
+  uint64_t random_state;
+} KllSketch;
+
+typedef enum { SAMPLE_NONE, SAMPLE_SYSTEM, SAMPLE_BERNOULLI } SampleMethod;
+
+// SYSTEM keeps whole pages, BERNOULLI keeps individual rows.
+typedef struct {
+  SampleMethod method;
+  double fraction;  // In (0, 1]
+  bool repeatable;
+  uint64_t seed;
+} TableSample;
+
+// Inclusive range of ids a select is restricted to.
+typedef struct {
+  bool active;
+  uint32_t min_id;
+  uint32_t max_id;
+} IdRange;
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -53,11 +533,217 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+typedef enum {
+  FILTER_EQUALS,   // Column has a bitmap index
+  FILTER_CONTAINS  // like '%value%', column has a trigram index
+} FilterType;
+
+typedef struct {
+  FilterType type;
+  Column column;
+  char value[COLUMN_EMAIL_SIZE + 1];
+} ValueFilter;
+
+typedef struct {
+  bool active;
+  Column column;  // id, username or email
+  bool descending;
+} OrderBy;
+
 typedef struct {
   StatementType type;
   Row row_to_insert; //only used by insert statement
+  IdRange id_range;  //only used by select statement
+  ValueFilter filters[MAX_VALUE_FILTERS];  //only used by select statement
+  uint32_t num_filters;
+  Aggregate aggregate;  //only used by select statement
+  TableSample sample;   //only used by select statement
+  OrderBy order_by;     //only used by select statement
+  uint32_t partition;  //only used by drop partition statement
+  uint32_t fill_percent;  //only used by create index statement
+  bool explain;      // Print the chosen plan instead of running it
 } Statement;
 
+// A line of input prepared before its session takes the executor.
+typedef struct {
+  char* text;  // The statement as typed, for the logs; NULL for meta commands
+  PrepareResult prepared;
+  Statement statement;
+} PreparedInput;
+
+// Rows a select with order by holds back until they can be sorted. Rows
+// that do not fit in the workspace share go to the spill file in sorted
+// runs.
+typedef struct {
+  Row* rows;
+  uint32_t count;
+  uint32_t allocated;
+  FILE* spill;          // NULL until the first run is written
+  uint32_t* run_sizes;  // Rows in each spilled run, in file order
+  uint32_t num_runs;
+} RowBuffer;
+
+// Where a select sends the rows it matches.
+typedef struct {
+  HyperLogLog hll;
+  KllSketch kll;
+  RowBuffer ordered;
+} SelectOutput;
+
+// A sort key as the sort moves it: the id, or the normalized prefix of
+// a string with a pointer to the rest of it.
+typedef struct {
+  uint64_t key;
+  const char* text;  // The string a normalized key came from, NULL for ids
+  uint32_t index;    // Position among the values being sorted, breaks ties
+} SortEntry;
+
+// One slice of the entries, sorted by its own thread.
+typedef struct {
+  SortEntry* entries;
+  SortEntry* scratch;
+  uint32_t count;
+  bool descending;  // Reverse the slice once sorted
+} SortPartition;
+
+// Tournament tree over sorted runs. losers[0] holds the run whose head
+// comes first; every other node holds the loser of the match played
+// there, with runs as the leaves below node num_runs - 1.
+typedef struct {
+  SortEntry** heads;  // Next entry of each run, NULL once it is used up
+  uint32_t* losers;
+  uint32_t num_runs;
+  bool descending;
+} LoserTree;
+
+// Reads a spilled sort run back a few rows at a time for the final merge.
+typedef struct {
+  off_t offset;        // Next row of the run in the spill file
+  uint32_t remaining;  // Rows of the run not yet read
+  uint32_t position;
+  uint32_t buffered;
+  uint32_t capacity;
+  Row* rows;
+  SortEntry head;  // Sort entry for rows[position]
+} SpillReader;
+
+typedef enum {
+  MEMORY_BUFFER_POOL,  // Cached table pages
+  MEMORY_WORKSPACE,    // Rows and sort entries held by order by
+  MEMORY_CONNECTION,   // The input line
+  MEMORY_CATEGORIES
+} MemoryCategory;
+
+// Bytes charged to each category against one process-wide budget. Each
+// category may use its share of the budget; a budget of 0 is unlimited.
+typedef struct {
+  uint64_t budget;
+  uint64_t used[MEMORY_CATEGORIES];
+  uint64_t peak[MEMORY_CATEGORIES];
+  uint64_t evictions;    // Pages dropped to stay under the pool share
+  uint64_t write_backs;  // Dirty pages written early so they could be dropped
+  uint64_t sort_spills;  // Sorted runs written to disk by order by
+} MemoryAccountant;
+
+typedef enum {
+  SCHEDULE_POINT,       // Inserts and single-id lookups
+  SCHEDULE_SCAN,        // Statements that may read the whole table
+  SCHEDULE_BACKGROUND,  // Checkpointing
+  SCHEDULE_CLASSES
+} ScheduleClass;
+
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_COUNTERS
+} PerfCounter;
+
+// Hardware counters for the thread that opened them, read as one group
+// so that all of them cover the same stretch of execution.
+typedef struct {
+  bool opened;
+  int fds[PERF_COUNTERS];
+  uint64_t start[PERF_COUNTERS];
+  uint64_t start_enabled;  // Nanoseconds the group was enabled and running
+  uint64_t start_running;
+} PerfGroup;
+
+// Counter totals over every statement profiled.
+typedef struct {
+  bool enabled;
+  uint64_t statements;
+  uint64_t totals[PERF_COUNTERS];
+} PerfStats;
+
+// Something that runs statements: the console, a client connected to
+// the session socket, or the background checkpointer.
+typedef struct {
+  Table* table;
+  int output_fd;  // Where stdout goes while this session runs, -1 to leave it
+  ScheduleClass schedule_class;
+  int64_t slice_end;  // When a scan must let a waiting scan take a turn
+  PerfGroup perf;     // Opened on this session's thread when first needed
+  uint32_t id;        // The number .cancel takes, 0 if it cannot be named
+  uint32_t timeout_ms;  // Limit on each statement's run time, 0 for none
+  int64_t deadline;     // Of the running statement, 0 for none
+  // Set by .cancel from another session, or by Ctrl-C for the console.
+  volatile sig_atomic_t cancel_requested;
+} Session;
+
+// Statements from every session run one at a time, on the thread of
+// whichever session holds the executor. A session waits while another
+// runs or while a session of a more urgent class waits; scans give the
+// executor up at page boundaries when someone more urgent is waiting.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  // Sessions prepare before taking the executor, one at a time, as strtok
+  // keeps its place in a static.
+  pthread_mutex_t prepare_lock;
+  Session* running;
+  uint32_t waiting[SCHEDULE_CLASSES];
+  uint32_t suspended;  // Statements parked part way through
+  int output_fd;       // The session stdout points at now
+  int console_fd;      // A copy of the original stdout
+  uint64_t yields;
+  KllSketch latency[SCHEDULE_CLASSES];  // Microseconds from input to result
+  uint32_t checkpoint_rate;             // Pages a second, 0 when off
+  uint64_t checkpoint_pages;
+  Session* console;    // The session Ctrl-C cancels, NULL if none
+  Session** sessions;  // Sessions .cancel can name
+  uint32_t num_sessions;
+  uint32_t next_session_id;
+} Scheduler;
+
+// Work done by the running statement, for the query stats.
+typedef struct {
+  uint64_t rows_scanned;
+  uint64_t pages_read;  // Pages read from disk rather than found in memory
+} StatementWork;
+
+// Totals for every statement with one fingerprint. An empty fingerprint
+// marks a free slot.
+typedef struct {
+  char fingerprint[FINGERPRINT_SIZE];
+  uint64_t hash;
+  uint64_t calls;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t rows_scanned;
+  uint64_t pages_read;
+} QueryStats;
+
+// Query stats in a fixed-size open-addressing table, and the log that
+// statements slower than slow_ms are written to.
+typedef struct {
+  QueryStats slots[QUERY_STATS_SLOTS];
+  uint32_t num_entries;
+  FILE* slow_log;  // NULL when not logging
+  uint32_t slow_ms;
+} QueryLog;
+
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
@@ -70,12 +756,175 @@ const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
 const uint32_t PAGE_SIZE = 4096;
 const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+const uint32_t HEADER_PAGES = 1;
+const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * (TABLE_MAX_PAGES - 1);
+const uint32_t CHANGE_RECORD_SIZE = sizeof(ChangeRecordHeader) + ROW_SIZE;
+const uint32_t RAFT_ENTRY_SIZE = sizeof(RaftEntryHeader) + ROW_SIZE;
+const uint32_t INDEX_LEAF_MAX =
+    (PAGE_SIZE - sizeof(IndexPageHeader)) / sizeof(IndexPair);
+const uint32_t INDEX_INTERNAL_MAX =
+    (PAGE_SIZE - sizeof(IndexPageHeader) - sizeof(uint32_t)) /
+    (sizeof(IndexPair) + sizeof(uint32_t));
+// Percent of the memory budget each category may use.
+const uint32_t MEMORY_SHARES[MEMORY_CATEGORIES] = {60, 30, 10};
 
-typedef struct {
-  uint32_t num_rows;
-  Pager* pager;
-} Table;
+StatementWork statement_work = {0, 0};
+QueryLog query_log;
+
+MemoryAccountant memory_accountant = {0};
+Scheduler scheduler;
+
+uint64_t memory_limit(MemoryCategory category) {
+  return memory_accountant.budget * MEMORY_SHARES[category] / 100;
+}
+
+// Whether category can take bytes more without going over its share.
+bool memory_fits(MemoryCategory category, uint64_t bytes) {
+  return memory_accountant.budget == 0 ||
+         memory_accountant.used[category] + bytes <= memory_limit(category);
+}
+
+void memory_charge(MemoryCategory category, uint64_t bytes) {
+  memory_accountant.used[category] += bytes;
+  if (memory_accountant.used[category] > memory_accountant.peak[category]) {
+    memory_accountant.peak[category] = memory_accountant.used[category];
+  }
+}
+
+void memory_release(MemoryCategory category, uint64_t bytes) {
+  memory_accountant.used[category] -= bytes;
+}
+
+void print_memory() {
+  const char* names[] = {"Buffer pool", "Workspace", "Connection"};
+  if (memory_accountant.budget == 0) {
+    printf("Budget: unlimited\n");
+  } else {
+    printf("Budget: %lu bytes\n", (unsigned long)memory_accountant.budget);
+  }
+  for (uint32_t c = 0; c < MEMORY_CATEGORIES; c++) {
+    printf("%s: %lu bytes, peak %lu", names[c],
+           (unsigned long)memory_accountant.used[c],
+           (unsigned long)memory_accountant.peak[c]);
+    if (memory_accountant.budget > 0) {
+      printf(", limit %lu", (unsigned long)memory_limit(c));
+    }
+    printf("\n");
+  }
+  printf("Evicted pages: %lu, written back: %lu, sort spills: %lu\n",
+         (unsigned long)memory_accountant.evictions,
+         (unsigned long)memory_accountant.write_backs,
+         (unsigned long)memory_accountant.sort_spills);
+}
+
+PerfStats perf_stats;
+
+void perf_close(PerfGroup* group) {
+  for (uint32_t i = 0; i < PERF_COUNTERS && group->opened; i++) {
+    close(group->fds[i]);
+  }
+  group->opened = false;
+}
+
+// Opens the counters for the calling thread, user space only. Sets errno
+// and returns false where the kernel or its settings do not allow it.
+bool perf_open(PerfGroup* group) {
+#ifdef __linux__
+  const uint64_t configs[PERF_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  for (uint32_t i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = configs[i];
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : group->fds[0], 0);
+    if (fd == -1) {
+      int error = errno;
+      for (uint32_t j = 0; j < i; j++) {
+        close(group->fds[j]);
+      }
+      errno = error;
+      return false;
+    }
+    group->fds[i] = fd;
+  }
+  group->opened = true;
+  return true;
+#else
+  (void)group;
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+// Reads the group, scaling for any time the kernel had it switched out
+// to share the hardware with other counters.
+bool perf_read(PerfGroup* group, uint64_t* values, uint64_t* enabled,
+               uint64_t* running) {
+  uint64_t data[3 + PERF_COUNTERS];
+  if (read(group->fds[0], data, sizeof(data)) != sizeof(data) ||
+      data[0] != PERF_COUNTERS) {
+    return false;
+  }
+  *enabled = data[1];
+  *running = data[2];
+  memcpy(values, data + 3, sizeof(uint64_t) * PERF_COUNTERS);
+  return true;
+}
+
+bool perf_begin(PerfGroup* group) {
+  if (!group->opened && !perf_open(group)) {
+    return false;
+  }
+  return perf_read(group, group->start, &(group->start_enabled),
+                   &(group->start_running));
+}
+
+// Counts since perf_begin, added to the totals.
+bool perf_end(PerfGroup* group, uint64_t* counts) {
+  uint64_t enabled;
+  uint64_t running;
+  if (!perf_read(group, counts, &enabled, &running)) {
+    return false;
+  }
+  enabled -= group->start_enabled;
+  running -= group->start_running;
+  for (uint32_t i = 0; i < PERF_COUNTERS; i++) {
+    counts[i] -= group->start[i];
+    if (running > 0 && running < enabled) {
+      counts[i] = (double)counts[i] * enabled / running;
+    }
+    perf_stats.totals[i] += counts[i];
+  }
+  perf_stats.statements++;
+  return true;
+}
+
+void print_perf_counts(uint64_t* counts) {
+  double ipc = counts[PERF_CYCLES] > 0
+                   ? (double)counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]
+                   : 0;
+  printf("Cycles: %lu, instructions: %lu (IPC %.2f), cache misses: %lu, "
+         "branch misses: %lu\n",
+         (unsigned long)counts[PERF_CYCLES],
+         (unsigned long)counts[PERF_INSTRUCTIONS], ipc,
+         (unsigned long)counts[PERF_CACHE_MISSES],
+         (unsigned long)counts[PERF_BRANCH_MISSES]);
+}
+
+void print_perf() {
+  printf("Perf %s, %lu statements profiled\n", perf_stats.enabled ? "on" : "off",
+         (unsigned long)perf_stats.statements);
+  if (perf_stats.statements > 0) {
+    print_perf_counts(perf_stats.totals);
+  }
+}
 
 
 Cursor* table_start(Table* table) {
@@ -104,11 +953,33 @@ void cursor_advance(Cursor* cursor) {
 
 // Function prototypes
 void* get_page(Pager* pager, uint32_t page_num);
+void header_note_insert(FileHeader* header, Cursor* cursor, uint32_t id);
+void raft_stop(Raft* raft);
+void print_raft_status(Raft* raft);
+void table_release(Table* table);
+void partitions_load(Table* table);
+void pager_double_write(Pager* pager, uint32_t num_pages);
+void pager_flush(Pager* pager, uint32_t page_num, uint32_t size);
+void pager_sync(int fd);
+void print_partitions(Table* table);
+void import_file(Table* table, const char* path);
+void print_scheduler();
+void print_top(uint32_t count);
+void scheduler_yield();
+uint64_t hash_bytes(const void* data, size_t size);
+int compare_ids(const void* a, const void* b);
+int64_t monotonic_millis();
+void btree_open(Table* table);
 
 void print_row(Row* row) {
   printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
+void print_change(FILE* out, uint64_t seq, Row* row) {
+  fprintf(out, "%lu: (%d, %s, %s)\n", (unsigned long)seq, row->id,
+          row->username, row->email);
+}
+
 void serialize_row(Row* source, void* destination) {
   memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
   strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
@@ -122,9 +993,22 @@ void deserialize_row(void *source, Row* destination) {
   memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
+const char* row_email_domain(Row* row) {
+  const char* at = strchr(row->email, '@');
+  return at ? at + 1 : row->email;
+}
+
+size_t row_tenant_length(Row* row) {
+  return strcspn(row->username, "_");
+}
+
+uint32_t cursor_page_num(Cursor* cursor) {
+  return HEADER_PAGES + cursor->row_num / ROWS_PER_PAGE;
+}
+
 void* cursor_value(Cursor* cursor) {
   uint32_t row_num = cursor->row_num;
-  uint32_t page_num = row_num / ROWS_PER_PAGE;
+  uint32_t page_num = cursor_page_num(cursor);
   void* page = get_page(cursor->table->pager, page_num);
   uint32_t row_offset = row_num % ROWS_PER_PAGE;
   uint32_t byte_offset = row_offset * ROW_SIZE;
@@ -141,6 +1025,7 @@ void* get_page(Pager* pager, uint32_t page_num) {
   if (pager->pages[page_num] == NULL) {
     // Cache miss. Allocate memory and load from file.
     void* page = malloc(PAGE_SIZE);
+    memory_charge(MEMORY_BUFFER_POOL, PAGE_SIZE);
     uint32_t num_pages = pager->file_length / PAGE_SIZE;
 
     // We might save a partial page at the end of the file
@@ -155,6 +1040,7 @@ void* get_page(Pager* pager, uint32_t page_num) {
         printf("Error reading file: %d\n", errno);
         exit(EXIT_FAILURE);
       }
+      statement_work.pages_read++;
     }
 
     pager->pages[page_num] = page;
@@ -163,242 +1049,6169 @@ void* get_page(Pager* pager, uint32_t page_num) {
   return pager->pages[page_num];
 }
 
+void pager_release_page(Pager* pager, uint32_t page_num) {
+  free(pager->pages[page_num]);
+  pager->pages[page_num] = NULL;
+  memory_release(MEMORY_BUFFER_POOL, PAGE_SIZE);
+}
 
-
-Pager* pager_open(const char* filename) {
-  int fd = open(filename,
-                O_RDWR |      // Read/Write mode
-                    O_CREAT,  // Create file if it does not exist
-                S_IWUSR |     // User write permission
-                    S_IRUSR   // User read permission
-                );
-
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+// Drops clean pages, sweeping round from where the last call stopped.
+void pager_evict_clean(Pager* pager) {
+  for (uint32_t swept = 0;
+       swept < TABLE_MAX_PAGES && !memory_fits(MEMORY_BUFFER_POOL, 0); swept++) {
+    uint32_t page_num = pager->evict_hand;
+    pager->evict_hand = (pager->evict_hand + 1) % TABLE_MAX_PAGES;
+    if (page_num >= HEADER_PAGES && pager->pages[page_num] != NULL &&
+        !pager->dirty[page_num]) {
+      pager_release_page(pager, page_num);
+      memory_accountant.evictions++;
+    }
   }
+}
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+// Brings the buffer pool back within its share. Clean pages go first. If
+// that is not enough, every dirty page is written back the way a
+// checkpoint writes it, through the double-write file, and is then clean
+// and can go too. The header is left alone, so a crash still replays
+// those rows from the change log. Only the page a caller is filling can
+// keep the pool over its share, by at most a page. Callers must hold no
+// page pointers.
+void pager_trim(Pager* pager) {
+  pager_evict_clean(pager);
+  if (memory_fits(MEMORY_BUFFER_POOL, 0)) {
+    return;
   }
-
-  return pager;
+  uint32_t num_pages = 0;
+  for (uint32_t i = HEADER_PAGES; i < TABLE_MAX_PAGES; i++) {
+    if (pager->pages[i] != NULL && pager->dirty[i]) {
+      num_pages = i + 1;
+    }
+  }
+  if (num_pages == 0) {
+    return;
+  }
+  // Every dirty page goes into the double-write file, including any a
+  // checkpoint has yet to write; those are written here too, so nothing
+  // is left depending on the checkpoint's copy.
+  pager_double_write(pager, num_pages);
+  for (uint32_t i = HEADER_PAGES; i < num_pages; i++) {
+    if (pager->pages[i] != NULL && pager->dirty[i]) {
+      pager_flush(pager, i, PAGE_SIZE);
+      pager->dirty[i] = false;
+      memory_accountant.write_backs++;
+    }
+  }
+  pager_sync(pager->file_descriptor);
+  unlink(pager->double_write_path);
+  pager_evict_clean(pager);
 }
 
-void pager_flush(Pager* pager, uint32_t page_num, uint32_t size) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+// Brings the buffer pool within its share across the table and its
+// partitions. On a cluster node the raft thread applies inserts under
+// raft->lock, holding page pointers, so the trim takes that lock too.
+void buffer_pool_trim(Table* table) {
+  if (table->raft != NULL) {
+    pthread_mutex_lock(&(table->raft->lock));
+  }
+  pager_trim(table->pager);
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    pager_trim(table->partitions[i]->pager);
   }
+  if (table->raft != NULL) {
+    pthread_mutex_unlock(&(table->raft->lock));
+  }
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
 
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
+
+void pager_write_header(Pager* pager) {
+  ssize_t bytes_written = pwrite(pager->file_descriptor, &(pager->header),
+                                 sizeof(FileHeader), 0);
+  if (bytes_written == -1) {
+    printf("Error writing header: %d\n", errno);
     exit(EXIT_FAILURE);
   }
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], size);
+// Files written before the header existed start with row 0 at offset 0.
+// Shift their contents down one page so they match the current layout.
+void pager_upgrade_legacy_file(Pager* pager) {
+  uint32_t length = pager->file_length;
+  void* contents = malloc(length);
 
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
+  if (pread(pager->file_descriptor, contents, length, 0) != (ssize_t)length ||
+      pwrite(pager->file_descriptor, contents, length, PAGE_SIZE) !=
+          (ssize_t)length) {
+    printf("Error upgrading db file: %d\n", errno);
     exit(EXIT_FAILURE);
   }
-}
+  free(contents);
 
+  pager->file_length = length + PAGE_SIZE;
+  pager->header.num_rows = length / ROW_SIZE;
+}
 
-void db_close(Table* table) {
-  Pager* pager = table->pager;
-  uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE;
+void pager_load_header(Pager* pager) {
+  FileHeader* header = &(pager->header);
+  memset(header, 0, sizeof(FileHeader));
 
-  for (uint32_t i = 0; i < num_full_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+  if (pager->file_length > 0) {
+    ssize_t bytes_read =
+        pread(pager->file_descriptor, header, sizeof(FileHeader), 0);
+    if (bytes_read == -1) {
+      printf("Error reading header: %d\n", errno);
+      exit(EXIT_FAILURE);
     }
-    pager_flush(pager, i, PAGE_SIZE);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
-  }
-
-  // There may be a partial page to write to the end of the file
-  // This should not be needed after we switch to a B-tree
-  uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
-  if (num_additional_rows > 0) {
-    uint32_t page_num = num_full_pages;
-    if (pager->pages[page_num] != NULL) {
-      pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
-      free(pager->pages[page_num]);
-      pager->pages[page_num] = NULL;
+    if (bytes_read == sizeof(FileHeader) && header->magic == DB_FILE_MAGIC) {
+      return;
     }
+    memset(header, 0, sizeof(FileHeader));
+    pager_upgrade_legacy_file(pager);
   }
 
-  int result = close(pager->file_descriptor);
+  header->magic = DB_FILE_MAGIC;
+  header->num_pages =
+      HEADER_PAGES + (header->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+  header->allocated_pages = pager->file_length / PAGE_SIZE;
+}
+
+// Headers written before zone maps existed have zeros past allocated_pages.
+// Their rows are left uncovered; zone maps start at the next fresh page.
+void pager_upgrade_header(Pager* pager) {
+  FileHeader* header = &(pager->header);
+  if (header->format_version >= DB_FORMAT_VERSION) {
+    return;
+  }
+
+  header->format_version = DB_FORMAT_VERSION;
+  header->zone_map_first_page = header->num_pages;
+  header->ids_sorted = (header->num_rows == 0);
+  header->max_id = 0;
+  memset(&(header->stats), 0, sizeof(TableStats));
+}
+
+// Grow the file a whole extent at a time so that appending rows does not
+// extend it (and update filesystem metadata) one 4 KB page per write.
+void pager_reserve(Pager* pager, uint32_t num_pages) {
+  FileHeader* header = &(pager->header);
+  if (num_pages <= header->allocated_pages) {
+    return;
+  }
+
+  uint32_t extent = pager->extent_pages;
+  uint32_t target = ((num_pages + extent - 1) / extent) * extent;
+  if (target > TABLE_MAX_PAGES) {
+    target = TABLE_MAX_PAGES;
+  }
+
+  off_t offset = (off_t)header->allocated_pages * PAGE_SIZE;
+  off_t length = (off_t)(target - header->allocated_pages) * PAGE_SIZE;
+  int result = posix_fallocate(pager->file_descriptor, offset, length);
+  if (result == EOPNOTSUPP || result == EINVAL) {
+    // Filesystem can't preallocate; plain writes will extend the file.
+    return;
+  }
+  if (result != 0) {
+    printf("Error allocating file space: %d\n", result);
+    exit(EXIT_FAILURE);
+  }
+
+  header->allocated_pages = target;
+  if (pager->file_length < offset + length) {
+    pager->file_length = offset + length;
+  }
+}
+
+uint32_t checksum(const void* data, uint32_t size) {
+  // FNV-1a
+  const uint8_t* bytes = data;
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void pager_sync(int fd) {
+  if (fsync(fd) == -1) {
+    printf("Error syncing file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// A page whose in-place write was interrupted fails its checksum against
+// the copy in the double-write file; put the intact copy back.
+void pager_recover_torn_pages(Pager* pager) {
+  int dw_fd = open(pager->double_write_path, O_RDWR);
+  if (dw_fd == -1) {
+    return;
+  }
+
+  DoubleWriteHeader dw_header;
+  ssize_t bytes_read = pread(dw_fd, &dw_header, sizeof(dw_header), 0);
+  bool valid = bytes_read == sizeof(dw_header) &&
+               dw_header.magic == DOUBLE_WRITE_MAGIC &&
+               dw_header.num_pages <= TABLE_MAX_PAGES &&
+               dw_header.header_checksum ==
+                   checksum(&dw_header, offsetof(DoubleWriteHeader,
+                                                 header_checksum));
+
+  if (valid) {
+    void* saved = malloc(PAGE_SIZE);
+    void* current = malloc(PAGE_SIZE);
+    bool repaired = false;
+    for (uint32_t i = 0; i < dw_header.num_pages; i++) {
+      off_t dw_offset = (off_t)(i + 1) * PAGE_SIZE;
+      off_t db_offset = (off_t)dw_header.page_nums[i] * PAGE_SIZE;
+      if (pread(dw_fd, saved, PAGE_SIZE, dw_offset) != PAGE_SIZE ||
+          checksum(saved, PAGE_SIZE) != dw_header.checksums[i]) {
+        // The double write itself was torn, so the page in place was
+        // never touched.
+        continue;
+      }
+      memset(current, 0, PAGE_SIZE);
+      pread(pager->file_descriptor, current, PAGE_SIZE, db_offset);
+      if (checksum(current, PAGE_SIZE) == dw_header.checksums[i]) {
+        continue;
+      }
+      if (pwrite(pager->file_descriptor, saved, PAGE_SIZE, db_offset) !=
+          PAGE_SIZE) {
+        printf("Error restoring torn page: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      repaired = true;
+    }
+    free(saved);
+    free(current);
+    if (repaired) {
+      pager_sync(pager->file_descriptor);
+      off_t file_length = lseek(pager->file_descriptor, 0, SEEK_END);
+      pager->file_length = file_length;
+    }
+  }
+
+  close(dw_fd);
+  unlink(pager->double_write_path);
+}
+
+// Copy every dirty page into the double-write file with one sequential
+// write and one fsync. After that the in-place writes can tear safely.
+void pager_double_write(Pager* pager, uint32_t num_pages) {
+  DoubleWriteHeader dw_header;
+  memset(&dw_header, 0, sizeof(dw_header));
+  dw_header.magic = DOUBLE_WRITE_MAGIC;
+
+  uint32_t buffer_size = PAGE_SIZE * (num_pages + 1);
+  uint8_t* buffer = malloc(buffer_size);
+  for (uint32_t i = HEADER_PAGES; i < num_pages; i++) {
+    if (pager->pages[i] == NULL || !pager->dirty[i]) {
+      continue;
+    }
+    uint32_t slot = dw_header.num_pages++;
+    dw_header.page_nums[slot] = i;
+    dw_header.checksums[slot] = checksum(pager->pages[i], PAGE_SIZE);
+    memcpy(buffer + (slot + 1) * PAGE_SIZE, pager->pages[i], PAGE_SIZE);
+  }
+
+  if (dw_header.num_pages > 0) {
+    dw_header.header_checksum =
+        checksum(&dw_header, offsetof(DoubleWriteHeader, header_checksum));
+    memset(buffer, 0, PAGE_SIZE);
+    memcpy(buffer, &dw_header, sizeof(dw_header));
+
+    int dw_fd = open(pager->double_write_path, O_RDWR | O_CREAT | O_TRUNC,
+                     S_IWUSR | S_IRUSR);
+    uint32_t size = PAGE_SIZE * (dw_header.num_pages + 1);
+    if (dw_fd == -1 || write(dw_fd, buffer, size) != (ssize_t)size) {
+      printf("Error writing double-write file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager_sync(dw_fd);
+    close(dw_fd);
+  }
+  free(buffer);
+}
+
+Pager* pager_open(const char* filename) {
+  int fd = open(filename,
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->extent_pages = PAGER_DEFAULT_EXTENT_PAGES;
+  pager->double_write_path = malloc(strlen(filename) + 4);
+  sprintf(pager->double_write_path, "%s-dw", filename);
+
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    pager->pages[i] = NULL;
+    pager->dirty[i] = false;
+  }
+  pager->evict_hand = HEADER_PAGES;
+
+  pager_load_header(pager);
+  pager_upgrade_header(pager);
+  pager_recover_torn_pages(pager);
+
+  return pager;
+}
+
+void pager_flush(Pager* pager, uint32_t page_num, uint32_t size) {
+  if (pager->pages[page_num] == NULL) {
+    printf("Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pager_reserve(pager, page_num + 1);
+
+  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+
+  if (offset == -1) {
+    printf("Error seeking: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  ssize_t bytes_written =
+      write(pager->file_descriptor, pager->pages[page_num], size);
+
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+uint8_t art_key_byte(uint32_t id, uint32_t depth) {
+  return (id >> (8 * (ART_KEY_BYTES - 1 - depth))) & 0xFF;
+}
+
+bool art_is_leaf(void* node) { return ((uintptr_t)node & 1) != 0; }
+
+ArtLeaf* art_leaf(void* node) { return (ArtLeaf*)((uintptr_t)node - 1); }
+
+void* art_new_leaf(uint32_t id, uint32_t row_num) {
+  ArtLeaf* leaf = malloc(sizeof(ArtLeaf));
+  leaf->id = id;
+  leaf->num_rows = 1;
+  leaf->allocated = 1;
+  leaf->rows = malloc(sizeof(uint32_t));
+  leaf->rows[0] = row_num;
+  return (void*)((uintptr_t)leaf + 1);
+}
+
+ArtNode* art_new_node(ArtNodeType type) {
+  size_t sizes[] = {sizeof(ArtNode4), sizeof(ArtNode16), sizeof(ArtNode48),
+                    sizeof(ArtNode256)};
+  ArtNode* node = calloc(1, sizes[type]);
+  node->type = type;
+  return node;
+}
+
+// Returns the slot holding the child for key_byte, or NULL.
+void** art_find_child(ArtNode* node, uint8_t key_byte) {
+  switch (node->type) {
+    case (ART_NODE4): {
+      ArtNode4* node4 = (ArtNode4*)node;
+      for (uint32_t i = 0; i < node->num_children; i++) {
+        if (node4->keys[i] == key_byte) {
+          return &(node4->children[i]);
+        }
+      }
+      return NULL;
+    }
+    case (ART_NODE16): {
+      ArtNode16* node16 = (ArtNode16*)node;
+#ifdef __SSE2__
+      // Compare all sixteen keys at once and keep the bits of live slots.
+      __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8((char)key_byte),
+                                       _mm_loadu_si128((__m128i*)node16->keys));
+      uint32_t mask = _mm_movemask_epi8(matches) & ((1u << node->num_children) - 1);
+      return mask ? &(node16->children[__builtin_ctz(mask)]) : NULL;
+#else
+      for (uint32_t i = 0; i < node->num_children; i++) {
+        if (node16->keys[i] == key_byte) {
+          return &(node16->children[i]);
+        }
+      }
+      return NULL;
+#endif
+    }
+    case (ART_NODE48): {
+      ArtNode48* node48 = (ArtNode48*)node;
+      uint8_t index = node48->child_index[key_byte];
+      return index ? &(node48->children[index - 1]) : NULL;
+    }
+    case (ART_NODE256): {
+      ArtNode256* node256 = (ArtNode256*)node;
+      return node256->children[key_byte] ? &(node256->children[key_byte]) : NULL;
+    }
+  }
+  return NULL;
+}
+
+// Inserts into the sorted key and child arrays of a Node4 or Node16.
+void art_add_sorted(uint8_t* keys, void** children, uint32_t num_children,
+                    uint8_t key_byte, void* child) {
+  uint32_t i = 0;
+  while (i < num_children && keys[i] < key_byte) {
+    i++;
+  }
+  memmove(keys + i + 1, keys + i, num_children - i);
+  memmove(children + i + 1, children + i, (num_children - i) * sizeof(void*));
+  keys[i] = key_byte;
+  children[i] = child;
+}
+
+// Adds a child to the node in *ref, replacing it with the next larger
+// node type first if it is full.
+void art_add_child(void** ref, ArtNode* node, uint8_t key_byte, void* child) {
+  switch (node->type) {
+    case (ART_NODE4): {
+      ArtNode4* node4 = (ArtNode4*)node;
+      if (node->num_children < 4) {
+        art_add_sorted(node4->keys, node4->children, node->num_children,
+                       key_byte, child);
+        node->num_children++;
+        return;
+      }
+      ArtNode16* grown = (ArtNode16*)art_new_node(ART_NODE16);
+      grown->node = *node;
+      grown->node.type = ART_NODE16;
+      memcpy(grown->keys, node4->keys, sizeof(node4->keys));
+      memcpy(grown->children, node4->children, sizeof(node4->children));
+      free(node);
+      *ref = grown;
+      art_add_child(ref, &(grown->node), key_byte, child);
+      return;
+    }
+    case (ART_NODE16): {
+      ArtNode16* node16 = (ArtNode16*)node;
+      if (node->num_children < 16) {
+        art_add_sorted(node16->keys, node16->children, node->num_children,
+                       key_byte, child);
+        node->num_children++;
+        return;
+      }
+      ArtNode48* grown = (ArtNode48*)art_new_node(ART_NODE48);
+      grown->node = *node;
+      grown->node.type = ART_NODE48;
+      for (uint32_t i = 0; i < 16; i++) {
+        grown->child_index[node16->keys[i]] = i + 1;
+        grown->children[i] = node16->children[i];
+      }
+      free(node);
+      *ref = grown;
+      art_add_child(ref, &(grown->node), key_byte, child);
+      return;
+    }
+    case (ART_NODE48): {
+      ArtNode48* node48 = (ArtNode48*)node;
+      if (node->num_children < 48) {
+        node48->children[node->num_children] = child;
+        node48->child_index[key_byte] = ++node->num_children;
+        return;
+      }
+      ArtNode256* grown = (ArtNode256*)art_new_node(ART_NODE256);
+      grown->node = *node;
+      grown->node.type = ART_NODE256;
+      for (uint32_t b = 0; b < 256; b++) {
+        if (node48->child_index[b]) {
+          grown->children[b] = node48->children[node48->child_index[b] - 1];
+        }
+      }
+      free(node);
+      *ref = grown;
+      art_add_child(ref, &(grown->node), key_byte, child);
+      return;
+    }
+    case (ART_NODE256):
+      ((ArtNode256*)node)->children[key_byte] = child;
+      node->num_children++;
+      return;
+  }
+}
+
+void art_insert(void** ref, uint32_t id, uint32_t row_num, uint32_t depth) {
+  void* node = *ref;
+  if (node == NULL) {
+    *ref = art_new_leaf(id, row_num);
+    return;
+  }
+
+  if (art_is_leaf(node)) {
+    ArtLeaf* leaf = art_leaf(node);
+    if (leaf->id == id) {
+      if (leaf->num_rows == leaf->allocated) {
+        leaf->allocated *= 2;
+        leaf->rows = realloc(leaf->rows, leaf->allocated * sizeof(uint32_t));
+      }
+      leaf->rows[leaf->num_rows++] = row_num;
+      return;
+    }
+    // Two different ids: branch where they first differ.
+    ArtNode* split = art_new_node(ART_NODE4);
+    while (art_key_byte(leaf->id, depth) == art_key_byte(id, depth)) {
+      split->prefix[split->prefix_length++] = art_key_byte(id, depth);
+      depth++;
+    }
+    *ref = split;
+    art_add_child(ref, split, art_key_byte(leaf->id, depth), node);
+    art_add_child(ref, split, art_key_byte(id, depth), art_new_leaf(id, row_num));
+    return;
+  }
+
+  ArtNode* inner = node;
+  uint32_t matched = 0;
+  while (matched < inner->prefix_length &&
+         inner->prefix[matched] == art_key_byte(id, depth + matched)) {
+    matched++;
+  }
+  if (matched < inner->prefix_length) {
+    // The id leaves the prefix early: put a new node above this one.
+    ArtNode* split = art_new_node(ART_NODE4);
+    memcpy(split->prefix, inner->prefix, matched);
+    split->prefix_length = matched;
+    uint8_t inner_byte = inner->prefix[matched];
+    inner->prefix_length -= matched + 1;
+    memmove(inner->prefix, inner->prefix + matched + 1, inner->prefix_length);
+    *ref = split;
+    art_add_child(ref, split, inner_byte, inner);
+    art_add_child(ref, split, art_key_byte(id, depth + matched),
+                  art_new_leaf(id, row_num));
+    return;
+  }
+
+  depth += inner->prefix_length;
+  void** child = art_find_child(inner, art_key_byte(id, depth));
+  if (child != NULL) {
+    art_insert(child, id, row_num, depth + 1);
+    return;
+  }
+  art_add_child(ref, inner, art_key_byte(id, depth), art_new_leaf(id, row_num));
+}
+
+ArtLeaf* art_lookup(void* node, uint32_t id) {
+  uint32_t depth = 0;
+  while (node != NULL) {
+    if (art_is_leaf(node)) {
+      ArtLeaf* leaf = art_leaf(node);
+      return leaf->id == id ? leaf : NULL;
+    }
+    ArtNode* inner = node;
+    for (uint32_t i = 0; i < inner->prefix_length; i++) {
+      if (inner->prefix[i] != art_key_byte(id, depth + i)) {
+        return NULL;
+      }
+    }
+    depth += inner->prefix_length;
+    void** child = art_find_child(inner, art_key_byte(id, depth));
+    if (child == NULL) {
+      return NULL;
+    }
+    node = *child;
+    depth++;
+  }
+  return NULL;
+}
+
+void art_free(void* node) {
+  if (node == NULL) {
+    return;
+  }
+  if (art_is_leaf(node)) {
+    free(art_leaf(node)->rows);
+    free(art_leaf(node));
+    return;
+  }
+  ArtNode* inner = node;
+  switch (inner->type) {
+    case (ART_NODE4):
+      for (uint32_t i = 0; i < inner->num_children; i++) {
+        art_free(((ArtNode4*)inner)->children[i]);
+      }
+      break;
+    case (ART_NODE16):
+      for (uint32_t i = 0; i < inner->num_children; i++) {
+        art_free(((ArtNode16*)inner)->children[i]);
+      }
+      break;
+    case (ART_NODE48):
+      for (uint32_t i = 0; i < inner->num_children; i++) {
+        art_free(((ArtNode48*)inner)->children[i]);
+      }
+      break;
+    case (ART_NODE256):
+      for (uint32_t b = 0; b < 256; b++) {
+        art_free(((ArtNode256*)inner)->children[b]);
+      }
+      break;
+  }
+  free(inner);
+}
+
+void learned_clear(LearnedIndex* index) {
+  free(index->segments);
+  index->segments = NULL;
+  index->num_segments = 0;
+  index->allocated = 0;
+}
+
+// Extends the model with the next row of a table whose ids are sorted.
+// The last segment keeps the row if some slope still fits every row it
+// covers; otherwise a new segment starts here.
+void learned_add(LearnedIndex* index, uint32_t id, uint32_t row_num) {
+  if (index->num_segments > 0) {
+    LearnedSegment* segment = &(index->segments[index->num_segments - 1]);
+    if (id == segment->first_id) {
+      if (row_num - segment->first_row <= LEARNED_MAX_ERROR) {
+        return;
+      }
+    } else {
+      double distance = (double)id - segment->first_id;
+      double low =
+          ((double)row_num - LEARNED_MAX_ERROR - segment->first_row) / distance;
+      double high =
+          ((double)row_num + LEARNED_MAX_ERROR - segment->first_row) / distance;
+      if (low < segment->slope_low) low = segment->slope_low;
+      if (high > segment->slope_high) high = segment->slope_high;
+      if (low <= high) {
+        segment->slope_low = low;
+        segment->slope_high = high;
+        return;
+      }
+    }
+  }
+
+  if (index->num_segments == index->allocated) {
+    index->allocated = index->allocated ? index->allocated * 2 : 4;
+    index->segments =
+        realloc(index->segments, index->allocated * sizeof(LearnedSegment));
+  }
+  index->segments[index->num_segments++] =
+      (LearnedSegment){id, row_num, 0.0, INFINITY};
+}
+
+uint32_t row_id(Table* table, uint32_t row_num) {
+  Cursor cursor = {table, row_num, false};
+  uint32_t id;
+  memcpy(&id, (uint8_t*)cursor_value(&cursor) + ID_OFFSET, ID_SIZE);
+  return id;
+}
+
+void cracker_free(CrackerColumn* cracker) {
+  if (cracker == NULL) {
+    return;
+  }
+  free(cracker->ids);
+  free(cracker->rows);
+  free(cracker->cracks);
+  free(cracker);
+}
+
+// Adds an entry without disturbing existing cracks: starting from the
+// end, the first entry of each piece above id moves into the hole left
+// at the end of that piece, until the hole reaches id's piece.
+void cracker_ripple(CrackerColumn* cracker, uint32_t id, uint32_t row_num) {
+  if (cracker->count == cracker->allocated) {
+    cracker->allocated = cracker->allocated ? cracker->allocated * 2 : 64;
+    cracker->ids = realloc(cracker->ids, cracker->allocated * sizeof(uint32_t));
+    cracker->rows = realloc(cracker->rows, cracker->allocated * sizeof(uint32_t));
+  }
+  uint32_t hole = cracker->count++;
+  for (uint32_t i = cracker->num_cracks; i > 0 && cracker->cracks[i - 1].pivot > id;
+       i--) {
+    Crack* crack = &(cracker->cracks[i - 1]);
+    cracker->ids[hole] = cracker->ids[crack->position];
+    cracker->rows[hole] = cracker->rows[crack->position];
+    hole = crack->position++;
+  }
+  cracker->ids[hole] = id;
+  cracker->rows[hole] = row_num;
+}
+
+// Brings in rows inserted since the last query.
+void cracker_sync(Table* table) {
+  CrackerColumn* cracker = table->cracker;
+  while (cracker->count < table->num_rows) {
+    uint32_t row_num = cracker->count;
+    cracker_ripple(cracker, row_id(table, row_num), row_num);
+  }
+}
+
+// Returns the position before which every id is below pivot, partitioning
+// the one piece that holds pivot if it is not already a crack.
+uint32_t cracker_crack(CrackerColumn* cracker, uint32_t pivot) {
+  uint32_t i = 0;
+  uint32_t j = cracker->num_cracks;
+  while (i < j) {
+    uint32_t mid = (i + j) / 2;
+    if (cracker->cracks[mid].pivot < pivot) {
+      i = mid + 1;
+    } else {
+      j = mid;
+    }
+  }
+  if (i < cracker->num_cracks && cracker->cracks[i].pivot == pivot) {
+    return cracker->cracks[i].position;
+  }
+
+  uint32_t left = i > 0 ? cracker->cracks[i - 1].position : 0;
+  uint32_t right = i < cracker->num_cracks ? cracker->cracks[i].position
+                                           : cracker->count;
+  while (left < right) {
+    if (cracker->ids[left] < pivot) {
+      left++;
+      continue;
+    }
+    right--;
+    uint32_t id = cracker->ids[left];
+    uint32_t row_num = cracker->rows[left];
+    cracker->ids[left] = cracker->ids[right];
+    cracker->rows[left] = cracker->rows[right];
+    cracker->ids[right] = id;
+    cracker->rows[right] = row_num;
+  }
+
+  if (cracker->num_cracks == cracker->allocated_cracks) {
+    cracker->allocated_cracks =
+        cracker->allocated_cracks ? cracker->allocated_cracks * 2 : 16;
+    cracker->cracks =
+        realloc(cracker->cracks, cracker->allocated_cracks * sizeof(Crack));
+  }
+  memmove(&(cracker->cracks[i + 1]), &(cracker->cracks[i]),
+          (cracker->num_cracks - i) * sizeof(Crack));
+  cracker->cracks[i] = (Crack){pivot, left};
+  cracker->num_cracks++;
+  return left;
+}
+
+// Bounds of the piece holding id, found without partitioning anything.
+void cracker_piece(CrackerColumn* cracker, uint32_t id, uint32_t* left,
+                   uint32_t* right) {
+  uint32_t i = 0;
+  uint32_t j = cracker->num_cracks;
+  while (i < j) {
+    uint32_t mid = (i + j) / 2;
+    if (cracker->cracks[mid].pivot <= id) {
+      i = mid + 1;
+    } else {
+      j = mid;
+    }
+  }
+  *left = i > 0 ? cracker->cracks[i - 1].position : 0;
+  *right = i < cracker->num_cracks ? cracker->cracks[i].position : cracker->count;
+}
+
+// First row with an id of at least key. Rows before the prediction's error
+// window must be smaller and rows after it larger, so only the window is
+// searched.
+uint32_t learned_lower_bound(Table* table, uint32_t key) {
+  LearnedIndex* index = &(table->learned);
+  if (index->num_segments == 0 || key <= index->segments[0].first_id) {
+    return 0;
+  }
+
+  // Last segment starting below key; equal ids may begin in an earlier one.
+  uint32_t low = 0;
+  uint32_t high = index->num_segments;
+  while (high - low > 1) {
+    uint32_t mid = (low + high) / 2;
+    if (index->segments[mid].first_id < key) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  LearnedSegment* segment = &(index->segments[low]);
+  double end = low + 1 < index->num_segments
+                   ? index->segments[low + 1].first_row
+                   : table->num_rows;
+
+  double slope = isinf(segment->slope_high)
+                     ? segment->slope_low
+                     : (segment->slope_low + segment->slope_high) / 2;
+  double predicted =
+      floor(segment->first_row + slope * ((double)key - segment->first_id));
+  if (predicted > end) {
+    predicted = end;  // Past the last id of the segment
+  }
+  double window_start = predicted - LEARNED_MAX_ERROR;
+  double window_end = predicted + LEARNED_MAX_ERROR + 2;
+  uint32_t first = window_start > segment->first_row ? window_start
+                                                     : segment->first_row;
+  uint32_t last = window_end < end ? window_end : end;
+
+  while (first < last) {
+    uint32_t mid = first + (last - first) / 2;
+    if (row_id(table, mid) < key) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
+}
+
+bool roaring_container_contains(RoaringContainer* container, uint16_t low) {
+  if (container->bitset != NULL) {
+    return (container->bitset[low / 64] >> (low % 64)) & 1;
+  }
+  uint32_t first = 0;
+  uint32_t last = container->cardinality;
+  while (first < last) {
+    uint32_t mid = (first + last) / 2;
+    if (container->array[mid] < low) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  return first < container->cardinality && container->array[first] == low;
+}
+
+void roaring_container_to_bitset(RoaringContainer* container) {
+  container->bitset = calloc(ROARING_BITSET_WORDS, sizeof(uint64_t));
+  for (uint32_t i = 0; i < container->cardinality; i++) {
+    uint16_t low = container->array[i];
+    container->bitset[low / 64] |= (uint64_t)1 << (low % 64);
+  }
+  free(container->array);
+  container->array = NULL;
+  container->allocated = 0;
+}
+
+void roaring_add(Roaring* bitmap, uint32_t value) {
+  uint16_t key = value >> 16;
+  uint16_t low = value & 0xFFFF;
+
+  uint32_t i = 0;
+  while (i < bitmap->num_containers && bitmap->containers[i].key < key) {
+    i++;
+  }
+  if (i == bitmap->num_containers || bitmap->containers[i].key != key) {
+    bitmap->containers =
+        realloc(bitmap->containers,
+                (bitmap->num_containers + 1) * sizeof(RoaringContainer));
+    memmove(&(bitmap->containers[i + 1]), &(bitmap->containers[i]),
+            (bitmap->num_containers - i) * sizeof(RoaringContainer));
+    bitmap->containers[i] = (RoaringContainer){key, 0, 0, NULL, NULL};
+    bitmap->num_containers++;
+  }
+
+  RoaringContainer* container = &(bitmap->containers[i]);
+  if (roaring_container_contains(container, low)) {
+    return;
+  }
+  container->cardinality++;
+  if (container->bitset != NULL) {
+    container->bitset[low / 64] |= (uint64_t)1 << (low % 64);
+    return;
+  }
+  if (container->cardinality > container->allocated) {
+    container->allocated = container->allocated ? container->allocated * 2 : 4;
+    container->array =
+        realloc(container->array, container->allocated * sizeof(uint16_t));
+  }
+  // Rows arrive in order, so this is almost always an append.
+  uint32_t position = container->cardinality - 1;
+  while (position > 0 && container->array[position - 1] > low) {
+    container->array[position] = container->array[position - 1];
+    position--;
+  }
+  container->array[position] = low;
+  if (container->cardinality > ROARING_ARRAY_MAX) {
+    roaring_container_to_bitset(container);
+  }
+}
+
+void roaring_free(Roaring* bitmap) {
+  for (uint32_t i = 0; i < bitmap->num_containers; i++) {
+    free(bitmap->containers[i].array);
+    free(bitmap->containers[i].bitset);
+  }
+  free(bitmap->containers);
+  bitmap->containers = NULL;
+  bitmap->num_containers = 0;
+}
+
+uint32_t roaring_cardinality(Roaring* bitmap) {
+  uint32_t cardinality = 0;
+  for (uint32_t i = 0; i < bitmap->num_containers; i++) {
+    cardinality += bitmap->containers[i].cardinality;
+  }
+  return cardinality;
+}
+
+RoaringContainer roaring_container_and(RoaringContainer* left,
+                                       RoaringContainer* right) {
+  RoaringContainer result = {left->key, 0, 0, NULL, NULL};
+  if (left->bitset != NULL && right->bitset != NULL) {
+    result.bitset = malloc(ROARING_BITSET_WORDS * sizeof(uint64_t));
+#ifdef __SSE2__
+    for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w += 2) {
+      __m128i words =
+          _mm_and_si128(_mm_loadu_si128((__m128i*)(left->bitset + w)),
+                        _mm_loadu_si128((__m128i*)(right->bitset + w)));
+      _mm_storeu_si128((__m128i*)(result.bitset + w), words);
+    }
+#else
+    for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w++) {
+      result.bitset[w] = left->bitset[w] & right->bitset[w];
+    }
+#endif
+    for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w++) {
+      result.cardinality += __builtin_popcountll(result.bitset[w]);
+    }
+    if (result.cardinality > ROARING_ARRAY_MAX) {
+      return result;
+    }
+    // Sparse enough to go back to an array.
+    result.allocated = result.cardinality + 1;
+    result.array = malloc(result.allocated * sizeof(uint16_t));
+    uint32_t n = 0;
+    for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w++) {
+      for (uint64_t word = result.bitset[w]; word != 0; word &= word - 1) {
+        result.array[n++] = w * 64 + __builtin_ctzll(word);
+      }
+    }
+    free(result.bitset);
+    result.bitset = NULL;
+    return result;
+  }
+
+  // At least one side is an array, and the result is no larger than it.
+  if (left->bitset != NULL) {
+    RoaringContainer* swap = left;
+    left = right;
+    right = swap;
+  }
+  result.allocated = left->cardinality + 1;
+  result.array = malloc(result.allocated * sizeof(uint16_t));
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < left->cardinality; i++) {
+    uint16_t low = left->array[i];
+    if (right->bitset != NULL) {
+      if (roaring_container_contains(right, low)) {
+        result.array[result.cardinality++] = low;
+      }
+      continue;
+    }
+    while (j < right->cardinality && right->array[j] < low) {
+      j++;
+    }
+    if (j < right->cardinality && right->array[j] == low) {
+      result.array[result.cardinality++] = low;
+    }
+  }
+  return result;
+}
+
+Roaring roaring_and(Roaring* left, Roaring* right) {
+  Roaring result = {NULL, 0};
+  uint32_t i = 0;
+  uint32_t j = 0;
+  while (i < left->num_containers && j < right->num_containers) {
+    RoaringContainer* a = &(left->containers[i]);
+    RoaringContainer* b = &(right->containers[j]);
+    if (a->key < b->key) {
+      i++;
+      continue;
+    }
+    if (a->key > b->key) {
+      j++;
+      continue;
+    }
+    RoaringContainer both = roaring_container_and(a, b);
+    if (both.cardinality > 0) {
+      result.containers =
+          realloc(result.containers,
+                  (result.num_containers + 1) * sizeof(RoaringContainer));
+      result.containers[result.num_containers++] = both;
+    } else {
+      free(both.array);
+      free(both.bitset);
+    }
+    i++;
+    j++;
+  }
+  return result;
+}
+
+// Writes every value in ascending order to values, which must have room
+// for roaring_cardinality(bitmap) entries.
+void roaring_values(Roaring* bitmap, uint32_t* values) {
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < bitmap->num_containers; i++) {
+    RoaringContainer* container = &(bitmap->containers[i]);
+    uint32_t high = (uint32_t)container->key << 16;
+    if (container->bitset == NULL) {
+      for (uint32_t k = 0; k < container->cardinality; k++) {
+        values[n++] = high | container->array[k];
+      }
+      continue;
+    }
+    for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w++) {
+      for (uint64_t word = container->bitset[w]; word != 0; word &= word - 1) {
+        values[n++] = high | (w * 64 + __builtin_ctzll(word));
+      }
+    }
+  }
+}
+
+// Returns the entry for value, or the empty slot where it belongs.
+BitmapEntry* bitmap_index_slot(BitmapIndex* index, const char* value,
+                               size_t length) {
+  uint32_t slot = hash_bytes(value, length) & (index->capacity - 1);
+  while (index->entries[slot].value != NULL &&
+         (strlen(index->entries[slot].value) != length ||
+          memcmp(index->entries[slot].value, value, length) != 0)) {
+    slot = (slot + 1) & (index->capacity - 1);
+  }
+  return &(index->entries[slot]);
+}
+
+Roaring* bitmap_index_find(BitmapIndex* index, const char* value) {
+  if (index->capacity == 0) {
+    return NULL;
+  }
+  BitmapEntry* entry = bitmap_index_slot(index, value, strlen(value));
+  return entry->value != NULL ? &(entry->rows) : NULL;
+}
+
+void bitmap_index_add(BitmapIndex* index, const char* value, size_t length,
+                      uint32_t row_num) {
+  if (2 * (index->num_entries + 1) > index->capacity) {
+    BitmapIndex grown = {NULL, index->num_entries,
+                         index->capacity ? index->capacity * 2 : 16};
+    grown.entries = calloc(grown.capacity, sizeof(BitmapEntry));
+    for (uint32_t i = 0; i < index->capacity; i++) {
+      BitmapEntry* entry = &(index->entries[i]);
+      if (entry->value != NULL) {
+        *bitmap_index_slot(&grown, entry->value, strlen(entry->value)) = *entry;
+      }
+    }
+    free(index->entries);
+    *index = grown;
+  }
+
+  BitmapEntry* entry = bitmap_index_slot(index, value, length);
+  if (entry->value == NULL) {
+    entry->value = strndup(value, length);
+    index->num_entries++;
+  }
+  roaring_add(&(entry->rows), row_num);
+}
+
+void bitmap_index_free(BitmapIndex* index) {
+  for (uint32_t i = 0; i < index->capacity; i++) {
+    if (index->entries[i].value != NULL) {
+      free(index->entries[i].value);
+      roaring_free(&(index->entries[i].rows));
+    }
+  }
+  free(index->entries);
+  *index = (BitmapIndex){NULL, 0, 0};
+}
+
+uint32_t trigram_key(const char* text) {
+  return ((uint32_t)(uint8_t)text[0] << 16) | ((uint32_t)(uint8_t)text[1] << 8) |
+         (uint8_t)text[2];
+}
+
+// Returns the postings for trigram, or the empty slot where they belong.
+TrigramPostings* trigram_slot(TrigramIndex* index, uint32_t trigram) {
+  uint32_t slot = hash_bytes(&trigram, sizeof(trigram)) & (index->capacity - 1);
+  while (index->postings[slot].used && index->postings[slot].trigram != trigram) {
+    slot = (slot + 1) & (index->capacity - 1);
+  }
+  return &(index->postings[slot]);
+}
+
+void trigram_postings_append(TrigramPostings* postings, uint32_t row_num) {
+  if (postings->num_rows > 0 && postings->last_row == row_num) {
+    return;  // Trigram repeats within the row
+  }
+  if (postings->length + 5 > postings->allocated) {
+    postings->allocated = postings->allocated ? postings->allocated * 2 : 8;
+    postings->bytes = realloc(postings->bytes, postings->allocated);
+  }
+  uint32_t delta = postings->num_rows > 0 ? row_num - postings->last_row : row_num;
+  do {
+    uint8_t byte = delta & 0x7F;
+    delta >>= 7;
+    postings->bytes[postings->length++] = byte | (delta ? 0x80 : 0);
+  } while (delta);
+  postings->last_row = row_num;
+  postings->num_rows++;
+}
+
+void trigram_index_add(TrigramIndex* index, const char* text, uint32_t row_num) {
+  size_t length = strlen(text);
+  for (size_t i = 0; i + 3 <= length; i++) {
+    if (2 * (index->num_trigrams + 1) > index->capacity) {
+      TrigramIndex grown = {NULL, index->num_trigrams,
+                            index->capacity ? index->capacity * 2 : 64};
+      grown.postings = calloc(grown.capacity, sizeof(TrigramPostings));
+      for (uint32_t j = 0; j < index->capacity; j++) {
+        if (index->postings[j].used) {
+          *trigram_slot(&grown, index->postings[j].trigram) = index->postings[j];
+        }
+      }
+      free(index->postings);
+      *index = grown;
+    }
+
+    uint32_t trigram = trigram_key(text + i);
+    TrigramPostings* postings = trigram_slot(index, trigram);
+    if (!postings->used) {
+      postings->used = true;
+      postings->trigram = trigram;
+      index->num_trigrams++;
+    }
+    trigram_postings_append(postings, row_num);
+  }
+}
+
+Roaring trigram_postings_decode(TrigramPostings* postings) {
+  Roaring rows = {NULL, 0};
+  uint32_t row_num = 0;
+  uint32_t position = 0;
+  for (uint32_t i = 0; i < postings->num_rows; i++) {
+    uint32_t delta = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+      byte = postings->bytes[position++];
+      delta |= (uint32_t)(byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    row_num = i == 0 ? delta : row_num + delta;
+    roaring_add(&rows, row_num);
+  }
+  return rows;
+}
+
+// Rows whose text holds every trigram of pattern. These are only
+// candidates, since the trigrams may appear apart or in another order.
+Roaring trigram_candidates(TrigramIndex* index, const char* pattern,
+                           uint32_t num_rows) {
+  Roaring candidates = {NULL, 0};
+  size_t length = strlen(pattern);
+  if (length < 3) {
+    for (uint32_t i = 0; i < num_rows; i++) {
+      roaring_add(&candidates, i);
+    }
+    return candidates;
+  }
+
+  for (size_t i = 0; i + 3 <= length; i++) {
+    Roaring rows = {NULL, 0};
+    if (index->capacity > 0) {
+      TrigramPostings* postings = trigram_slot(index, trigram_key(pattern + i));
+      if (postings->used) {
+        rows = trigram_postings_decode(postings);
+      }
+    }
+    if (i == 0) {
+      candidates = rows;
+    } else {
+      Roaring narrowed = roaring_and(&candidates, &rows);
+      roaring_free(&candidates);
+      roaring_free(&rows);
+      candidates = narrowed;
+    }
+    if (candidates.num_containers == 0) {
+      break;
+    }
+  }
+  return candidates;
+}
+
+void trigram_index_free(TrigramIndex* index) {
+  for (uint32_t i = 0; i < index->capacity; i++) {
+    free(index->postings[i].bytes);
+  }
+  free(index->postings);
+  *index = (TrigramIndex){NULL, 0, 0};
+}
+
+char* index_path(const char* filename) {
+  size_t length = strlen(filename) + 16;
+  char* path = malloc(length);
+  snprintf(path, length, "%s-index", filename);
+  return path;
+}
+
+int compare_index_pairs(const void* a, const void* b) {
+  const IndexPair* left = a;
+  const IndexPair* right = b;
+  if (left->id != right->id) {
+    return left->id < right->id ? -1 : 1;
+  }
+  return (left->row_num > right->row_num) - (left->row_num < right->row_num);
+}
+
+IndexPageHeader* index_page_header(uint8_t* page) {
+  return (IndexPageHeader*)page;
+}
+
+IndexPair* index_leaf_pairs(uint8_t* page) {
+  return (IndexPair*)(page + sizeof(IndexPageHeader));
+}
+
+uint32_t* index_children(uint8_t* page) {
+  return (uint32_t*)(page + sizeof(IndexPageHeader));
+}
+
+IndexPair* index_keys(uint8_t* page) {
+  return (IndexPair*)(index_children(page) + INDEX_INTERNAL_MAX + 1);
+}
+
+// Slot of the child of an internal page whose subtree would hold pair.
+uint32_t index_child_slot(uint8_t* page, IndexPair* pair) {
+  IndexPair* keys = index_keys(page);
+  uint32_t first = 0;
+  uint32_t last = index_page_header(page)->num_entries;
+  while (first < last) {
+    uint32_t mid = (first + last) / 2;
+    if (compare_index_pairs(&keys[mid], pair) <= 0) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
+}
+
+// Position of the first pair in a leaf that is not below pair.
+uint32_t index_leaf_position(uint8_t* page, IndexPair* pair) {
+  IndexPair* pairs = index_leaf_pairs(page);
+  uint32_t first = 0;
+  uint32_t last = index_page_header(page)->num_entries;
+  while (first < last) {
+    uint32_t mid = (first + last) / 2;
+    if (compare_index_pairs(&pairs[mid], pair) < 0) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
+}
+
+uint32_t btree_new_page(BTree* btree, bool is_leaf) {
+  uint32_t page_num = btree->meta.num_pages++;
+  if (page_num >= btree->allocated_pages) {
+    btree->allocated_pages = 2 * page_num;
+    btree->pages =
+        realloc(btree->pages, btree->allocated_pages * sizeof(uint8_t*));
+  }
+  btree->pages[page_num] = calloc(1, PAGE_SIZE);
+  index_page_header(btree->pages[page_num])->is_leaf = is_leaf;
+  return page_num;
+}
+
+// Adds separator and the page to its right after slot in an internal
+// page. Returns false if the page has no room.
+bool index_internal_insert(uint8_t* page, uint32_t slot, IndexPair separator,
+                           uint32_t right) {
+  IndexPageHeader* header = index_page_header(page);
+  if (header->num_entries == INDEX_INTERNAL_MAX) {
+    return false;
+  }
+  IndexPair* keys = index_keys(page);
+  uint32_t* children = index_children(page);
+  memmove(&keys[slot + 1], &keys[slot],
+          (header->num_entries - slot) * sizeof(IndexPair));
+  memmove(&children[slot + 2], &children[slot + 1],
+          (header->num_entries - slot) * sizeof(uint32_t));
+  keys[slot] = separator;
+  children[slot + 1] = right;
+  header->num_entries++;
+  return true;
+}
+
+// Inserts into the leaf that pair sorts into. A full page splits in half,
+// and the split moves up the path for as long as parents are full too.
+void btree_insert(BTree* btree, IndexPair pair) {
+  uint32_t path[32];
+  uint32_t slots[32];
+  uint32_t depth = 0;
+  uint32_t page_num = btree->meta.root;
+  while (!index_page_header(btree->pages[page_num])->is_leaf) {
+    uint8_t* page = btree->pages[page_num];
+    path[depth] = page_num;
+    slots[depth] = index_child_slot(page, &pair);
+    page_num = index_children(page)[slots[depth]];
+    depth++;
+  }
+  btree->dirty = true;
+
+  uint8_t* leaf = btree->pages[page_num];
+  IndexPageHeader* header = index_page_header(leaf);
+  IndexPair* pairs = index_leaf_pairs(leaf);
+  uint32_t position = index_leaf_position(leaf, &pair);
+  if (header->num_entries < INDEX_LEAF_MAX) {
+    memmove(&pairs[position + 1], &pairs[position],
+            (header->num_entries - position) * sizeof(IndexPair));
+    pairs[position] = pair;
+    header->num_entries++;
+    return;
+  }
+
+  IndexPair all_pairs[INDEX_LEAF_MAX + 1];
+  memcpy(all_pairs, pairs, position * sizeof(IndexPair));
+  all_pairs[position] = pair;
+  memcpy(&all_pairs[position + 1], &pairs[position],
+         (INDEX_LEAF_MAX - position) * sizeof(IndexPair));
+  uint32_t right_num = btree_new_page(btree, true);
+  uint8_t* right = btree->pages[right_num];
+  uint32_t left_count = (INDEX_LEAF_MAX + 1) / 2;
+  header->num_entries = left_count;
+  memcpy(pairs, all_pairs, left_count * sizeof(IndexPair));
+  index_page_header(right)->num_entries = INDEX_LEAF_MAX + 1 - left_count;
+  memcpy(index_leaf_pairs(right), &all_pairs[left_count],
+         (INDEX_LEAF_MAX + 1 - left_count) * sizeof(IndexPair));
+  index_page_header(right)->next_leaf = header->next_leaf;
+  header->next_leaf = right_num;
+
+  IndexPair separator = all_pairs[left_count];
+  while (depth > 0) {
+    depth--;
+    uint8_t* parent = btree->pages[path[depth]];
+    if (index_internal_insert(parent, slots[depth], separator, right_num)) {
+      return;
+    }
+
+    // Split the parent around its middle key, which moves up a level.
+    IndexPair all_keys[INDEX_INTERNAL_MAX + 1];
+    uint32_t all_children[INDEX_INTERNAL_MAX + 2];
+    uint32_t slot = slots[depth];
+    IndexPair* keys = index_keys(parent);
+    uint32_t* children = index_children(parent);
+    memcpy(all_keys, keys, slot * sizeof(IndexPair));
+    all_keys[slot] = separator;
+    memcpy(&all_keys[slot + 1], &keys[slot],
+           (INDEX_INTERNAL_MAX - slot) * sizeof(IndexPair));
+    memcpy(all_children, children, (slot + 1) * sizeof(uint32_t));
+    all_children[slot + 1] = right_num;
+    memcpy(&all_children[slot + 2], &children[slot + 1],
+           (INDEX_INTERNAL_MAX - slot) * sizeof(uint32_t));
+
+    uint32_t left_keys = (INDEX_INTERNAL_MAX + 1) / 2;
+    uint32_t right_keys = INDEX_INTERNAL_MAX - left_keys;
+    right_num = btree_new_page(btree, false);
+    right = btree->pages[right_num];
+    index_page_header(parent)->num_entries = left_keys;
+    memcpy(keys, all_keys, left_keys * sizeof(IndexPair));
+    memcpy(children, all_children, (left_keys + 1) * sizeof(uint32_t));
+    index_page_header(right)->num_entries = right_keys;
+    memcpy(index_keys(right), &all_keys[left_keys + 1],
+           right_keys * sizeof(IndexPair));
+    memcpy(index_children(right), &all_children[left_keys + 1],
+           (right_keys + 1) * sizeof(uint32_t));
+    separator = all_keys[left_keys];
+  }
+
+  // The root itself split, so the tree grows a level.
+  uint32_t root_num = btree_new_page(btree, false);
+  uint8_t* root = btree->pages[root_num];
+  index_children(root)[0] = btree->meta.root;
+  index_keys(root)[0] = separator;
+  index_children(root)[1] = right_num;
+  index_page_header(root)->num_entries = 1;
+  btree->meta.root = root_num;
+  btree->meta.height++;
+}
+
+// Rows holding an id in [min_id, max_id], found by descending to the
+// first leaf in range and following the leaf links.
+Roaring btree_range(BTree* btree, uint32_t min_id, uint32_t max_id) {
+  Roaring rows = {NULL, 0};
+  if (min_id > max_id) {
+    return rows;
+  }
+  IndexPair start = {min_id, 0};
+  uint8_t* page = btree->pages[btree->meta.root];
+  while (!index_page_header(page)->is_leaf) {
+    page = btree->pages[index_children(page)[index_child_slot(page, &start)]];
+  }
+
+  // Ids come out sorted but rows do not, so sort them before adding.
+  uint32_t count = 0;
+  uint32_t allocated = 64;
+  uint32_t* row_nums = malloc(allocated * sizeof(uint32_t));
+  uint32_t i = index_leaf_position(page, &start);
+  while (true) {
+    IndexPageHeader* header = index_page_header(page);
+    IndexPair* pairs = index_leaf_pairs(page);
+    for (; i < header->num_entries && pairs[i].id <= max_id; i++) {
+      if (count == allocated) {
+        allocated *= 2;
+        row_nums = realloc(row_nums, allocated * sizeof(uint32_t));
+      }
+      row_nums[count++] = pairs[i].row_num;
+    }
+    if (i < header->num_entries || header->next_leaf == 0) {
+      break;
+    }
+    page = btree->pages[header->next_leaf];
+    i = 0;
+  }
+  qsort(row_nums, count, sizeof(uint32_t), compare_ids);
+  for (uint32_t j = 0; j < count; j++) {
+    roaring_add(&rows, row_nums[j]);
+  }
+  free(row_nums);
+  return rows;
+}
+
+void btree_free(BTree* btree) {
+  if (btree == NULL) {
+    return;
+  }
+  for (uint32_t i = 1; i < btree->meta.num_pages; i++) {
+    free(btree->pages[i]);
+  }
+  free(btree->pages);
+  free(btree->path);
+  free(btree);
+}
+
+// Reads the whole index file, or returns NULL if there is none.
+BTree* btree_load(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  BTree* btree = calloc(1, sizeof(BTree));
+  if (pread(fd, &(btree->meta), sizeof(IndexMeta), 0) != sizeof(IndexMeta) ||
+      btree->meta.magic != INDEX_FILE_MAGIC || btree->meta.root == 0 ||
+      btree->meta.root >= btree->meta.num_pages) {
+    printf("Ignoring unreadable index file\n");
+    free(btree);
+    close(fd);
+    return NULL;
+  }
+  btree->path = strdup(path);
+  btree->allocated_pages = btree->meta.num_pages;
+  btree->pages = calloc(btree->allocated_pages, sizeof(uint8_t*));
+  for (uint32_t i = 1; i < btree->meta.num_pages; i++) {
+    btree->pages[i] = malloc(PAGE_SIZE);
+    if (pread(fd, btree->pages[i], PAGE_SIZE, (off_t)i * PAGE_SIZE) !=
+        (ssize_t)PAGE_SIZE) {
+      printf("Ignoring unreadable index file\n");
+      btree->meta.num_pages = i + 1;
+      btree_free(btree);
+      close(fd);
+      return NULL;
+    }
+  }
+  close(fd);
+  return btree;
+}
+
+// Rewrites the index beside the old file and renames it into place, so a
+// crash leaves either the old index or the new one.
+void btree_save(BTree* btree) {
+  size_t length = strlen(btree->path) + 8;
+  char* temp_path = malloc(length);
+  snprintf(temp_path, length, "%s-tmp", btree->path);
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  bool written = fd != -1;
+
+  uint8_t meta_page[PAGE_SIZE];
+  memset(meta_page, 0, PAGE_SIZE);
+  memcpy(meta_page, &(btree->meta), sizeof(IndexMeta));
+  written = written && write(fd, meta_page, PAGE_SIZE) == (ssize_t)PAGE_SIZE;
+  for (uint32_t i = 1; written && i < btree->meta.num_pages; i++) {
+    written = write(fd, btree->pages[i], PAGE_SIZE) == (ssize_t)PAGE_SIZE;
+  }
+  if (written) {
+    pager_sync(fd);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (!written || rename(temp_path, btree->path) == -1) {
+    printf("Error writing index: %d\n", errno);
+    unlink(temp_path);
+  }
+  free(temp_path);
+  btree->dirty = false;
+}
+
+// Keeps the in-memory indexes up to date with a newly added row.
+void table_index_row(Table* table, Row* row, uint32_t row_num) {
+  art_insert(&(table->id_index), row->id, row_num, 0);
+  if (table->pager->header.ids_sorted) {
+    learned_add(&(table->learned), row->id, row_num);
+  } else if (table->learned.num_segments > 0) {
+    learned_clear(&(table->learned));
+  }
+  const char* domain = row_email_domain(row);
+  bitmap_index_add(&(table->domain_index), domain, strlen(domain), row_num);
+  bitmap_index_add(&(table->tenant_index), row->username,
+                   row_tenant_length(row), row_num);
+  trigram_index_add(&(table->username_trigrams), row->username, row_num);
+  trigram_index_add(&(table->email_trigrams), row->email, row_num);
+  if (table->btree != NULL) {
+    btree_insert(table->btree, (IndexPair){row->id, row_num});
+    table->btree->meta.indexed_rows = row_num + 1;
+  }
+}
+
+
+int64_t now_micros() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Reads record seq into header and row_bytes. Returns false past the end
+// of the log or if the record is incomplete or corrupt.
+bool change_log_read(int fd, uint64_t seq, ChangeRecordHeader* header,
+                     void* row_bytes) {
+  uint8_t record[CHANGE_RECORD_SIZE];
+  off_t offset = (off_t)(seq - 1) * CHANGE_RECORD_SIZE;
+  if (seq == 0 ||
+      pread(fd, record, CHANGE_RECORD_SIZE, offset) != CHANGE_RECORD_SIZE) {
+    return false;
+  }
+  memcpy(header, record, sizeof(ChangeRecordHeader));
+  memcpy(row_bytes, record + sizeof(ChangeRecordHeader), ROW_SIZE);
+  return header->seq == seq && header->checksum == checksum(row_bytes, ROW_SIZE);
+}
+
+uint64_t change_log_length(int fd) {
+  return lseek(fd, 0, SEEK_END) / CHANGE_RECORD_SIZE;
+}
+
+// Returns seq, or the first record after it if seq falls in the zeroed
+// hole at the start of a restored log. Never skips the last record, which
+// may still be being written.
+uint64_t change_log_skip_hole(int fd, uint64_t seq) {
+  ChangeRecordHeader header;
+  uint8_t row_bytes[ROW_SIZE];
+  uint64_t length = change_log_length(fd);
+  while (seq > 0 && seq < length &&
+         !change_log_read(fd, seq, &header, row_bytes) && header.seq == 0) {
+    seq++;
+  }
+  return seq;
+}
+
+// base_seq is the last change already in the table's pages. A restored
+// log starts after its base backup, with a hole where the older records
+// would be, so records up to base_seq may not be readable.
+ChangeLog* change_log_open(const char* filename, uint64_t base_seq) {
+  ChangeLog* log = malloc(sizeof(ChangeLog));
+  log->path = malloc(strlen(filename) + 9);
+  sprintf(log->path, "%s-changes", filename);
+  log->feed_socket = -1;
+  log->feed_path = NULL;
+
+  log->file_descriptor = open(log->path, O_RDWR | O_CREAT | O_APPEND,
+                              S_IWUSR | S_IRUSR);
+  if (log->file_descriptor == -1) {
+    printf("Unable to open change log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Drop a record torn by a crash mid-append.
+  off_t length = lseek(log->file_descriptor, 0, SEEK_END);
+  uint64_t count = length / CHANGE_RECORD_SIZE;
+  ChangeRecordHeader header;
+  uint8_t row_bytes[ROW_SIZE];
+  if (count > base_seq &&
+      !change_log_read(log->file_descriptor, count, &header, row_bytes)) {
+    count--;
+  }
+  if ((off_t)(count * CHANGE_RECORD_SIZE) != length &&
+      ftruncate(log->file_descriptor, count * CHANGE_RECORD_SIZE) == -1) {
+    printf("Error truncating change log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  log->next_seq = count + 1;
+
+  return log;
+}
+
+// Appends count consecutive records that already carry their sequence
+// numbers.
+void change_log_write(ChangeLog* log, uint8_t* records, uint32_t count) {
+  ssize_t length = (ssize_t)count * CHANGE_RECORD_SIZE;
+  if (write(log->file_descriptor, records, length) != length) {
+    printf("Error writing change log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  log->next_seq += count;
+}
+
+// header->seq must be the log's next sequence number.
+void change_log_append_record(ChangeLog* log, ChangeRecordHeader* header,
+                              void* row_bytes) {
+  uint8_t record[CHANGE_RECORD_SIZE];
+  memcpy(record, header, sizeof(ChangeRecordHeader));
+  memcpy(record + sizeof(ChangeRecordHeader), row_bytes, ROW_SIZE);
+  change_log_write(log, record, 1);
+}
+
+uint64_t change_log_append(ChangeLog* log, uint32_t row_num, void* row_bytes) {
+  ChangeRecordHeader header;
+  header.seq = log->next_seq;
+  header.timestamp = now_micros();
+  header.row_num = row_num;
+  header.checksum = checksum(row_bytes, ROW_SIZE);
+  change_log_append_record(log, &header, row_bytes);
+  return header.seq;
+}
+
+// Returns false if the change is not the next row of the table.
+bool table_apply_change(Table* table, ChangeRecordHeader* header,
+                        void* row_bytes) {
+  if (header->row_num != table->num_rows || header->row_num >= TABLE_MAX_ROWS) {
+    return false;
+  }
+  Cursor* cursor = table_end(table);
+  memcpy(cursor_value(cursor), row_bytes, ROW_SIZE);
+  table->pager->dirty[cursor_page_num(cursor)] = true;
+  Row row;
+  deserialize_row(row_bytes, &row);
+  header_note_insert(&(table->pager->header), cursor, row.id);
+  table_index_row(table, &row, cursor->row_num);
+  table->num_rows += 1;
+  free(cursor);
+  return true;
+}
+
+// Rows for one redo thread to copy into the pages it owns.
+typedef struct {
+  Pager* pager;
+  uint8_t* rows;  // Serialized rows, one per table row from first_row on
+  uint32_t first_row;
+  uint32_t num_rows;
+} RedoWork;
+
+void* redo_pages(void* arg) {
+  RedoWork* work = arg;
+  for (uint32_t i = 0; i < work->num_rows; i++) {
+    uint32_t row_num = work->first_row + i;
+    uint8_t* page = work->pager->pages[HEADER_PAGES + row_num / ROWS_PER_PAGE];
+    memcpy(page + (row_num % ROWS_PER_PAGE) * ROW_SIZE, work->rows + i * ROW_SIZE,
+           ROW_SIZE);
+  }
+  return NULL;
+}
+
+// Re-apply inserts that reached the change log but not the database file
+// before the last run ended.
+void change_log_replay(Table* table) {
+  ChangeLog* log = table->changes;
+  Pager* pager = table->pager;
+  ChangeRecordHeader header;
+  uint64_t available = log->next_seq - 1 - pager->header.change_seq;
+  if (pager->header.change_seq >= log->next_seq - 1) {
+    return;
+  }
+  if (available > TABLE_MAX_ROWS) {
+    available = TABLE_MAX_ROWS;
+  }
+
+  // Collect the records that extend the table without a gap.
+  uint8_t* rows = malloc(available * ROW_SIZE);
+  uint32_t first_row = table->num_rows;
+  uint32_t count = 0;
+  for (uint64_t seq = pager->header.change_seq + 1; seq < log->next_seq; seq++) {
+    if (first_row + count >= TABLE_MAX_ROWS ||
+        !change_log_read(log->file_descriptor, seq, &header,
+                         rows + count * ROW_SIZE)) {
+      break;
+    }
+    if (header.row_num < first_row + count) {
+      continue;  // Already in the pages
+    }
+    if (header.row_num != first_row + count) {
+      break;
+    }
+    count++;
+  }
+
+  // Reads go through the single file descriptor, so fault pages in first.
+  for (uint32_t i = 0; i < count; i++) {
+    get_page(pager, HEADER_PAGES + (first_row + i) / ROWS_PER_PAGE);
+  }
+
+  // The rows are consecutive, so each thread takes a run of whole pages
+  // and the rows that fall on them; no two threads write the same page.
+  RedoWork work[REDO_THREADS];
+  pthread_t threads[REDO_THREADS];
+  uint32_t first_page = first_row / ROWS_PER_PAGE;
+  uint32_t num_pages =
+      count == 0 ? 0 : (first_row + count - 1) / ROWS_PER_PAGE - first_page + 1;
+  uint32_t next_row = first_row;
+  for (uint32_t t = 0; t < REDO_THREADS; t++) {
+    uint32_t end_page = first_page + num_pages * (t + 1) / REDO_THREADS;
+    uint32_t end_row = t == REDO_THREADS - 1 ? first_row + count
+                                             : end_page * ROWS_PER_PAGE;
+    if (end_row < next_row) {
+      end_row = next_row;
+    }
+    work[t] = (RedoWork){pager, rows + (size_t)(next_row - first_row) * ROW_SIZE,
+                         next_row, end_row - next_row};
+    next_row = end_row;
+    pthread_create(&threads[t], NULL, redo_pages, &work[t]);
+  }
+  for (uint32_t t = 0; t < REDO_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  Row row;
+  for (uint32_t i = 0; i < count; i++) {
+    Cursor* cursor = table_end(table);
+    pager->dirty[cursor_page_num(cursor)] = true;
+    deserialize_row(rows + i * ROW_SIZE, &row);
+    header_note_insert(&(pager->header), cursor, row.id);
+    table->num_rows += 1;
+    free(cursor);
+  }
+  free(rows);
+}
+
+// Archived segments are named changes-<first seq>-<last seq>, zero padded
+// so that name order is sequence order.
+uint64_t archive_last_seq(const char* dir) {
+  DIR* directory = opendir(dir);
+  if (directory == NULL) {
+    return 0;
+  }
+  uint64_t last = 0;
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    unsigned long first_seq, last_seq;
+    if (sscanf(entry->d_name, "changes-%lu-%lu", &first_seq, &last_seq) == 2 &&
+        last_seq > last) {
+      last = last_seq;
+    }
+  }
+  closedir(directory);
+  return last;
+}
+
+// Copies the change log records that are not yet archived into a new
+// segment in dir.
+bool change_log_archive(ChangeLog* log, const char* dir) {
+  uint64_t first = archive_last_seq(dir) + 1;
+  uint64_t last = log->next_seq - 1;
+  first = change_log_skip_hole(log->file_descriptor, first);
+  if (first > last) {
+    return true;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/changes-%020lu-%020lu", dir,
+           (unsigned long)first, (unsigned long)last);
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    return false;
+  }
+
+  size_t length = (last - first + 1) * CHANGE_RECORD_SIZE;
+  uint8_t* records = malloc(length);
+  bool copied =
+      pread(log->file_descriptor, records, length,
+            (off_t)(first - 1) * CHANGE_RECORD_SIZE) == (ssize_t)length &&
+      write(fd, records, length) == (ssize_t)length && fsync(fd) == 0;
+  free(records);
+  close(fd);
+  if (!copied) {
+    unlink(path);
+  }
+  return copied;
+}
+
+
+bool replica_attach(Table* table, const char* primary_filename) {
+  char* path = malloc(strlen(primary_filename) + 9);
+  sprintf(path, "%s-changes", primary_filename);
+  table->upstream_changes = open(path, O_RDONLY);
+  free(path);
+  return table->upstream_changes != -1;
+}
+
+// Apply everything the primary has logged since this replica last caught
+// up. The replica logs each change under the same sequence number, so its
+// own log can replay them after a crash or feed a replica of its own.
+void replica_catch_up(Table* table) {
+  ChangeLog* log = table->changes;
+  ChangeRecordHeader header;
+  uint8_t row_bytes[ROW_SIZE];
+
+  while (change_log_read(table->upstream_changes, log->next_seq, &header,
+                         row_bytes)) {
+    if (!table_apply_change(table, &header, row_bytes)) {
+      printf("Replica has diverged from primary at change %lu.\n",
+             (unsigned long)header.seq);
+      return;
+    }
+    change_log_append_record(log, &header, row_bytes);
+  }
+}
+
+void print_changes_since(ChangeLog* log, uint64_t since) {
+  ChangeRecordHeader header;
+  uint8_t row_bytes[ROW_SIZE];
+  Row row;
+  for (uint64_t seq = change_log_skip_hole(log->file_descriptor, since + 1);
+       change_log_read(log->file_descriptor, seq, &header, row_bytes); seq++) {
+    deserialize_row(row_bytes, &row);
+    print_change(stdout, seq, &row);
+  }
+}
+
+typedef struct {
+  int connection;
+  char* log_path;
+} ChangeFeedClient;
+
+// Serves one follower: reads "since N", sends every later record, then
+// keeps polling the log for new ones until the follower hangs up.
+void* change_feed_serve(void* arg) {
+  ChangeFeedClient* client = arg;
+  FILE* stream = fdopen(client->connection, "r+");
+  int log_fd = open(client->log_path, O_RDONLY);
+  char request[64];
+  unsigned long since;
+
+  if (stream != NULL && log_fd != -1 && fgets(request, sizeof(request), stream) &&
+      sscanf(request, "since %lu", &since) == 1) {
+    ChangeRecordHeader header;
+    uint8_t row_bytes[ROW_SIZE];
+    Row row;
+    uint64_t seq = change_log_skip_hole(log_fd, since + 1);
+    while (true) {
+      if (change_log_read(log_fd, seq, &header, row_bytes)) {
+        deserialize_row(row_bytes, &row);
+        print_change(stream, seq, &row);
+        seq++;
+        continue;
+      }
+      if (fflush(stream) == EOF) {
+        break;
+      }
+      struct pollfd hangup = {client->connection, POLLIN, 0};
+      if (poll(&hangup, 1, 50) > 0) {
+        char byte;
+        if (recv(client->connection, &byte, 1, MSG_DONTWAIT) <= 0) {
+          break;
+        }
+      }
+    }
+  }
+
+  if (log_fd != -1) {
+    close(log_fd);
+  }
+  if (stream != NULL) {
+    fclose(stream);
+  } else {
+    close(client->connection);
+  }
+  free(client->log_path);
+  free(client);
+  return NULL;
+}
+
+void* change_feed_listen(void* arg) {
+  ChangeLog* log = arg;
+  while (true) {
+    int connection = accept(log->feed_socket, NULL, NULL);
+    if (connection == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
+    }
+    ChangeFeedClient* client = malloc(sizeof(ChangeFeedClient));
+    client->connection = connection;
+    // Followers can outlive the log, so each keeps its own copy.
+    client->log_path = strdup(log->path);
+    pthread_t thread;
+    pthread_create(&thread, NULL, change_feed_serve, client);
+    pthread_detach(thread);
+  }
+}
+
+bool change_feed_start(ChangeLog* log, const char* socket_path) {
+  struct sockaddr_un address;
+  if (log->feed_socket != -1 || strlen(socket_path) >= sizeof(address.sun_path)) {
+    return false;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+      listen(fd, 16) == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  // A follower hanging up mid-write must not kill the database.
+  signal(SIGPIPE, SIG_IGN);
+  log->feed_socket = fd;
+  log->feed_path = strdup(socket_path);
+  pthread_create(&(log->feed_thread), NULL, change_feed_listen, log);
+  return true;
+}
+
+void change_log_close(ChangeLog* log) {
+  if (log->feed_socket != -1) {
+    // Wake the accept thread and wait for it before the socket goes away.
+    shutdown(log->feed_socket, SHUT_RDWR);
+    pthread_join(log->feed_thread, NULL);
+    close(log->feed_socket);
+    unlink(log->feed_path);
+    free(log->feed_path);
+  }
+  close(log->file_descriptor);
+  free(log->path);
+  free(log);
+}
+
+void db_close(Table* table) {
+  if (table->raft != NULL) {
+    raft_stop(table->raft);
+    table->raft = NULL;
+  }
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    db_close(table->partitions[i]);
+  }
+  Pager* pager = table->pager;
+  uint32_t num_pages =
+      HEADER_PAGES + (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+
+  // Reserve everything up front so the flushes below never grow the file.
+  // The header records the logical size, so the last page is written whole.
+  pager_reserve(pager, num_pages);
+  pager_double_write(pager, num_pages);
+  for (uint32_t i = HEADER_PAGES; i < num_pages; i++) {
+    if (pager->pages[i] == NULL) {
+      continue;
+    }
+    if (pager->dirty[i]) {
+      pager_flush(pager, i, PAGE_SIZE);
+      pager->dirty[i] = false;
+    }
+    pager_release_page(pager, i);
+  }
+
+  pager->header.num_rows = table->num_rows;
+  pager->header.num_pages = num_pages;
+  pager->header.change_seq = table->changes->next_seq - 1;
+  pager_write_header(pager);
+  pager_sync(pager->file_descriptor);
+  unlink(pager->double_write_path);
+
+  if (table->btree != NULL && table->btree->dirty) {
+    btree_save(table->btree);
+  }
+
+  if (table->archive_dir != NULL &&
+      !change_log_archive(table->changes, table->archive_dir)) {
+    printf("Error archiving change log: %d\n", errno);
+  }
+
+  table_release(table);
+}
+
+// Frees a table and closes its files without writing anything back.
+void table_release(Table* table) {
+  Pager* pager = table->pager;
+  int result = close(pager->file_descriptor);
   if (result == -1) {
     printf("Error closing db file.\n");
     exit(EXIT_FAILURE);
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    if (pager->pages[i] != NULL) {
+      pager_release_page(pager, i);
+    }
+  }
+  free(pager->double_write_path);
+  free(pager);
+  art_free(table->id_index);
+  learned_clear(&(table->learned));
+  bitmap_index_free(&(table->domain_index));
+  bitmap_index_free(&(table->tenant_index));
+  trigram_index_free(&(table->username_trigrams));
+  trigram_index_free(&(table->email_trigrams));
+  cracker_free(table->cracker);
+  btree_free(table->btree);
+  change_log_close(table->changes);
+  if (table->upstream_changes != -1) {
+    close(table->upstream_changes);
+  }
+  free(table->archive_dir);
+  free(table->filename);
+  free(table->partitions);
+  free(table->partition_numbers);
+  free(table);
+}
+
+
+Table* db_open(const char* filename) {
+    Pager* pager = pager_open(filename);
+    uint32_t num_rows = pager->header.num_rows;
+    Table* table = (Table*)malloc(sizeof(Table));
+    table->pager = pager;
+    table->num_rows = num_rows;
+    table->changes = change_log_open(filename, pager->header.change_seq);
+    table->upstream_changes = -1;
+    table->raft = NULL;
+    table->archive_dir = NULL;
+    change_log_replay(table);
+
+    table->id_index = NULL;
+    table->learned = (LearnedIndex){NULL, 0, 0};
+    table->domain_index = (BitmapIndex){NULL, 0, 0};
+    table->tenant_index = (BitmapIndex){NULL, 0, 0};
+    table->username_trigrams = (TrigramIndex){NULL, 0, 0};
+    table->email_trigrams = (TrigramIndex){NULL, 0, 0};
+    table->cracker = NULL;
+    table->btree = NULL;
+    table->filename = strdup(filename);
+    table->partitions = NULL;
+    table->partition_numbers = NULL;
+    table->num_partitions = 0;
+    table->allocated_partitions = 0;
+    Cursor* cursor = table_start(table);
+    Row row;
+    while (!(cursor->end_of_table)) {
+      deserialize_row(cursor_value(cursor), &row);
+      table_index_row(table, &row, cursor->row_num);
+      cursor_advance(cursor);
+    }
+    free(cursor);
+    btree_open(table);
+
+    if (pager->header.partition_size > 0) {
+      partitions_load(table);
+    }
+    return table;
+}
+
+// Writes a self-contained copy of the table as it is right now. Its header
+// records the last change included, so a restore knows where to resume.
+bool db_backup(Table* table, const char* path) {
+  Pager* pager = table->pager;
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    return false;
+  }
+
+  uint32_t num_pages =
+      HEADER_PAGES + (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+  FileHeader header = pager->header;
+  header.num_rows = table->num_rows;
+  header.num_pages = num_pages;
+  header.allocated_pages = num_pages;
+  header.change_seq = table->changes->next_seq - 1;
+
+  bool written = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 ftruncate(fd, (off_t)num_pages * PAGE_SIZE) == 0;
+  for (uint32_t i = HEADER_PAGES; written && i < num_pages; i++) {
+    written = pwrite(fd, get_page(pager, i), PAGE_SIZE,
+                     (off_t)i * PAGE_SIZE) == PAGE_SIZE;
+  }
+  written = written && fsync(fd) == 0;
+  close(fd);
+  if (!written) {
+    unlink(path);
+  }
+  return written;
+}
+
+int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Rebuilds filename from a base backup plus archived change log segments,
+// stopping after until_seq or before the first change newer than
+// until_time (microseconds since the epoch).
+bool db_restore(const char* filename, const char* base, const char* archive_dir,
+                uint64_t until_seq, int64_t until_time) {
+  int base_fd = open(base, O_RDONLY);
+  int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR);
+  FileHeader base_header;
+  if (base_fd == -1 || fd == -1 ||
+      pread(base_fd, &base_header, sizeof(base_header), 0) != sizeof(base_header)) {
+    printf("Unable to create restore target from base backup\n");
+    return false;
+  }
+  uint8_t buffer[PAGE_SIZE];
+  ssize_t bytes_read;
+  while ((bytes_read = read(base_fd, buffer, PAGE_SIZE)) > 0) {
+    if (write(fd, buffer, bytes_read) != bytes_read) {
+      printf("Error copying base backup: %d\n", errno);
+      return false;
+    }
+  }
+  close(base_fd);
+  close(fd);
+
+  DIR* directory = opendir(archive_dir);
+  if (directory == NULL) {
+    printf("Unable to open archive directory\n");
+    return false;
+  }
+  char** segments = NULL;
+  uint32_t num_segments = 0;
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (strncmp(entry->d_name, "changes-", 8) == 0) {
+      segments = realloc(segments, (num_segments + 1) * sizeof(char*));
+      segments[num_segments++] = strdup(entry->d_name);
+    }
+  }
+  closedir(directory);
+  qsort(segments, num_segments, sizeof(char*), compare_names);
+
+  // The restored change log starts right after the base backup and holds
+  // the archived history from there to the target, so opening the table
+  // replays whatever the base backup lacks. Older records are a hole.
+  char* log_path = malloc(strlen(filename) + 9);
+  sprintf(log_path, "%s-changes", filename);
+  int log_fd = open(log_path, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR);
+  free(log_path);
+  if (log_fd == -1 ||
+      ftruncate(log_fd, (off_t)base_header.change_seq * CHANGE_RECORD_SIZE) == -1) {
+    printf("Unable to create restored change log\n");
+    return false;
+  }
+  close(log_fd);
+  ChangeLog* log = change_log_open(filename, base_header.change_seq);
+  ChangeRecordHeader header;
+  uint8_t row_bytes[ROW_SIZE];
+  bool done = false;
+  for (uint32_t i = 0; i < num_segments; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", archive_dir, segments[i]);
+    int segment_fd = open(path, O_RDONLY);
+    unsigned long first_seq = 0;
+    sscanf(segments[i], "changes-%lu-", &first_seq);
+    for (uint64_t seq = first_seq; !done && segment_fd != -1; seq++) {
+      off_t offset = (off_t)(seq - first_seq) * CHANGE_RECORD_SIZE;
+      uint8_t record[CHANGE_RECORD_SIZE];
+      if (pread(segment_fd, record, CHANGE_RECORD_SIZE, offset) !=
+          CHANGE_RECORD_SIZE) {
+        break;
+      }
+      memcpy(&header, record, sizeof(header));
+      memcpy(row_bytes, record + sizeof(header), ROW_SIZE);
+      if (header.seq < log->next_seq) {
+        continue;
+      }
+      if (header.seq > until_seq || header.timestamp > until_time ||
+          header.seq != log->next_seq ||
+          header.checksum != checksum(row_bytes, ROW_SIZE)) {
+        done = true;
+        break;
+      }
+      change_log_append_record(log, &header, row_bytes);
+    }
+    if (segment_fd != -1) {
+      close(segment_fd);
+    }
+    free(segments[i]);
+  }
+  free(segments);
+  pager_sync(log->file_descriptor);
+  uint64_t restored_seq = log->next_seq - 1;
+  change_log_close(log);
+
+  Table* table = db_open(filename);
+  printf("Restored through change %lu, %d rows.\n", (unsigned long)restored_seq,
+         table->num_rows);
+  db_close(table);
+  return true;
+}
+
+void free_table(Table* table) {
+  for (int i = 0; table->pager->pages[i]; i++) {
+     free(table->pager->pages[i]);
+  }
+  free(table->pager);
+  free(table);
+}
+
+InputBuffer* new_input_buffer() {
+  InputBuffer* input_buffer = (InputBuffer*)malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+  input_buffer->charged = 0;
+  return input_buffer;
+}
+
+// Brings the connection's charge up to date after reads grew the buffer.
+void input_buffer_account(InputBuffer* input_buffer) {
+  size_t size = sizeof(InputBuffer) + input_buffer->buffer_length;
+  memory_charge(MEMORY_CONNECTION, size - input_buffer->charged);
+  input_buffer->charged = size;
+}
+
+void close_input_buffer(InputBuffer* input_buffer) {
+  memory_release(MEMORY_CONNECTION, input_buffer->charged);
+  free(input_buffer->buffer);
+  free(input_buffer);
+}
+
+// Parses a whole, unsigned decimal number no larger than max. Signs,
+// blanks and trailing text are rejected rather than read as 0 or cut off.
+bool parse_number(const char* text, uint64_t max, uint64_t* value) {
+  if (text[0] < '0' || text[0] > '9') {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  uint64_t number = strtoull(text, &end, 10);
+  if (*end != '\0' || errno == ERANGE || number > max) {
+    return false;
+  }
+  *value = number;
+  return true;
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Session* session) {
+  Table* table = session->table;
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  } else if (strncmp(input_buffer->buffer, ".extent ", 8) == 0) {
+    int extent_pages = atoi(input_buffer->buffer + 8);
+    if (extent_pages < 1) {
+      printf("Extent must be at least one page.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    table->pager->extent_pages = extent_pages;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".raft") == 0) {
+    if (table->raft == NULL) {
+      printf("Not a cluster node.\n");
+    } else {
+      print_raft_status(table->raft);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".archive ", 9) == 0) {
+    free(table->archive_dir);
+    table->archive_dir = strdup(input_buffer->buffer + 9);
+    if (!change_log_archive(table->changes, table->archive_dir)) {
+      printf("Error archiving change log: %d\n", errno);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".backup ", 8) == 0) {
+    if (!db_backup(table, input_buffer->buffer + 8)) {
+      printf("Error writing backup: %d\n", errno);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".crack on") == 0) {
+    if (table->cracker == NULL) {
+      table->cracker = calloc(1, sizeof(CrackerColumn));
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".crack off") == 0) {
+    cracker_free(table->cracker);
+    table->cracker = NULL;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".crack") == 0) {
+    if (table->cracker == NULL) {
+      printf("Cracking off.\n");
+    } else {
+      printf("Cracks: %d over %d rows\n", table->cracker->num_cracks,
+             table->cracker->count);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+    import_file(table, input_buffer->buffer + 8);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".timeout") == 0) {
+    if (session->timeout_ms == 0) {
+      printf("Timeout off.\n");
+    } else {
+      printf("Timeout: %u ms\n", session->timeout_ms);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".timeout ", 9) == 0) {
+    char* end;
+    errno = 0;
+    long long timeout_ms = strtoll(input_buffer->buffer + 9, &end, 10);
+    if (end == input_buffer->buffer + 9 || *end != '\0' || errno == ERANGE ||
+        timeout_ms < 0 || timeout_ms > UINT32_MAX) {
+      printf("Timeout must be between 0 and %u ms.\n", UINT32_MAX);
+      return META_COMMAND_SUCCESS;
+    }
+    session->timeout_ms = timeout_ms;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".session") == 0) {
+    printf("Session %u\n", session->id);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".memory") == 0) {
+    print_memory();
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".memory limit ", 14) == 0) {
+    uint64_t budget;
+    if (!parse_number(input_buffer->buffer + 14, MEMORY_MAX_BUDGET, &budget)) {
+      printf("Memory limit must be between 0 and %lu bytes.\n",
+             (unsigned long)MEMORY_MAX_BUDGET);
+      return META_COMMAND_SUCCESS;
+    }
+    memory_accountant.budget = budget;
+    buffer_pool_trim(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".perf") == 0) {
+    print_perf();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".perf on") == 0) {
+    PerfGroup probe;
+    probe.opened = false;
+    if (!perf_open(&probe)) {
+      printf("Performance counters unavailable: %s\n", strerror(errno));
+      return META_COMMAND_SUCCESS;
+    }
+    perf_close(&probe);
+    perf_stats.enabled = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".perf off") == 0) {
+    perf_stats.enabled = false;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".top") == 0) {
+    print_top(TOP_DEFAULT_COUNT);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".top ", 5) == 0) {
+    uint64_t count;
+    if (!parse_number(input_buffer->buffer + 5, UINT32_MAX, &count) ||
+        count == 0) {
+      printf("Count must be between 1 and %u.\n", UINT32_MAX);
+      return META_COMMAND_SUCCESS;
+    }
+    print_top(count);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".scheduler") == 0) {
+    print_scheduler();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".partitions") == 0) {
+    print_partitions(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".lag") == 0) {
+    if (table->upstream_changes == -1) {
+      printf("Not a replica.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    uint64_t applied = table->changes->next_seq - 1;
+    uint64_t available = change_log_length(table->upstream_changes);
+    printf("Lag: %lu changes\n",
+           (unsigned long)(available > applied ? available - applied : 0));
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".changes since ", 15) == 0) {
+    print_changes_since(table->changes, strtoull(input_buffer->buffer + 15, NULL, 10));
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".changes listen ", 16) == 0) {
+    if (!change_feed_start(table->changes, input_buffer->buffer + 16)) {
+      printf("Unable to listen for change followers.\n");
+    }
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+void print_prompt() {
+  printf("db > ");
+}
+
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+
+  strtok(input_buffer->buffer, " ");  // Skips "insert".
+  char* id_string = strtok(NULL, " ");
+  char* username = strtok(NULL, " ");
+  char* email = strtok(NULL, " ");
+
+  if (id_string == NULL || username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  int id = atoi(id_string);
+  if (id < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (strlen(username) > COLUMN_USERNAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  if (strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  statement->row_to_insert.id = id;
+  strcpy(statement->row_to_insert.username, username);
+  strcpy(statement->row_to_insert.email, email);
+
+  return PREPARE_SUCCESS;
+}
+
+// Maps a column name, including the derived email_domain and tenant, to
+// its Column. Returns false for unknown names.
+bool parse_column(const char* name, Column* column) {
+  if (strcmp(name, "id") == 0) {
+    *column = COLUMN_ID;
+  } else if (strcmp(name, "username") == 0) {
+    *column = COLUMN_USERNAME;
+  } else if (strcmp(name, "email") == 0) {
+    *column = COLUMN_EMAIL;
+  } else if (strcmp(name, "email_domain") == 0) {
+    *column = COLUMN_EMAIL_DOMAIN;
+  } else if (strcmp(name, "tenant") == 0) {
+    *column = COLUMN_TENANT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Parses the number in an id comparison. Numbers past the largest id all
+// compare the same way, so they are read as UINT32_MAX + 1.
+PrepareResult parse_id_bound(const char* text, uint64_t* value) {
+  if (text[0] == '-' && text[1] >= '0' && text[1] <= '9') {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (text[0] < '0' || text[0] > '9') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* end;
+  errno = 0;
+  *value = strtoull(text, &end, 10);
+  if (*end != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (errno == ERANGE || *value > UINT32_MAX) {
+    *value = (uint64_t)UINT32_MAX + 1;
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Parses one predicate of a where clause: "id <op> N" or "id between A and
+// B", which narrow an inclusive id range; equality on a column with a
+// bitmap index; or "like '%text%'" on username or email.
+PrepareResult prepare_where(Statement* statement) {
+  char* column = strtok(NULL, " ");
+  char* op = strtok(NULL, " ");
+  char* value_string = strtok(NULL, " ");
+  if (column == NULL || op == NULL || value_string == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  if (strcmp(op, "like") == 0) {
+    // A pattern with spaces was split up; join it back to its closing quote.
+    while (value_string[0] == '\'' &&
+           (strlen(value_string) < 2 ||
+            value_string[strlen(value_string) - 1] != '\'')) {
+      char* next = strtok(NULL, " ");
+      if (next == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      for (char* p = value_string + strlen(value_string); p < next; p++) {
+        *p = ' ';
+      }
+    }
+    size_t length = strlen(value_string);
+    Column filter_column;
+    if (!parse_column(column, &filter_column) ||
+        (filter_column != COLUMN_USERNAME && filter_column != COLUMN_EMAIL) ||
+        statement->num_filters == MAX_VALUE_FILTERS || length < 4 ||
+        length - 4 > COLUMN_EMAIL_SIZE || strncmp(value_string, "'%", 2) != 0 ||
+        strcmp(value_string + length - 2, "%'") != 0 ||
+        strcspn(value_string + 2, "%_'") != length - 4) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    ValueFilter* filter = &(statement->filters[statement->num_filters++]);
+    filter->type = FILTER_CONTAINS;
+    filter->column = filter_column;
+    memcpy(filter->value, value_string + 2, length - 4);
+    filter->value[length - 4] = '\0';
+    return PREPARE_SUCCESS;
+  }
+
+  if (strcmp(column, "id") != 0) {
+    Column filter_column;
+    if (!parse_column(column, &filter_column) ||
+        (filter_column != COLUMN_EMAIL_DOMAIN && filter_column != COLUMN_TENANT) ||
+        strcmp(op, "=") != 0 || statement->num_filters == MAX_VALUE_FILTERS ||
+        strlen(value_string) > COLUMN_EMAIL_SIZE) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    ValueFilter* filter = &(statement->filters[statement->num_filters++]);
+    filter->type = FILTER_EQUALS;
+    filter->column = filter_column;
+    strcpy(filter->value, value_string);
+    return PREPARE_SUCCESS;
+  }
+
+  uint64_t value;
+  PrepareResult parsed = parse_id_bound(value_string, &value);
+  if (parsed != PREPARE_SUCCESS) {
+    return parsed;
+  }
+
+  // Bounds are worked out in 64 bits, so values past the largest id
+  // narrow the range instead of wrapping.
+  uint64_t min_id = 0;
+  uint64_t max_id = UINT32_MAX;
+  if (strcmp(op, "=") == 0) {
+    min_id = value;
+    max_id = value;
+  } else if (strcmp(op, ">=") == 0) {
+    min_id = value;
+  } else if (strcmp(op, ">") == 0) {
+    min_id = value + 1;
+  } else if (strcmp(op, "<=") == 0) {
+    max_id = value;
+  } else if (strcmp(op, "<") == 0) {
+    if (value == 0) {
+      min_id = 1;  // Matches nothing
+    }
+    max_id = value == 0 ? 0 : value - 1;
+  } else if (strcmp(op, "between") == 0) {
+    char* and_keyword = strtok(NULL, " ");
+    char* max_string = strtok(NULL, " ");
+    if (and_keyword == NULL || max_string == NULL ||
+        strcmp(and_keyword, "and") != 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    parsed = parse_id_bound(max_string, &max_id);
+    if (parsed != PREPARE_SUCCESS) {
+      return parsed;
+    }
+    min_id = value;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  IdRange predicate = {true, 1, 0};  // Matches nothing
+  if (min_id <= UINT32_MAX && min_id <= max_id) {
+    predicate.min_id = min_id;
+    predicate.max_id = max_id < UINT32_MAX ? max_id : UINT32_MAX;
+  }
+
+  // Later id predicates narrow the range set by earlier ones.
+  IdRange* current = &(statement->id_range);
+  if (!current->active) {
+    *current = predicate;
+  } else {
+    if (predicate.min_id > current->min_id) current->min_id = predicate.min_id;
+    if (predicate.max_id < current->max_id) current->max_id = predicate.max_id;
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Parses "system(P%)" or "bernoulli(P%)", optionally followed by
+// "repeatable(SEED)", from the rest of the line.
+PrepareResult prepare_tablesample(Statement* statement) {
+  char* text = strtok(NULL, "");
+  if (text == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  TableSample* sample = &(statement->sample);
+  char method[16];
+  double percent;
+  int consumed = 0;
+  if (sscanf(text, " %15[a-z] ( %lf %% )%n", method, &percent, &consumed) != 2 ||
+      consumed == 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(method, "system") == 0) {
+    sample->method = SAMPLE_SYSTEM;
+  } else if (strcmp(method, "bernoulli") == 0) {
+    sample->method = SAMPLE_BERNOULLI;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (percent <= 0 || percent > 100) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  sample->fraction = percent / 100;
+  text += consumed;
+
+  unsigned long seed;
+  consumed = 0;
+  if (sscanf(text, " repeatable ( %lu )%n", &seed, &consumed) == 1 &&
+      consumed > 0) {
+    sample->repeatable = true;
+    sample->seed = seed;
+    text += consumed;
+  } else {
+    sample->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  }
+
+  text += strspn(text, " ");
+  return *text == '\0' ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+// Parses an aggregate at the start of text; returns the characters
+// consumed, or 0 if text does not start with a valid aggregate.
+int prepare_aggregate(const char* text, Aggregate* aggregate) {
+  char column_name[16];
+  int consumed = 0;
+
+  if (sscanf(text, " approx_count_distinct ( %15[a-z_] )%n", column_name,
+             &consumed) == 1 && consumed > 0) {
+    aggregate->type = AGGREGATE_APPROX_COUNT_DISTINCT;
+    return parse_column(column_name, &(aggregate->column)) ? consumed : 0;
+  }
+
+  consumed = 0;
+  if (sscanf(text, " approx_percentile ( id , %lf )%n",
+             &(aggregate->percentile), &consumed) == 1 && consumed > 0) {
+    if (!isfinite(aggregate->percentile) || aggregate->percentile < 0 ||
+        aggregate->percentile > 1) {
+      return 0;
+    }
+    aggregate->type = AGGREGATE_APPROX_PERCENTILE;
+    aggregate->column = COLUMN_ID;
+    return consumed;
+  }
+  return 0;
+}
+
+// Parses "COLUMN [asc|desc]" following "order by".
+PrepareResult prepare_order_by(char* text, Statement* statement) {
+  OrderBy* order_by = &(statement->order_by);
+  char column_name[16];
+  int consumed = 0;
+  if (sscanf(text, " %15[a-z_]%n", column_name, &consumed) != 1 ||
+      !parse_column(column_name, &(order_by->column)) ||
+      order_by->column > COLUMN_EMAIL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  text += consumed;
+  text += strspn(text, " ");
+  if (strcmp(text, "desc") == 0) {
+    order_by->descending = true;
+  } else if (*text != '\0' && strcmp(text, "asc") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  order_by->active = true;
+  return PREPARE_SUCCESS;
+}
+
+// Finds the " order by " that starts the trailing clause. Any inside a
+// quoted like pattern are part of the pattern.
+char* find_order_by(char* text) {
+  char* found = NULL;
+  bool quoted = false;
+  for (char* p = text; *p != '\0'; p++) {
+    if (*p == '\'') {
+      quoted = !quoted;
+    } else if (!quoted && strncmp(p, " order by ", 10) == 0) {
+      found = p;
+    }
+  }
+  return found;
+}
+
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+
+  char* rest = input_buffer->buffer + strlen("select");
+  // Order by comes last; parse and cut it off before the other clauses.
+  char* order = find_order_by(rest);
+  if (order != NULL) {
+    PrepareResult result = prepare_order_by(order + 10, statement);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    *order = '\0';
+  }
+  if (strncmp(rest, " approx_", 8) == 0) {
+    int consumed = prepare_aggregate(rest, &(statement->aggregate));
+    if (consumed == 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (statement->order_by.active) {
+      return PREPARE_SYNTAX_ERROR;  // Aggregates yield a single row
+    }
+    rest += consumed;
+  }
+
+  char* clause = strtok(rest, " ");
+  if (clause != NULL && strcmp(clause, "where") == 0) {
+    do {
+      PrepareResult result = prepare_where(statement);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+      clause = strtok(NULL, " ");
+    } while (clause != NULL && strcmp(clause, "and") == 0);
+  }
+  if (clause != NULL && strcmp(clause, "tablesample") == 0) {
+    return prepare_tablesample(statement);
+  }
+  return clause == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
+  memset(statement, 0, sizeof(Statement));
+  if (strncmp(input_buffer->buffer, "explain ", 8) == 0) {
+    statement->explain = true;
+    memmove(input_buffer->buffer, input_buffer->buffer + 8,
+            strlen(input_buffer->buffer + 8) + 1);
+  }
+
+  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+    return prepare_insert(input_buffer, statement);
+  }
+  if (strcmp(input_buffer->buffer, "select") == 0 ||
+      strncmp(input_buffer->buffer, "select ", 7) == 0) {
+    return prepare_select(input_buffer, statement);
+  }
+  if (strcmp(input_buffer->buffer, "analyze") == 0) {
+    statement->type = STATEMENT_ANALYZE;
+    return PREPARE_SUCCESS;
+  }
+  if (strncmp(input_buffer->buffer, "create index", 12) == 0) {
+    statement->type = STATEMENT_CREATE_INDEX;
+    statement->fill_percent = INDEX_DEFAULT_FILL;
+    char* rest = input_buffer->buffer + 12;
+    if (*rest == '\0') {
+      return PREPARE_SUCCESS;
+    }
+    unsigned int fill;
+    int consumed = 0;
+    if (sscanf(rest, " fill %u%n", &fill, &consumed) != 1 ||
+        rest[consumed] != '\0' || fill < 10 || fill > 100) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->fill_percent = fill;
+    return PREPARE_SUCCESS;
+  }
+  if (strncmp(input_buffer->buffer, "drop partition ", 15) == 0) {
+    statement->type = STATEMENT_DROP_PARTITION;
+    long partition = atol(input_buffer->buffer + 15);
+    if (partition < 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->partition = partition;
+    return PREPARE_SUCCESS;
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+uint64_t next_random(uint64_t* state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+uint64_t hash_bytes(const void* data, size_t size) {
+  // FNV-1a followed by a murmur3 finalizer so the high bits are well mixed
+  const uint8_t* bytes = data;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Keep the zone map of the row's page and the sortedness flag current.
+void header_note_insert(FileHeader* header, Cursor* cursor, uint32_t id) {
+  uint32_t page_num = cursor_page_num(cursor);
+  if (page_num >= header->zone_map_first_page) {
+    ZoneMap* zone = &(header->zone_maps[page_num]);
+    if (cursor->row_num % ROWS_PER_PAGE == 0) {
+      zone->min_id = id;
+      zone->max_id = id;
+    } else {
+      if (id < zone->min_id) zone->min_id = id;
+      if (id > zone->max_id) zone->max_id = id;
+    }
+  }
+
+  if (cursor->row_num > 0 && id < header->max_id) {
+    header->ids_sorted = false;
+  }
+  if (cursor->row_num == 0 || id > header->max_id) {
+    header->max_id = id;
+  }
+}
+
+int compare_ids(const void* a, const void* b) {
+  uint32_t left = *(const uint32_t*)a;
+  uint32_t right = *(const uint32_t*)b;
+  return (left > right) - (left < right);
+}
+
+// The first 8 bytes of text, big-endian and zero padded. As integers
+// these order strings the way strcmp does as far as the prefix goes, so
+// most comparisons never touch the strings themselves.
+uint64_t normalized_key(const char* text) {
+  uint64_t key = 0;
+  for (uint32_t i = 0; i < 8; i++) {
+    key <<= 8;
+    if (*text != '\0') {
+      key |= (uint8_t)*text++;
+    }
+  }
+  return key;
+}
+
+// Orders by normalized key, falling back to the rest of the strings only
+// when the keys tie and neither string ended inside the prefix.
+int compare_sort_keys(const void* a, const void* b) {
+  const SortEntry* left = a;
+  const SortEntry* right = b;
+  if (left->key != right->key) {
+    return left->key < right->key ? -1 : 1;
+  }
+  if (left->text == NULL || (left->key & 0xFF) == 0) {
+    return 0;
+  }
+  return strcmp(left->text + 8, right->text + 8);
+}
+
+int compare_sort_entries(const void* a, const void* b) {
+  int order = compare_sort_keys(a, b);
+  if (order != 0) {
+    return order;
+  }
+  const SortEntry* left = a;
+  const SortEntry* right = b;
+  return (left->index > right->index) - (left->index < right->index);
+}
+
+// Guaranteed-Error Estimator: values seen once in the sample stand for
+// sqrt(N/n) values each, values seen more often are assumed complete.
+uint32_t estimate_distinct(void* sorted, uint32_t count, size_t size,
+                           int (*compare)(const void*, const void*),
+                           uint32_t table_rows) {
+  uint32_t singletons = 0;
+  uint32_t repeated = 0;
+  uint32_t i = 0;
+  while (i < count) {
+    uint32_t run = 1;
+    while (i + run < count &&
+           compare((char*)sorted + i * size, (char*)sorted + (i + run) * size) == 0) {
+      run++;
+    }
+    if (run == 1) {
+      singletons++;
+    } else {
+      repeated++;
+    }
+    i += run;
+  }
+
+  if (count == table_rows) {
+    return singletons + repeated;
+  }
+  return (uint32_t)(sqrt((double)table_rows / count) * singletons) + repeated;
+}
+
+typedef struct {
+  IndexPair* pairs;
+  uint32_t count;
+} SortRun;
+
+void* sort_run(void* arg) {
+  SortRun* run = arg;
+  qsort(run->pairs, run->count, sizeof(IndexPair), compare_index_pairs);
+  return NULL;
+}
+
+// Reads one spilled run back a buffer at a time during the merge.
+typedef struct {
+  off_t offset;        // Next unread pair in the spill file
+  uint32_t remaining;  // Pairs not yet read into the buffer
+  IndexPair buffer[INDEX_MERGE_BUFFER];
+  uint32_t position;
+  uint32_t buffered;
+} RunReader;
+
+bool run_reader_next(int fd, RunReader* reader, IndexPair* pair) {
+  if (reader->position == reader->buffered) {
+    if (reader->remaining == 0) {
+      return false;
+    }
+    uint32_t count = reader->remaining < INDEX_MERGE_BUFFER
+                         ? reader->remaining
+                         : INDEX_MERGE_BUFFER;
+    ssize_t length = count * sizeof(IndexPair);
+    if (pread(fd, reader->buffer, length, reader->offset) != length) {
+      printf("Error reading index sort file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    reader->offset += length;
+    reader->remaining -= count;
+    reader->position = 0;
+    reader->buffered = count;
+  }
+  *pair = reader->buffer[reader->position++];
+  return true;
+}
+
+typedef struct {
+  IndexPair pair;
+  uint32_t run;
+} MergeHead;
+
+void merge_sift_down(MergeHead* heap, uint32_t size, uint32_t i) {
+  while (true) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < size &&
+        compare_index_pairs(&heap[left].pair, &heap[smallest].pair) < 0) {
+      smallest = left;
+    }
+    if (right < size &&
+        compare_index_pairs(&heap[right].pair, &heap[smallest].pair) < 0) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    MergeHead swap = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = swap;
+    i = smallest;
+  }
+}
+
+// Builds the id index bottom-up instead of inserting row by row. A table
+// holds at most TABLE_MAX_ROWS rows, so its (id, row) pairs fit in memory:
+// each sort thread takes one run of num_rows / INDEX_SORT_THREADS pairs,
+// and the sorted runs are spilled to a scratch file. The merge of those
+// runs fills leaves left to right to fill_percent, and each level above is
+// built from the first pair of each page below it. Every page is written
+// once, in order.
+bool index_build(Table* table, uint32_t fill_percent) {
+  char* path = index_path(table->filename);
+  size_t length = strlen(path) + 8;
+  char* temp_path = malloc(length);
+  char* spill_path = malloc(length);
+  snprintf(temp_path, length, "%s-tmp", path);
+  snprintf(spill_path, length, "%s-sort", path);
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  int spill = open(spill_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  unlink(spill_path);  // Gone once closed, even after a crash
+  free(spill_path);
+  if (fd == -1 || spill == -1) {
+    if (fd != -1) {
+      close(fd);
+      unlink(temp_path);
+    }
+    if (spill != -1) {
+      close(spill);
+    }
+    free(temp_path);
+    free(path);
+    return false;
+  }
+
+  // Pages are read on this thread; the sort threads only touch pairs.
+  uint32_t num_runs = table->num_rows < INDEX_SORT_THREADS ? table->num_rows
+                                                           : INDEX_SORT_THREADS;
+  RunReader* readers = calloc(num_runs + 1, sizeof(RunReader));
+  IndexPair* pairs = malloc((table->num_rows + 1) * sizeof(IndexPair));
+  Cursor* cursor = table_start(table);
+  while (cursor->row_num < table->num_rows) {
+    IndexPair* pair = &(pairs[cursor->row_num]);
+    memcpy(&(pair->id), (uint8_t*)cursor_value(cursor) + ID_OFFSET, ID_SIZE);
+    pair->row_num = cursor->row_num++;
+  }
+  free(cursor);
+
+  SortRun runs[INDEX_SORT_THREADS];
+  pthread_t threads[INDEX_SORT_THREADS];
+  for (uint32_t r = 0; r < num_runs; r++) {
+    uint32_t first = (uint64_t)table->num_rows * r / num_runs;
+    uint32_t end = (uint64_t)table->num_rows * (r + 1) / num_runs;
+    runs[r] = (SortRun){pairs + first, end - first};
+    pthread_create(&threads[r], NULL, sort_run, &runs[r]);
+  }
+  off_t spilled = 0;
+  for (uint32_t r = 0; r < num_runs; r++) {
+    pthread_join(threads[r], NULL);
+    ssize_t bytes = runs[r].count * sizeof(IndexPair);
+    if (write(spill, runs[r].pairs, bytes) != bytes) {
+      printf("Error writing index sort file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    readers[r].offset = spilled;
+    readers[r].remaining = runs[r].count;
+    spilled += bytes;
+  }
+  free(pairs);
+
+  MergeHead* heap = malloc((num_runs + 1) * sizeof(MergeHead));
+  uint32_t heap_size = 0;
+  for (uint32_t r = 0; r < num_runs; r++) {
+    if (run_reader_next(spill, &readers[r], &(heap[heap_size].pair))) {
+      heap[heap_size++].run = r;
+    }
+  }
+  for (uint32_t i = heap_size; i > 0; i--) {
+    merge_sift_down(heap, heap_size, i - 1);
+  }
+
+  uint32_t leaf_fill = INDEX_LEAF_MAX * fill_percent / 100;
+  uint32_t internal_fill = (INDEX_INTERNAL_MAX + 1) * fill_percent / 100;
+  if (leaf_fill < 1) leaf_fill = 1;
+  if (internal_fill < 2) internal_fill = 2;
+
+  // The first pair and page number of each page on the level being built.
+  uint32_t max_pages = table->num_rows / leaf_fill + 1;
+  IndexPair* firsts = malloc(max_pages * sizeof(IndexPair));
+  uint32_t* page_nums = malloc(max_pages * sizeof(uint32_t));
+  uint32_t num_level_pages = 0;
+
+  uint8_t page[PAGE_SIZE];
+  memset(page, 0, PAGE_SIZE);
+  bool written = write(fd, page, PAGE_SIZE) == (ssize_t)PAGE_SIZE;  // Meta
+  uint32_t page_num = 1;
+  IndexPageHeader* header = index_page_header(page);
+  header->is_leaf = true;
+  while (written) {
+    if (heap_size > 0 && header->num_entries == leaf_fill) {
+      header->next_leaf = page_num + 1;
+      written = write(fd, page, PAGE_SIZE) == (ssize_t)PAGE_SIZE;
+      page_num++;
+      memset(page, 0, PAGE_SIZE);
+      header->is_leaf = true;
+    }
+    if (header->num_entries == 0) {
+      firsts[num_level_pages] = heap_size > 0 ? heap[0].pair : (IndexPair){0, 0};
+      page_nums[num_level_pages++] = page_num;
+    }
+    if (heap_size == 0) {
+      written = written && write(fd, page, PAGE_SIZE) == (ssize_t)PAGE_SIZE;
+      page_num++;
+      break;
+    }
+    index_leaf_pairs(page)[header->num_entries++] = heap[0].pair;
+    if (!run_reader_next(spill, &readers[heap[0].run], &(heap[0].pair))) {
+      heap[0] = heap[--heap_size];
+    }
+    merge_sift_down(heap, heap_size, 0);
+  }
+  close(spill);
+  free(readers);
+  free(heap);
+
+  uint32_t height = 1;
+  while (written && num_level_pages > 1) {
+    uint32_t num_parents = 0;
+    for (uint32_t i = 0; written && i < num_level_pages; i += internal_fill) {
+      uint32_t count = num_level_pages - i < internal_fill ? num_level_pages - i
+                                                           : internal_fill;
+      memset(page, 0, PAGE_SIZE);
+      header->num_entries = count - 1;
+      memcpy(index_children(page), &page_nums[i], count * sizeof(uint32_t));
+      memcpy(index_keys(page), &firsts[i + 1], (count - 1) * sizeof(IndexPair));
+      written = write(fd, page, PAGE_SIZE) == (ssize_t)PAGE_SIZE;
+      firsts[num_parents] = firsts[i];
+      page_nums[num_parents++] = page_num++;
+    }
+    num_level_pages = num_parents;
+    height++;
+  }
+
+  IndexMeta meta = {INDEX_FILE_MAGIC, page_nums[0], height, page_num,
+                    table->num_rows, fill_percent};
+  memset(page, 0, PAGE_SIZE);
+  memcpy(page, &meta, sizeof(IndexMeta));
+  written = written && pwrite(fd, page, PAGE_SIZE, 0) == (ssize_t)PAGE_SIZE;
+  if (written) {
+    pager_sync(fd);
+  }
+  close(fd);
+  free(firsts);
+  free(page_nums);
+  if (!written || rename(temp_path, path) == -1) {
+    unlink(temp_path);
+    free(temp_path);
+    free(path);
+    return false;
+  }
+  free(temp_path);
+
+  btree_free(table->btree);
+  table->btree = btree_load(path);
+  free(path);
+  return table->btree != NULL;
+}
+
+// Opens the table's index, adding rows written after it was last saved.
+// An index that knows of rows the table lacks, as after a restore, is
+// built again.
+void btree_open(Table* table) {
+  char* path = index_path(table->filename);
+  table->btree = btree_load(path);
+  free(path);
+  if (table->btree == NULL) {
+    return;
+  }
+  IndexMeta* meta = &(table->btree->meta);
+  if (meta->indexed_rows > table->num_rows) {
+    index_build(table, meta->fill_percent);
+    return;
+  }
+  Cursor* cursor = table_start(table);
+  cursor->row_num = meta->indexed_rows;
+  for (; cursor->row_num < table->num_rows; cursor->row_num++) {
+    IndexPair pair = {0, cursor->row_num};
+    memcpy(&(pair.id), (uint8_t*)cursor_value(cursor) + ID_OFFSET, ID_SIZE);
+    btree_insert(table->btree, pair);
+  }
+  meta->indexed_rows = table->num_rows;
+  free(cursor);
+}
+
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+  if (!index_build(table, statement->fill_percent)) {
+    return EXECUTE_INDEX_FAILED;
+  }
+  IndexMeta* meta = &(table->btree->meta);
+  printf("Index built: %d rows, %d pages, height %d.\n", meta->indexed_rows,
+         meta->num_pages - 1, meta->height);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_analyze(Table* table) {
+  FileHeader* header = &(table->pager->header);
+  TableStats* stats = &(header->stats);
+  uint32_t num_data_pages = (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+  uint32_t step = num_data_pages / ANALYZE_SAMPLE_PAGES;
+  if (step == 0) {
+    step = 1;
+  }
+
+  uint32_t capacity = ROWS_PER_PAGE * ANALYZE_SAMPLE_PAGES + ROWS_PER_PAGE;
+  uint32_t* ids = malloc(capacity * sizeof(uint32_t));
+  char (*usernames)[COLUMN_USERNAME_SIZE + 1] =
+      malloc(capacity * sizeof(*usernames));
+  char (*emails)[COLUMN_EMAIL_SIZE + 1] = malloc(capacity * sizeof(*emails));
+  SortEntry* username_keys = malloc(capacity * sizeof(SortEntry));
+  SortEntry* email_keys = malloc(capacity * sizeof(SortEntry));
+  uint32_t count = 0;
+
+  Cursor* cursor = table_start(table);
+  Row row;
+  for (uint32_t page = 0; page < num_data_pages; page += step) {
+    cursor->row_num = page * ROWS_PER_PAGE;
+    cursor->end_of_table = (cursor->row_num >= table->num_rows);
+    for (uint32_t i = 0; i < ROWS_PER_PAGE && !(cursor->end_of_table); i++) {
+      deserialize_row(cursor_value(cursor), &row);
+      ids[count] = row.id;
+      strcpy(usernames[count], row.username);
+      strcpy(emails[count], row.email);
+      username_keys[count] = (SortEntry){normalized_key(row.username),
+                                         usernames[count], count};
+      email_keys[count] =
+          (SortEntry){normalized_key(row.email), emails[count], count};
+      count++;
+      cursor_advance(cursor);
+    }
+  }
+  free(cursor);
+
+  memset(stats, 0, sizeof(TableStats));
+  stats->analyzed_rows = table->num_rows;
+  stats->sampled_rows = count;
+  if (count > 0) {
+    qsort(ids, count, sizeof(uint32_t), compare_ids);
+    qsort(username_keys, count, sizeof(SortEntry), compare_sort_entries);
+    qsort(email_keys, count, sizeof(SortEntry), compare_sort_entries);
+    for (uint32_t b = 0; b <= HISTOGRAM_BUCKETS; b++) {
+      stats->id_bounds[b] = ids[(uint64_t)b * (count - 1) / HISTOGRAM_BUCKETS];
+    }
+    stats->distinct_ids = estimate_distinct(ids, count, sizeof(uint32_t),
+                                            compare_ids, table->num_rows);
+    stats->distinct_usernames =
+        estimate_distinct(username_keys, count, sizeof(SortEntry),
+                          compare_sort_keys, table->num_rows);
+    stats->distinct_emails =
+        estimate_distinct(email_keys, count, sizeof(SortEntry),
+                          compare_sort_keys, table->num_rows);
+  }
+
+  free(ids);
+  free(usernames);
+  free(emails);
+  free(username_keys);
+  free(email_keys);
+
+  pager_write_header(table->pager);
+  return EXECUTE_SUCCESS;
+}
+
+// Fraction of analyzed rows with an id in [min_id, max_id], assuming ids
+// are spread evenly within each histogram bucket.
+double histogram_fraction(TableStats* stats, uint32_t min_id, uint32_t max_id) {
+  double fraction = 0;
+  for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    double low = stats->id_bounds[b];
+    double high = stats->id_bounds[b + 1];
+    if (max_id < low || min_id > high) {
+      continue;
+    }
+    if (high == low) {
+      fraction += 1.0;
+      continue;
+    }
+    double overlap_low = min_id > low ? min_id : low;
+    double overlap_high = max_id < high ? max_id + 1.0 : high;
+    double overlap = (overlap_high - overlap_low) / (high - low);
+    fraction += overlap > 1.0 ? 1.0 : overlap;
+  }
+  return fraction / HISTOGRAM_BUCKETS;
+}
+
+// Deterministic in (seed, key), so a repeatable sample sees the same
+// pages and rows every time.
+bool sample_includes(TableSample* sample, uint32_t key) {
+  if (sample->fraction >= 1.0) {
+    return true;
+  }
+  uint64_t input[2] = {sample->seed, key};
+  return hash_bytes(input, sizeof(input)) <
+         (uint64_t)(sample->fraction * 18446744073709551616.0);
+}
+
+bool zone_may_match(FileHeader* header, uint32_t page_num, IdRange* range) {
+  if (page_num < header->zone_map_first_page) {
+    return true;
+  }
+  ZoneMap* zone = &(header->zone_maps[page_num]);
+  return zone->max_id >= range->min_id && zone->min_id <= range->max_id;
+}
+
+QueryPlan plan_range(Statement* statement, Table* table) {
+  FileHeader* header = &(table->pager->header);
+  TableStats* stats = &(header->stats);
+  IdRange* range = &(statement->id_range);
+  uint32_t num_data_pages = (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+
+  QueryPlan plan = {PLAN_FULL_SCAN, num_data_pages, table->num_rows, {NULL, 0}};
+  if (!range->active || table->num_rows == 0) {
+    return plan;
+  }
+
+  // Fraction of the table with an id below / at or below the range.
+  double below_min = 0;
+  double below_max;
+  if (stats->analyzed_rows > 0) {
+    if (range->min_id > 0) {
+      below_min = histogram_fraction(stats, 0, range->min_id - 1);
+    }
+    below_max = histogram_fraction(stats, 0, range->max_id);
+    if (range->min_id == range->max_id && stats->distinct_ids > 0) {
+      plan.estimated_rows = table->num_rows / stats->distinct_ids;
+    } else {
+      plan.estimated_rows = table->num_rows *
+          histogram_fraction(stats, range->min_id, range->max_id);
+    }
+  } else {
+    // Without statistics assume ids are spread evenly up to the maximum.
+    below_min = header->max_id ? (double)range->min_id / header->max_id : 0.0;
+    below_max = header->max_id ? (double)range->max_id / header->max_id : 1.0;
+    if (below_min > 1.0) below_min = 1.0;
+    if (below_max > 1.0) below_max = 1.0;
+    plan.estimated_rows = range->min_id == range->max_id ? 1 : table->num_rows / 3;
+  }
+  if (range->min_id > range->max_id) {
+    plan.estimated_rows = 0;
+  }
+
+  uint32_t skip_pages = 0;
+  for (uint32_t i = 0; i < num_data_pages; i++) {
+    if (zone_may_match(header, HEADER_PAGES + i, range)) {
+      skip_pages++;
+    }
+  }
+  if (skip_pages < plan.estimated_pages) {
+    plan.path = PLAN_PAGE_SKIP;
+    plan.estimated_pages = skip_pages;
+  }
+
+  // Sorted ids also let the scan stop at the first id past the range
+  // instead of checking the zone map of every remaining page.
+  if (header->ids_sorted) {
+    uint32_t first_page = below_min * table->num_rows / ROWS_PER_PAGE;
+    uint32_t last_page = below_max * table->num_rows / ROWS_PER_PAGE;
+    uint32_t stop_pages = last_page - first_page + 1;
+    if (stop_pages > num_data_pages) {
+      stop_pages = num_data_pages;
+    }
+    if (stop_pages <= plan.estimated_pages) {
+      plan.path = PLAN_EARLY_STOP;
+      plan.estimated_pages = stop_pages;
+    }
+  }
+
+  // A single id is answered exactly by the radix tree.
+  if (range->min_id == range->max_id) {
+    ArtLeaf* leaf = art_lookup(table->id_index, range->min_id);
+    uint32_t lookup_pages = 0;
+    for (uint32_t i = 0; leaf != NULL && i < leaf->num_rows; i++) {
+      if (i == 0 || leaf->rows[i] / ROWS_PER_PAGE !=
+                        leaf->rows[i - 1] / ROWS_PER_PAGE) {
+        lookup_pages++;
+      }
+    }
+    if (lookup_pages <= plan.estimated_pages) {
+      plan.path = PLAN_INDEX_LOOKUP;
+      plan.estimated_pages = lookup_pages;
+      plan.estimated_rows = leaf != NULL ? leaf->num_rows : 0;
+    }
+  }
+
+  return plan;
+}
+
+// Number of distinct pages holding the rows in bitmap.
+uint32_t roaring_pages(Roaring* bitmap) {
+  uint32_t num_rows = roaring_cardinality(bitmap);
+  uint32_t* rows = malloc((num_rows + 1) * sizeof(uint32_t));
+  roaring_values(bitmap, rows);
+  uint32_t pages = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if (i == 0 || rows[i] / ROWS_PER_PAGE != rows[i - 1] / ROWS_PER_PAGE) {
+      pages++;
+    }
+  }
+  free(rows);
+  return pages;
+}
+
+// Cracks the id column at both ends of the range, leaving the matching
+// rows contiguous, so repeated queries find smaller pieces to partition.
+// Explain leaves the column alone: it checks the ids in the pieces the
+// existing cracks bound, and counts rows not yet in the column as
+// candidates.
+void plan_cracked(Statement* statement, Table* table, QueryPlan* plan) {
+  IdRange* range = &(statement->id_range);
+  CrackerColumn* cracker = table->cracker;
+
+  Roaring matches = {NULL, 0};
+  if (statement->explain && range->min_id <= range->max_id) {
+    uint32_t start, end, unused;
+    cracker_piece(cracker, range->min_id, &start, &unused);
+    cracker_piece(cracker, range->max_id, &unused, &end);
+    for (uint32_t i = start; i < end; i++) {
+      if (cracker->ids[i] >= range->min_id && cracker->ids[i] <= range->max_id) {
+        roaring_add(&matches, cracker->rows[i]);
+      }
+    }
+    for (uint32_t row_num = cracker->count; row_num < table->num_rows; row_num++) {
+      roaring_add(&matches, row_num);
+    }
+  } else if (!statement->explain) {
+    cracker_sync(table);
+    if (range->min_id <= range->max_id) {
+      uint32_t start = cracker_crack(cracker, range->min_id);
+      uint32_t end = range->max_id == UINT32_MAX
+                         ? cracker->count
+                         : cracker_crack(cracker, range->max_id + 1);
+      for (uint32_t i = start; i < end; i++) {
+        roaring_add(&matches, cracker->rows[i]);
+      }
+    }
+  }
+
+  plan->path = PLAN_CRACKED;
+  plan->estimated_rows = roaring_cardinality(&matches);
+  plan->estimated_pages = roaring_pages(&matches);
+  plan->matches = matches;
+}
+
+// Value filters are answered by ANDing their bitmaps, and the candidates
+// of any substring filters, before any page is read; only pages holding a
+// row in the result are visited.
+void plan_bitmap(Statement* statement, Table* table, QueryPlan* plan) {
+  Roaring matches = {NULL, 0};
+  for (uint32_t i = 0; i < statement->num_filters; i++) {
+    ValueFilter* filter = &(statement->filters[i]);
+    Roaring candidates = {NULL, 0};
+    Roaring* rows;
+    if (filter->type == FILTER_CONTAINS) {
+      TrigramIndex* index = filter->column == COLUMN_USERNAME
+                                ? &(table->username_trigrams)
+                                : &(table->email_trigrams);
+      candidates = trigram_candidates(index, filter->value, table->num_rows);
+      rows = &candidates;
+    } else {
+      BitmapIndex* index = filter->column == COLUMN_EMAIL_DOMAIN
+                               ? &(table->domain_index)
+                               : &(table->tenant_index);
+      rows = bitmap_index_find(index, filter->value);
+      if (rows == NULL) {
+        roaring_free(&matches);
+        break;
+      }
+    }
+    Roaring narrowed = roaring_and(i == 0 ? rows : &matches, rows);
+    roaring_free(&matches);
+    roaring_free(&candidates);
+    matches = narrowed;
+  }
+
+  uint32_t num_matches = roaring_cardinality(&matches);
+  plan->path = PLAN_BITMAP;
+  plan->estimated_pages = roaring_pages(&matches);
+  if (num_matches < plan->estimated_rows) {
+    plan->estimated_rows = num_matches;
+  }
+  plan->matches = matches;
+}
+
+// Walks the id index across the range, and keeps the result only if the
+// rows it names sit on fewer pages than the plan so far would read.
+void plan_index_range(Statement* statement, Table* table, QueryPlan* plan) {
+  IdRange* range = &(statement->id_range);
+  Roaring matches = btree_range(table->btree, range->min_id, range->max_id);
+  uint32_t pages = roaring_pages(&matches);
+  if (pages >= plan->estimated_pages) {
+    roaring_free(&matches);
+    return;
+  }
+  plan->path = PLAN_INDEX_RANGE;
+  plan->estimated_pages = pages;
+  plan->estimated_rows = roaring_cardinality(&matches);
+  plan->matches = matches;
+}
+
+QueryPlan plan_select(Statement* statement, Table* table) {
+  QueryPlan plan = plan_range(statement, table);
+  if (statement->num_filters > 0) {
+    plan_bitmap(statement, table, &plan);
+  } else if (table->cracker != NULL && statement->id_range.active) {
+    plan_cracked(statement, table, &plan);
+  } else if (table->btree != NULL && statement->id_range.active) {
+    plan_index_range(statement, table, &plan);
+  }
+  TableSample* sample = &(statement->sample);
+  if (sample->method != SAMPLE_NONE) {
+    plan.estimated_rows *= sample->fraction;
+  }
+  if (sample->method == SAMPLE_SYSTEM) {
+    plan.estimated_pages = ceil(plan.estimated_pages * sample->fraction);
+  }
+  return plan;
+}
+
+void print_plan(QueryPlan* plan, Table* table) {
+  const char* names[] = {"full scan", "page skip", "early stop",
+                         "index lookup", "bitmap index", "cracked index",
+                         "index range scan"};
+  printf("Plan: %s (est. %d of %d pages, %d rows)\n", names[plan->path],
+         plan->estimated_pages,
+         (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE,
+         plan->estimated_rows);
+}
+
+uint64_t hash_column(Row* row, Column column) {
+  switch (column) {
+    case (COLUMN_ID):
+      return hash_bytes(&(row->id), sizeof(row->id));
+    case (COLUMN_USERNAME):
+      return hash_bytes(row->username, strlen(row->username));
+    case (COLUMN_EMAIL):
+      return hash_bytes(row->email, strlen(row->email));
+    case (COLUMN_EMAIL_DOMAIN):
+      return hash_bytes(row_email_domain(row), strlen(row_email_domain(row)));
+    case (COLUMN_TENANT):
+      return hash_bytes(row->username, row_tenant_length(row));
+  }
+  return 0;
+}
+
+void hll_init(HyperLogLog* hll) {
+  memset(hll->registers, 0, sizeof(hll->registers));
+}
+
+void hll_add(HyperLogLog* hll, uint64_t hash) {
+  uint32_t index = hash >> (64 - HLL_PRECISION);
+  uint64_t rest = (hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+  uint8_t rank = __builtin_clzll(rest) + 1;
+  if (rank > hll->registers[index]) {
+    hll->registers[index] = rank;
+  }
+}
+
+void hll_merge(HyperLogLog* into, HyperLogLog* from) {
+  for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+    if (from->registers[i] > into->registers[i]) {
+      into->registers[i] = from->registers[i];
+    }
+  }
+}
+
+uint64_t hll_estimate(HyperLogLog* hll) {
+  double m = HLL_REGISTERS;
+  double sum = 0;
+  uint32_t empty = 0;
+  for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -hll->registers[i]);
+    if (hll->registers[i] == 0) {
+      empty++;
+    }
+  }
+  double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+  if (estimate <= 2.5 * m && empty > 0) {
+    // Linear counting is more accurate while many registers are unused.
+    estimate = m * log(m / empty);
+  }
+  return (uint64_t)(estimate + 0.5);
+}
+
+void kll_init(KllSketch* sketch) {
+  memset(sketch, 0, sizeof(KllSketch));
+  sketch->num_levels = 1;
+  sketch->random_state = 0x9E3779B97F4A7C15ULL;
+}
+
+void kll_free(KllSketch* sketch) {
+  for (uint32_t h = 0; h < KLL_MAX_LEVELS; h++) {
+    free(sketch->items[h]);
+  }
+}
+
+// Lower levels get geometrically smaller capacities, as in KLL.
+uint32_t kll_capacity(KllSketch* sketch, uint32_t level) {
+  uint32_t depth = sketch->num_levels - 1 - level;
+  uint32_t capacity = (uint32_t)ceil(KLL_K * pow(2.0 / 3.0, depth));
+  return capacity < 2 ? 2 : capacity;
+}
+
+void kll_append(KllSketch* sketch, uint32_t level, uint32_t value) {
+  if (sketch->sizes[level] == sketch->allocated[level]) {
+    sketch->allocated[level] = sketch->allocated[level] ? sketch->allocated[level] * 2 : 16;
+    sketch->items[level] = realloc(sketch->items[level],
+                                   sketch->allocated[level] * sizeof(uint32_t));
+  }
+  sketch->items[level][sketch->sizes[level]++] = value;
+}
+
+void kll_compress(KllSketch* sketch) {
+  for (uint32_t h = 0; h < sketch->num_levels; h++) {
+    if (sketch->sizes[h] < kll_capacity(sketch, h)) {
+      continue;
+    }
+    if (h + 1 == sketch->num_levels) {
+      if (sketch->num_levels == KLL_MAX_LEVELS) {
+        continue;
+      }
+      sketch->num_levels++;
+    }
+
+    uint32_t* items = sketch->items[h];
+    uint32_t size = sketch->sizes[h];
+    qsort(items, size, sizeof(uint32_t), compare_ids);
+    // An odd item out stays behind so the promoted run is even.
+    uint32_t keep = size % 2;
+    uint32_t offset = next_random(&(sketch->random_state)) & 1;
+    for (uint32_t i = keep + offset; i < size; i += 2) {
+      kll_append(sketch, h + 1, items[i]);
+    }
+    sketch->sizes[h] = keep;
+  }
+}
+
+void kll_add(KllSketch* sketch, uint32_t value) {
+  kll_append(sketch, 0, value);
+  sketch->count++;
+  if (sketch->sizes[0] >= kll_capacity(sketch, 0)) {
+    kll_compress(sketch);
+  }
+}
+
+void kll_merge(KllSketch* into, KllSketch* from) {
+  if (from->num_levels > into->num_levels) {
+    into->num_levels = from->num_levels;
+  }
+  for (uint32_t h = 0; h < from->num_levels; h++) {
+    for (uint32_t i = 0; i < from->sizes[h]; i++) {
+      kll_append(into, h, from->items[h][i]);
+    }
+  }
+  into->count += from->count;
+  kll_compress(into);
+}
+
+typedef struct {
+  uint32_t value;
+  uint64_t weight;
+} WeightedItem;
+
+int compare_weighted_items(const void* a, const void* b) {
+  return compare_ids(&((const WeightedItem*)a)->value,
+                     &((const WeightedItem*)b)->value);
+}
+
+uint32_t kll_quantile(KllSketch* sketch, double fraction) {
+  uint32_t total = 0;
+  for (uint32_t h = 0; h < sketch->num_levels; h++) {
+    total += sketch->sizes[h];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  WeightedItem* items = malloc(total * sizeof(WeightedItem));
+  uint32_t n = 0;
+  uint64_t total_weight = 0;
+  for (uint32_t h = 0; h < sketch->num_levels; h++) {
+    for (uint32_t i = 0; i < sketch->sizes[h]; i++) {
+      items[n].value = sketch->items[h][i];
+      items[n].weight = 1ULL << h;
+      total_weight += items[n].weight;
+      n++;
+    }
+  }
+  qsort(items, n, sizeof(WeightedItem), compare_weighted_items);
+
+  double target = fraction * total_weight;
+  uint64_t seen = 0;
+  uint32_t result = items[n - 1].value;
+  for (uint32_t i = 0; i < n; i++) {
+    seen += items[i].weight;
+    if (seen >= target) {
+      result = items[i].value;
+      break;
+    }
+  }
+  free(items);
+  return result;
+}
+
+ExecuteResult table_insert_row(Table* table, Row* row_to_insert) {
+  if (table->num_rows >= TABLE_MAX_ROWS) {
+    return EXECUTE_TABLE_FULL;
+  }
+
+  Cursor* cursor = table_end(table);
+
+  serialize_row(row_to_insert, cursor_value(cursor));
+  table->pager->dirty[cursor_page_num(cursor)] = true;
+  change_log_append(table->changes, cursor->row_num, cursor_value(cursor));
+  header_note_insert(&(table->pager->header), cursor, row_to_insert->id);
+  table_index_row(table, row_to_insert, cursor->row_num);
+  table->num_rows += 1;
+
+  free(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  if (table->upstream_changes != -1) {
+    return EXECUTE_READ_ONLY;
+  }
+  return table_insert_row(table, &(statement->row_to_insert));
+}
+
+// Checks the substring filters that trigram candidates only approximate.
+bool row_matches_filters(Statement* statement, Row* row) {
+  for (uint32_t i = 0; i < statement->num_filters; i++) {
+    ValueFilter* filter = &(statement->filters[i]);
+    if (filter->type != FILTER_CONTAINS) {
+      continue;
+    }
+    const char* text =
+        filter->column == COLUMN_USERNAME ? row->username : row->email;
+    if (strstr(text, filter->value) == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+SortEntry sort_entry(Row* row, Column column, uint32_t index) {
+  SortEntry entry;
+  entry.index = index;
+  entry.text = column == COLUMN_ID         ? NULL
+               : column == COLUMN_USERNAME ? row->username
+                                           : row->email;
+  entry.key = entry.text == NULL ? row->id : normalized_key(entry.text);
+  return entry;
+}
+
+void row_buffer_spill(RowBuffer* buffer, OrderBy* order_by);
+
+// Most rows the buffer may hold while leaving room in the workspace share
+// to sort them.
+uint64_t row_buffer_capacity(RowBuffer* buffer) {
+  uint64_t row_cost = sizeof(Row) + 2 * sizeof(SortEntry) + sizeof(uint32_t);
+  uint64_t others = memory_accountant.used[MEMORY_WORKSPACE] -
+                    (uint64_t)buffer->allocated * sizeof(Row);
+  uint64_t limit = memory_limit(MEMORY_WORKSPACE);
+  return limit > others ? (limit - others) / row_cost : 0;
+}
+
+// Once the rows held would outgrow the workspace share, they go to disk
+// as a sorted run and the buffer starts over.
+void row_buffer_append(RowBuffer* buffer, Row* row, OrderBy* order_by) {
+  if (buffer->count == buffer->allocated) {
+    uint32_t allocated = buffer->allocated ? buffer->allocated * 2 : 256;
+    if (memory_accountant.budget > 0) {
+      uint64_t capacity = row_buffer_capacity(buffer);
+      if (allocated > capacity) {
+        allocated = capacity > 0 ? capacity : 1;
+      }
+    }
+    if (allocated <= buffer->allocated) {
+      row_buffer_spill(buffer, order_by);
+    } else {
+      memory_charge(MEMORY_WORKSPACE,
+                    (uint64_t)(allocated - buffer->allocated) * sizeof(Row));
+      buffer->allocated = allocated;
+      buffer->rows = realloc(buffer->rows, buffer->allocated * sizeof(Row));
+    }
+  }
+  buffer->rows[buffer->count++] = *row;
+}
+
+// LSD radix sort on the key, a byte per pass. Passes where every entry
+// has the same byte, such as the high bytes of ids, are skipped.
+void radix_sort_entries(SortEntry* entries, SortEntry* scratch, uint32_t count) {
+  SortEntry* from = entries;
+  SortEntry* to = scratch;
+  for (uint32_t shift = 0; shift < 64; shift += 8) {
+    uint32_t counts[256] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+      counts[(from[i].key >> shift) & 0xFF]++;
+    }
+    if (counts[(from[0].key >> shift) & 0xFF] == count) {
+      continue;
+    }
+    uint32_t offset = 0;
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t bucket = counts[b];
+      counts[b] = offset;
+      offset += bucket;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      to[counts[(from[i].key >> shift) & 0xFF]++] = from[i];
+    }
+    SortEntry* swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != entries) {
+    memcpy(entries, from, count * sizeof(SortEntry));
+  }
+}
+
+void* sort_partition(void* arg) {
+  SortPartition* partition = arg;
+  if (partition->count == 0) {
+    return NULL;
+  }
+  if (partition->entries[0].text == NULL) {
+    radix_sort_entries(partition->entries, partition->scratch, partition->count);
+  } else {
+    qsort(partition->entries, partition->count, sizeof(SortEntry),
+          compare_sort_entries);
+  }
+  if (partition->descending) {
+    for (uint32_t i = 0; i < partition->count / 2; i++) {
+      SortEntry swap = partition->entries[i];
+      partition->entries[i] = partition->entries[partition->count - 1 - i];
+      partition->entries[partition->count - 1 - i] = swap;
+    }
+  }
+  return NULL;
+}
+
+// True if the head of run a comes before the head of run b. A run that
+// is used up loses every match.
+bool loser_tree_beats(LoserTree* tree, uint32_t a, uint32_t b) {
+  SortEntry* left = tree->heads[a];
+  SortEntry* right = tree->heads[b];
+  if (left == NULL || right == NULL) {
+    return left != NULL;
+  }
+  int order = compare_sort_entries(left, right);
+  return tree->descending ? order > 0 : order < 0;
+}
+
+// Plays the matches below node; returns the winning run.
+uint32_t loser_tree_play(LoserTree* tree, uint32_t node) {
+  if (node >= tree->num_runs) {
+    return node - tree->num_runs;
+  }
+  uint32_t left = loser_tree_play(tree, 2 * node);
+  uint32_t right = loser_tree_play(tree, 2 * node + 1);
+  if (loser_tree_beats(tree, left, right)) {
+    tree->losers[node] = right;
+    return left;
+  }
+  tree->losers[node] = left;
+  return right;
+}
+
+void loser_tree_init(LoserTree* tree, SortEntry** heads, uint32_t num_runs,
+                     bool descending) {
+  tree->heads = heads;
+  tree->num_runs = num_runs;
+  tree->descending = descending;
+  tree->losers = malloc(num_runs * sizeof(uint32_t));
+  tree->losers[0] = loser_tree_play(tree, 1);
+}
+
+// Replays the matches on the path from the winning run to the root after
+// the caller moved that run's head on.
+void loser_tree_replay(LoserTree* tree) {
+  uint32_t winner = tree->losers[0];
+  for (uint32_t node = (winner + tree->num_runs) / 2; node > 0; node /= 2) {
+    if (loser_tree_beats(tree, tree->losers[node], winner)) {
+      uint32_t swap = tree->losers[node];
+      tree->losers[node] = winner;
+      winner = swap;
+    }
+  }
+  tree->losers[0] = winner;
+}
+
+void loser_tree_free(LoserTree* tree) {
+  free(tree->losers);
+}
+
+// Sorts the buffered rows in slices on up to SORT_THREADS threads and
+// merges the slices with a loser tree. Returns the row positions in
+// output order, charged to the workspace until sort_order_free.
+uint32_t* sort_row_buffer(RowBuffer* buffer, OrderBy* order_by) {
+  uint32_t count = buffer->count;
+  uint64_t workspace = (uint64_t)count * (2 * sizeof(SortEntry) + sizeof(uint32_t));
+  memory_charge(MEMORY_WORKSPACE, workspace);
+  SortEntry* entries = malloc(count * sizeof(SortEntry));
+  SortEntry* scratch = malloc(count * sizeof(SortEntry));
+  for (uint32_t i = 0; i < count; i++) {
+    entries[i] = sort_entry(&(buffer->rows[i]), order_by->column, i);
+  }
+
+  uint32_t num_runs = count / SORT_MIN_PARTITION_ROWS;
+  if (num_runs > SORT_THREADS) num_runs = SORT_THREADS;
+  if (num_runs == 0) num_runs = 1;
+  SortPartition runs[SORT_THREADS];
+  pthread_t threads[SORT_THREADS];
+  for (uint32_t t = 0; t < num_runs; t++) {
+    uint32_t start = (uint64_t)count * t / num_runs;
+    uint32_t end = (uint64_t)count * (t + 1) / num_runs;
+    runs[t] = (SortPartition){entries + start, scratch + start, end - start,
+                              order_by->descending};
+    pthread_create(&threads[t], NULL, sort_partition, &runs[t]);
+  }
+  for (uint32_t t = 0; t < num_runs; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  uint32_t* order = malloc((count + 1) * sizeof(uint32_t));
+  uint32_t positions[SORT_THREADS] = {0};
+  SortEntry* heads[SORT_THREADS];
+  for (uint32_t t = 0; t < num_runs; t++) {
+    heads[t] = runs[t].count > 0 ? runs[t].entries : NULL;
+  }
+  uint32_t n = 0;
+  LoserTree tree;
+  loser_tree_init(&tree, heads, num_runs, order_by->descending);
+  for (uint32_t w; heads[w = tree.losers[0]] != NULL;) {
+    order[n++] = heads[w]->index;
+    positions[w]++;
+    heads[w] = positions[w] < runs[w].count ? &(runs[w].entries[positions[w]]) : NULL;
+    loser_tree_replay(&tree);
+  }
+  loser_tree_free(&tree);
+  free(entries);
+  free(scratch);
+  memory_release(MEMORY_WORKSPACE, (uint64_t)count * 2 * sizeof(SortEntry));
+  return order;
+}
+
+void sort_order_free(uint32_t* order, uint32_t count) {
+  free(order);
+  memory_release(MEMORY_WORKSPACE, (uint64_t)count * sizeof(uint32_t));
+}
+
+void print_sorted_rows(RowBuffer* buffer, OrderBy* order_by) {
+  if (buffer->count == 0) {
+    return;
+  }
+  uint32_t* order = sort_row_buffer(buffer, order_by);
+  for (uint32_t i = 0; i < buffer->count; i++) {
+    print_row(&(buffer->rows[order[i]]));
+  }
+  sort_order_free(order, buffer->count);
+}
+
+// Writes the buffered rows to the spill file as one sorted run.
+void row_buffer_spill(RowBuffer* buffer, OrderBy* order_by) {
+  if (buffer->spill == NULL && (buffer->spill = tmpfile()) == NULL) {
+    printf("Unable to open sort spill file\n");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t* order = sort_row_buffer(buffer, order_by);
+  for (uint32_t i = 0; i < buffer->count; i++) {
+    if (fwrite(&(buffer->rows[order[i]]), sizeof(Row), 1, buffer->spill) != 1) {
+      printf("Error writing sort spill file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  sort_order_free(order, buffer->count);
+  buffer->run_sizes =
+      realloc(buffer->run_sizes, (buffer->num_runs + 1) * sizeof(uint32_t));
+  buffer->run_sizes[buffer->num_runs++] = buffer->count;
+  buffer->count = 0;
+  memory_accountant.sort_spills++;
+}
+
+// Points the reader's head at its next row, reading more of the run when
+// the rows buffered are used up. False once the run is.
+bool spill_reader_load(FILE* spill, SpillReader* reader, Column column) {
+  if (reader->position == reader->buffered) {
+    if (reader->remaining == 0) {
+      return false;
+    }
+    uint32_t count =
+        reader->remaining < reader->capacity ? reader->remaining : reader->capacity;
+    size_t bytes = count * sizeof(Row);
+    if (pread(fileno(spill), reader->rows, bytes, reader->offset) != (ssize_t)bytes) {
+      printf("Error reading sort spill file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    reader->offset += bytes;
+    reader->remaining -= count;
+    reader->position = 0;
+    reader->buffered = count;
+  }
+  // Ties break on position in the file, which keeps them in scan order.
+  uint32_t file_row =
+      reader->offset / sizeof(Row) - reader->buffered + reader->position;
+  reader->head = sort_entry(&(reader->rows[reader->position]), column, file_row);
+  return true;
+}
+
+// Writes what is still buffered as the last run, then merges every run
+// from the spill file with up to SORT_MERGE_ROWS rows of each in memory,
+// fewer if the workspace share has no room for that many.
+void print_spilled_rows(RowBuffer* buffer, OrderBy* order_by) {
+  if (buffer->count > 0) {
+    row_buffer_spill(buffer, order_by);
+  }
+  memory_release(MEMORY_WORKSPACE, (uint64_t)buffer->allocated * sizeof(Row));
+  free(buffer->rows);
+  buffer->rows = NULL;
+  buffer->allocated = 0;
+  if (fflush(buffer->spill) != 0) {
+    printf("Error writing sort spill file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t num_runs = buffer->num_runs;
+  uint64_t merge_rows = SORT_MERGE_ROWS;
+  if (memory_accountant.budget > 0) {
+    uint64_t limit = memory_limit(MEMORY_WORKSPACE);
+    uint64_t used = memory_accountant.used[MEMORY_WORKSPACE];
+    uint64_t room = limit > used ? (limit - used) / ((uint64_t)num_runs * sizeof(Row)) : 0;
+    merge_rows = room < 1 ? 1 : room < SORT_MERGE_ROWS ? room : SORT_MERGE_ROWS;
+  }
+  uint64_t workspace =
+      (uint64_t)num_runs *
+      (sizeof(SpillReader) + sizeof(SortEntry*) + merge_rows * sizeof(Row));
+  memory_charge(MEMORY_WORKSPACE, workspace);
+  SpillReader* readers = calloc(num_runs, sizeof(SpillReader));
+  SortEntry** heads = malloc(num_runs * sizeof(SortEntry*));
+  off_t offset = 0;
+  for (uint32_t r = 0; r < num_runs; r++) {
+    readers[r].capacity = merge_rows;
+    readers[r].rows = malloc(merge_rows * sizeof(Row));
+    readers[r].offset = offset;
+    readers[r].remaining = buffer->run_sizes[r];
+    offset += (off_t)buffer->run_sizes[r] * sizeof(Row);
+    heads[r] = spill_reader_load(buffer->spill, &readers[r], order_by->column)
+                   ? &(readers[r].head)
+                   : NULL;
+  }
+  LoserTree tree;
+  loser_tree_init(&tree, heads, num_runs, order_by->descending);
+  for (uint32_t w; heads[w = tree.losers[0]] != NULL;) {
+    SpillReader* reader = &readers[w];
+    print_row(&(reader->rows[reader->position++]));
+    if (!spill_reader_load(buffer->spill, reader, order_by->column)) {
+      heads[w] = NULL;
+    }
+    loser_tree_replay(&tree);
+  }
+  loser_tree_free(&tree);
+  for (uint32_t r = 0; r < num_runs; r++) {
+    free(readers[r].rows);
+  }
+  free(heads);
+  free(readers);
+  memory_release(MEMORY_WORKSPACE, workspace);
+}
+
+// Sends one matching row to the output or to the aggregate being computed.
+void select_emit(Statement* statement, Row* row, SelectOutput* output) {
+  Aggregate* aggregate = &(statement->aggregate);
+  switch (aggregate->type) {
+    case (AGGREGATE_NONE):
+      if (statement->order_by.active) {
+        row_buffer_append(&(output->ordered), row, &(statement->order_by));
+      } else {
+        print_row(row);
+      }
+      break;
+    case (AGGREGATE_APPROX_COUNT_DISTINCT):
+      hll_add(&(output->hll), hash_column(row, aggregate->column));
+      break;
+    case (AGGREGATE_APPROX_PERCENTILE):
+      kll_add(&(output->kll), row->id);
+      break;
+  }
+}
+
+void handle_interrupt(int signal_number) {
+  (void)signal_number;
+  if (scheduler.console != NULL) {
+    __atomic_store_n(&(scheduler.console->cancel_requested), 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Starts the clock on a statement of the session holding the executor,
+// under that session's timeout.
+void statement_begin() {
+  Session* session = scheduler.running;
+  __atomic_store_n(&(session->cancel_requested), 0, __ATOMIC_RELAXED);
+  session->deadline =
+      session->timeout_ms > 0 ? monotonic_millis() + session->timeout_ms : 0;
+  statement_work = (StatementWork){0, 0};
+}
+
+// Whether the running statement should stop, and why. Long statements
+// poll this between pages.
+ExecuteResult statement_interrupted() {
+  Session* session = scheduler.running;
+  if (__atomic_load_n(&(session->cancel_requested), __ATOMIC_RELAXED)) {
+    return EXECUTE_CANCELLED;
+  }
+  if (session->deadline > 0 && monotonic_millis() >= session->deadline) {
+    return EXECUTE_TIMED_OUT;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+void select_output_init(SelectOutput* output) {
+  hll_init(&(output->hll));
+  kll_init(&(output->kll));
+  output->ordered = (RowBuffer){NULL, 0, 0, NULL, NULL, 0};
+}
+
+// Feeds the rows of table that a select matches to its output or
+// aggregate, or prints the plan when explaining. Stops early, at a page
+// boundary, if the statement is cancelled or runs out of time.
+ExecuteResult select_rows(Statement* statement, Table* table,
+                          SelectOutput* output) {
+    QueryPlan plan = plan_select(statement, table);
+    if (statement->explain) {
+      print_plan(&plan, table);
+      roaring_free(&(plan.matches));
+      return EXECUTE_SUCCESS;
+    }
+
+    FileHeader* header = &(table->pager->header);
+    IdRange* range = &(statement->id_range);
+
+    TableSample* sample = &(statement->sample);
+    Cursor* cursor = table_start(table);
+    Row row;
+    ExecuteResult result = EXECUTE_SUCCESS;
+    if (plan.path == PLAN_INDEX_LOOKUP || plan.path == PLAN_BITMAP ||
+        plan.path == PLAN_CRACKED || plan.path == PLAN_INDEX_RANGE) {
+      // Visit only the rows an index names, in row order.
+      uint32_t num_candidates = 0;
+      uint32_t* candidates;
+      if (plan.path != PLAN_INDEX_LOOKUP) {
+        num_candidates = roaring_cardinality(&(plan.matches));
+        candidates = malloc((num_candidates + 1) * sizeof(uint32_t));
+        roaring_values(&(plan.matches), candidates);
+      } else {
+        ArtLeaf* leaf = art_lookup(table->id_index, range->min_id);
+        num_candidates = leaf != NULL ? leaf->num_rows : 0;
+        candidates = malloc((num_candidates + 1) * sizeof(uint32_t));
+        if (leaf != NULL) {
+          memcpy(candidates, leaf->rows, num_candidates * sizeof(uint32_t));
+        }
+      }
+      for (uint32_t i = 0; i < num_candidates; i++) {
+        cursor->row_num = candidates[i];
+        if (i == 0 || candidates[i] / ROWS_PER_PAGE !=
+                          candidates[i - 1] / ROWS_PER_PAGE) {
+          pager_trim(table->pager);
+          scheduler_yield();
+          if ((result = statement_interrupted()) != EXECUTE_SUCCESS) {
+            break;
+          }
+        }
+        if ((sample->method == SAMPLE_SYSTEM &&
+             !sample_includes(sample, cursor_page_num(cursor))) ||
+            (sample->method == SAMPLE_BERNOULLI &&
+             !sample_includes(sample, cursor->row_num))) {
+          continue;
+        }
+        deserialize_row(cursor_value(cursor), &row);
+        statement_work.rows_scanned++;
+        if ((range->active &&
+             (row.id < range->min_id || row.id > range->max_id)) ||
+            !row_matches_filters(statement, &row)) {
+          continue;
+        }
+        select_emit(statement, &row, output);
+      }
+      free(candidates);
+      cursor->end_of_table = true;
+    } else if (plan.path == PLAN_EARLY_STOP && table->learned.num_segments > 0) {
+      // Seek straight to the page holding the first id in range. Start at
+      // the top of the page so that page-level sampling still applies.
+      cursor->row_num = learned_lower_bound(table, range->min_id);
+      cursor->row_num -= cursor->row_num % ROWS_PER_PAGE;
+      cursor->end_of_table = cursor->row_num >= table->num_rows;
+    }
+    while (!(cursor->end_of_table)) {
+      uint32_t page_num = cursor_page_num(cursor);
+      if (cursor->row_num % ROWS_PER_PAGE == 0) {
+        pager_trim(table->pager);
+        scheduler_yield();
+        if ((result = statement_interrupted()) != EXECUTE_SUCCESS) {
+          break;
+        }
+      }
+      if (cursor->row_num % ROWS_PER_PAGE == 0 &&
+          ((plan.path != PLAN_FULL_SCAN &&
+            !zone_may_match(header, page_num, range)) ||
+           (sample->method == SAMPLE_SYSTEM &&
+            !sample_includes(sample, page_num)))) {
+        // Skip the whole page without reading it.
+        cursor->row_num += ROWS_PER_PAGE - 1;
+        cursor_advance(cursor);
+        continue;
+      }
+      if (sample->method == SAMPLE_BERNOULLI &&
+          !sample_includes(sample, cursor->row_num)) {
+        cursor_advance(cursor);
+        continue;
+      }
+      deserialize_row(cursor_value(cursor), &row);
+      statement_work.rows_scanned++;
+      if (range->active && row.id > range->max_id &&
+          plan.path == PLAN_EARLY_STOP) {
+        break;
+      }
+      if (!range->active ||
+          (row.id >= range->min_id && row.id <= range->max_id)) {
+        select_emit(statement, &row, output);
+      }
+      cursor_advance(cursor);
+    }
+
+    roaring_free(&(plan.matches));
+    free(cursor);
+    return result;
+}
+
+void select_output_free(SelectOutput* output) {
+  RowBuffer* ordered = &(output->ordered);
+  kll_free(&(output->kll));
+  memory_release(MEMORY_WORKSPACE, (uint64_t)ordered->allocated * sizeof(Row));
+  free(ordered->rows);
+  if (ordered->spill != NULL) {
+    fclose(ordered->spill);
+  }
+  free(ordered->run_sizes);
+}
+
+void select_finish(Statement* statement, SelectOutput* output) {
+  Aggregate* aggregate = &(statement->aggregate);
+  OrderBy* order_by = &(statement->order_by);
+  KllSketch* kll = &(output->kll);
+  if (statement->explain) {
+    if (order_by->active) {
+      const char* names[] = {"id", "username", "email"};
+      printf("Sort: %s%s\n", names[order_by->column],
+             order_by->descending ? " desc" : "");
+    }
+  } else if (order_by->active && output->ordered.num_runs > 0) {
+    print_spilled_rows(&(output->ordered), order_by);
+  } else if (order_by->active) {
+    print_sorted_rows(&(output->ordered), order_by);
+  } else if (aggregate->type == AGGREGATE_APPROX_COUNT_DISTINCT) {
+    printf("(%lu)\n", (unsigned long)hll_estimate(&(output->hll)));
+  } else if (aggregate->type == AGGREGATE_APPROX_PERCENTILE) {
+    // Like approx_count_distinct, one row even when nothing matched.
+    if (kll->count > 0) {
+      printf("(%u)\n", kll_quantile(kll, aggregate->percentile));
+    } else {
+      printf("(NULL)\n");
+    }
+  }
+  select_output_free(output);
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table) {
+  SelectOutput output;
+  select_output_init(&output);
+  ExecuteResult result = select_rows(statement, table, &output);
+  if (result == EXECUTE_SUCCESS) {
+    select_finish(statement, &output);
+  } else {
+    select_output_free(&output);
+  }
+  return result;
+}
+
+ExecuteResult execute_local_statement(Statement* statement, Table *table) {
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      return execute_insert(statement, table);
+    case (STATEMENT_SELECT):
+      return execute_select(statement, table);
+    case (STATEMENT_ANALYZE):
+      return execute_analyze(table);
+    case (STATEMENT_DROP_PARTITION):
+      return EXECUTE_NO_PARTITION;
+    case (STATEMENT_CREATE_INDEX):
+      return execute_create_index(statement, table);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+int64_t monotonic_millis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint8_t* raft_entry(Raft* raft, uint64_t index) {
+  return raft->entries + (index - 1) * RAFT_ENTRY_SIZE;
+}
+
+uint64_t raft_term_at(Raft* raft, uint64_t index) {
+  if (index == 0 || index > raft->num_entries) {
+    return 0;
+  }
+  return ((RaftEntryHeader*)raft_entry(raft, index))->term;
+}
+
+void raft_save_state(Raft* raft) {
+  uint64_t state[2] = {raft->current_term, (uint64_t)(int64_t)raft->voted_for};
+  if (pwrite(raft->state_fd, state, sizeof(state), 0) != sizeof(state)) {
+    printf("Error writing raft state: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager_sync(raft->state_fd);
+}
+
+// Drops entries after index, both in memory and on disk.
+void raft_truncate(Raft* raft, uint64_t index) {
+  raft->num_entries = index;
+  if (raft->synced_index > index) {
+    raft->synced_index = index;
+  }
+  if (ftruncate(raft->log_fd, index * RAFT_ENTRY_SIZE) == -1) {
+    printf("Error truncating raft log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void raft_push_entry(Raft* raft, uint8_t* entry) {
+  if (raft->num_entries == raft->allocated_entries) {
+    raft->allocated_entries = raft->allocated_entries ? raft->allocated_entries * 2 : 64;
+    raft->entries = realloc(raft->entries, raft->allocated_entries * RAFT_ENTRY_SIZE);
+  }
+  raft->num_entries++;
+  memcpy(raft_entry(raft, raft->num_entries), entry, RAFT_ENTRY_SIZE);
+}
+
+// Appends an entry without syncing; callers sync once per batch. The
+// checksum is set here so that every entry, no-ops included, survives
+// the check made when the log is loaded.
+void raft_append(Raft* raft, uint8_t* entry) {
+  ((RaftEntryHeader*)entry)->checksum =
+      checksum(entry + sizeof(RaftEntryHeader), ROW_SIZE);
+  raft_push_entry(raft, entry);
+  off_t offset = (off_t)(raft->num_entries - 1) * RAFT_ENTRY_SIZE;
+  if (pwrite(raft->log_fd, entry, RAFT_ENTRY_SIZE, offset) != RAFT_ENTRY_SIZE) {
+    printf("Error writing raft log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void raft_sync_log(Raft* raft) {
+  if (raft->synced_index < raft->num_entries) {
+    pager_sync(raft->log_fd);
+    raft->synced_index = raft->num_entries;
+  }
+}
+
+void raft_send(Raft* raft, uint32_t peer, RaftMessage* message,
+               uint64_t first_entry, uint32_t num_entries) {
+  uint8_t buffer[sizeof(RaftMessage) + RAFT_BATCH_ENTRIES * RAFT_ENTRY_SIZE];
+  message->from = raft->id;
+  message->term = raft->current_term;
+  message->num_entries = num_entries;
+  memcpy(buffer, message, sizeof(RaftMessage));
+  if (num_entries > 0) {
+    memcpy(buffer + sizeof(RaftMessage), raft_entry(raft, first_entry),
+           num_entries * RAFT_ENTRY_SIZE);
+  }
+  // Lost datagrams are recovered by retries and heartbeats.
+  sendto(raft->socket, buffer, sizeof(RaftMessage) + num_entries * RAFT_ENTRY_SIZE,
+         0, (struct sockaddr*)&(raft->peers[peer]), sizeof(struct sockaddr_in));
+}
+
+void raft_reset_election_timer(Raft* raft) {
+  raft->election_deadline = monotonic_millis() + RAFT_ELECTION_TIMEOUT_MS +
+      next_random(&(raft->random_state)) % RAFT_ELECTION_TIMEOUT_MS;
+}
+
+void raft_become_follower(Raft* raft, uint64_t term) {
+  if (term > raft->current_term) {
+    raft->current_term = term;
+    raft->voted_for = -1;
+    raft_save_state(raft);
+  }
+  if (raft->role == RAFT_LEADER) {
+    raft->leader_id = -1;
+    // Unconfirmed reads are left to time out on the followers that asked.
+    raft->num_pending_reads = 0;
+  }
+  raft->role = RAFT_FOLLOWER;
+  pthread_cond_broadcast(&(raft->changed));
+}
+
+// Sends every peer the entries it is missing, up to RAFT_PIPELINE_BATCHES
+// batches ahead of its last acknowledgement, without waiting for replies
+// in between. A heartbeat goes out to peers with nothing to send.
+void raft_replicate(Raft* raft, bool heartbeat) {
+  int64_t now = monotonic_millis();
+  for (uint32_t peer = 0; peer < raft->num_nodes; peer++) {
+    if (peer == raft->id) {
+      continue;
+    }
+    if (raft->next_index[peer] > raft->match_index[peer] + 1 &&
+        now - raft->last_ack[peer] > 4 * RAFT_HEARTBEAT_MS) {
+      // Replies stopped coming; something in flight was lost.
+      raft->next_index[peer] = raft->match_index[peer] + 1;
+    }
+
+    bool sent = false;
+    while (raft->next_index[peer] <= raft->num_entries &&
+           raft->next_index[peer] - raft->match_index[peer] - 1 <
+               RAFT_BATCH_ENTRIES * RAFT_PIPELINE_BATCHES) {
+      uint64_t next = raft->next_index[peer];
+      uint64_t count = raft->num_entries - next + 1;
+      if (count > RAFT_BATCH_ENTRIES) {
+        count = RAFT_BATCH_ENTRIES;
+      }
+      RaftMessage message = {0};
+      message.type = RAFT_APPEND_ENTRIES;
+      message.index = next - 1;
+      message.log_term = raft_term_at(raft, next - 1);
+      message.commit = raft->commit_index;
+      message.round = raft->round;
+      raft_send(raft, peer, &message, next, count);
+      raft->next_index[peer] += count;
+      sent = true;
+    }
+    if (!sent && heartbeat) {
+      RaftMessage message = {0};
+      message.type = RAFT_APPEND_ENTRIES;
+      message.index = raft->next_index[peer] - 1;
+      message.log_term = raft_term_at(raft, message.index);
+      message.commit = raft->commit_index;
+      message.round = raft->round;
+      raft_send(raft, peer, &message, 0, 0);
+    }
+  }
+}
+
+// Raises confirmed_round to the highest round a majority, this leader
+// included, has acknowledged in the current term, then answers the
+// follower reads that round covers.
+void raft_advance_confirmed(Raft* raft) {
+  for (uint32_t candidate = 0; candidate < raft->num_nodes; candidate++) {
+    uint64_t round = candidate == raft->id ? raft->round
+                                           : raft->acked_round[candidate];
+    if (round <= raft->confirmed_round) {
+      continue;
+    }
+    uint32_t acks = 0;
+    for (uint32_t node = 0; node < raft->num_nodes; node++) {
+      uint64_t acked = node == raft->id ? raft->round : raft->acked_round[node];
+      if (acked >= round) {
+        acks++;
+      }
+    }
+    if (acks * 2 > raft->num_nodes) {
+      raft->confirmed_round = round;
+      pthread_cond_broadcast(&(raft->changed));
+    }
+  }
+
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < raft->num_pending_reads; i++) {
+    RaftPendingRead* read = &(raft->pending_reads[i]);
+    if (read->round > raft->confirmed_round) {
+      raft->pending_reads[kept++] = *read;
+      continue;
+    }
+    RaftMessage reply = {0};
+    reply.type = RAFT_READ_INDEX_REPLY;
+    reply.index = read->read_index;
+    reply.commit = read->request;  // Echo the request id
+    raft_send(raft, read->from, &reply, 0, 0);
+  }
+  raft->num_pending_reads = kept;
+}
+
+// Leader only: starts a heartbeat round. Once a majority acks it in this
+// term, nothing newer than the commit index at this moment can have been
+// committed by another leader.
+uint64_t raft_start_round(Raft* raft) {
+  uint64_t round = ++(raft->round);
+  raft_replicate(raft, true);
+  raft_advance_confirmed(raft);
+  return round;
+}
+
+// Commits the highest entry of the current term stored on a majority.
+void raft_advance_commit(Raft* raft) {
+  for (uint64_t index = raft->num_entries; index > raft->commit_index; index--) {
+    if (raft_term_at(raft, index) != raft->current_term) {
+      break;
+    }
+    uint32_t replicas = raft->synced_index >= index ? 1 : 0;
+    for (uint32_t peer = 0; peer < raft->num_nodes; peer++) {
+      if (peer != raft->id && raft->match_index[peer] >= index) {
+        replicas++;
+      }
+    }
+    if (replicas * 2 > raft->num_nodes) {
+      raft->commit_index = index;
+      break;
+    }
+  }
+}
+
+void raft_start_election(Raft* raft) {
+  raft->role = RAFT_CANDIDATE;
+  raft->current_term++;
+  raft->voted_for = raft->id;
+  raft->votes = 1;
+  raft->leader_id = -1;
+  raft_save_state(raft);
+  raft_reset_election_timer(raft);
+
+  RaftMessage message = {0};
+  message.type = RAFT_REQUEST_VOTE;
+  message.index = raft->num_entries;
+  message.log_term = raft_term_at(raft, raft->num_entries);
+  for (uint32_t peer = 0; peer < raft->num_nodes; peer++) {
+    if (peer != raft->id) {
+      raft_send(raft, peer, &message, 0, 0);
+    }
+  }
+}
+
+void raft_become_leader(Raft* raft) {
+  raft->role = RAFT_LEADER;
+  raft->leader_id = raft->id;
+  int64_t now = monotonic_millis();
+  for (uint32_t peer = 0; peer < raft->num_nodes; peer++) {
+    raft->next_index[peer] = raft->num_entries + 1;
+    raft->match_index[peer] = 0;
+    raft->last_ack[peer] = now;
+    raft->acked_round[peer] = 0;
+  }
+
+  // Entries from earlier terms only commit along with one from this term.
+  uint8_t entry[RAFT_ENTRY_SIZE];
+  memset(entry, 0, RAFT_ENTRY_SIZE);
+  RaftEntryHeader* header = (RaftEntryHeader*)entry;
+  header->term = raft->current_term;
+  header->type = RAFT_ENTRY_NOOP;
+  raft_append(raft, entry);
+  raft_replicate(raft, true);
+  raft->next_heartbeat = now + RAFT_HEARTBEAT_MS;
+  pthread_cond_broadcast(&(raft->changed));
+}
+
+void raft_handle_append(Raft* raft, RaftMessage* message, uint8_t* entries) {
+  RaftMessage reply = {0};
+  reply.type = RAFT_APPEND_REPLY;
+
+  if (message->term < raft->current_term) {
+    raft_send(raft, message->from, &reply, 0, 0);
+    return;
+  }
+  raft_become_follower(raft, message->term);
+  raft->leader_id = message->from;
+  raft_reset_election_timer(raft);
+  reply.round = message->round;
+
+  uint64_t prev = message->index;
+  if (prev > raft->num_entries || raft_term_at(raft, prev) != message->log_term) {
+    reply.index = prev > raft->num_entries ? raft->num_entries : prev - 1;
+    raft_send(raft, message->from, &reply, 0, 0);
+    return;
+  }
+
+  for (uint32_t i = 0; i < message->num_entries; i++) {
+    uint64_t index = prev + 1 + i;
+    uint8_t* entry = entries + i * RAFT_ENTRY_SIZE;
+    if (index <= raft->num_entries) {
+      if (raft_term_at(raft, index) == ((RaftEntryHeader*)entry)->term) {
+        continue;
+      }
+      raft_truncate(raft, index - 1);
+    }
+    raft_append(raft, entry);
+  }
+  raft_sync_log(raft);
+
+  uint64_t last_new = prev + message->num_entries;
+  if (message->commit > raft->commit_index) {
+    raft->commit_index = message->commit < last_new ? message->commit : last_new;
+  }
+  reply.success = 1;
+  reply.index = last_new;
+  raft_send(raft, message->from, &reply, 0, 0);
+}
+
+void raft_handle_message(Raft* raft, RaftMessage* message, uint8_t* entries) {
+  if (message->from >= raft->num_nodes || message->from == raft->id) {
+    return;
+  }
+  if (message->term > raft->current_term) {
+    raft_become_follower(raft, message->term);
+  }
+
+  RaftMessage reply = {0};
+  switch (message->type) {
+    case (RAFT_REQUEST_VOTE): {
+      uint64_t last_term = raft_term_at(raft, raft->num_entries);
+      bool up_to_date = message->log_term > last_term ||
+          (message->log_term == last_term && message->index >= raft->num_entries);
+      reply.type = RAFT_VOTE;
+      if (message->term == raft->current_term && up_to_date &&
+          (raft->voted_for == -1 || raft->voted_for == (int32_t)message->from)) {
+        raft->voted_for = message->from;
+        raft_save_state(raft);
+        raft_reset_election_timer(raft);
+        reply.success = 1;
+      }
+      raft_send(raft, message->from, &reply, 0, 0);
+      break;
+    }
+    case (RAFT_VOTE):
+      if (raft->role == RAFT_CANDIDATE && message->term == raft->current_term &&
+          message->success) {
+        raft->votes++;
+        if (raft->votes * 2 > raft->num_nodes) {
+          raft_become_leader(raft);
+        }
+      }
+      break;
+    case (RAFT_APPEND_ENTRIES):
+      raft_handle_append(raft, message, entries);
+      break;
+    case (RAFT_APPEND_REPLY):
+      if (raft->role != RAFT_LEADER || message->term != raft->current_term) {
+        break;
+      }
+      raft->last_ack[message->from] = monotonic_millis();
+      if (message->round > raft->acked_round[message->from]) {
+        raft->acked_round[message->from] = message->round;
+        raft_advance_confirmed(raft);
+      }
+      if (message->success) {
+        if (message->index > raft->match_index[message->from]) {
+          raft->match_index[message->from] = message->index;
+        }
+        if (raft->next_index[message->from] <= message->index) {
+          raft->next_index[message->from] = message->index + 1;
+        }
+        raft_advance_commit(raft);
+      } else {
+        uint64_t next = message->index + 1;
+        if (next <= raft->match_index[message->from]) {
+          next = raft->match_index[message->from] + 1;
+        }
+        if (next < raft->next_index[message->from]) {
+          raft->next_index[message->from] = next;
+        }
+        raft_replicate(raft, false);
+      }
+      break;
+    case (RAFT_READ_INDEX):
+      // Only answer once an entry of this term has committed, so the
+      // commit index covers everything earlier leaders acknowledged, and
+      // a majority has since confirmed this node still leads.
+      if (raft->role == RAFT_LEADER &&
+          raft_term_at(raft, raft->commit_index) == raft->current_term &&
+          raft->num_pending_reads < RAFT_MAX_PENDING_READS) {
+        RaftPendingRead* read = &(raft->pending_reads[raft->num_pending_reads++]);
+        read->from = message->from;
+        read->request = message->commit;
+        read->read_index = raft->commit_index;
+        read->round = raft->round + 1;  // The round started next
+        raft_start_round(raft);
+      }
+      break;
+    case (RAFT_READ_INDEX_REPLY):
+      if (message->commit == raft->read_request) {
+        raft->read_index = message->index;
+        raft->read_reply = message->commit;
+        pthread_cond_broadcast(&(raft->changed));
+      }
+      break;
+  }
+}
+
+void raft_apply_committed(Raft* raft, Table* table) {
+  while (raft->last_applied < raft->commit_index) {
+    raft->last_applied++;
+    uint8_t* entry = raft_entry(raft, raft->last_applied);
+    if (((RaftEntryHeader*)entry)->type == RAFT_ENTRY_INSERT) {
+      Row row;
+      deserialize_row(entry + sizeof(RaftEntryHeader), &row);
+      table_insert_row(table, &row);
+    }
+    pthread_cond_broadcast(&(raft->changed));
+  }
+}
+
+void* raft_run(void* arg) {
+  Table* table = arg;
+  Raft* raft = table->raft;
+  uint8_t buffer[sizeof(RaftMessage) + RAFT_BATCH_ENTRIES * RAFT_ENTRY_SIZE];
+
+  pthread_mutex_lock(&(raft->lock));
+  while (raft->running) {
+    pthread_mutex_unlock(&(raft->lock));
+    struct pollfd readable = {raft->socket, POLLIN, 0};
+    poll(&readable, 1, 10);
+    pthread_mutex_lock(&(raft->lock));
+
+    ssize_t size;
+    while ((size = recv(raft->socket, buffer, sizeof(buffer), MSG_DONTWAIT)) >=
+           (ssize_t)sizeof(RaftMessage)) {
+      RaftMessage message;
+      memcpy(&message, buffer, sizeof(RaftMessage));
+      if (message.num_entries <= RAFT_BATCH_ENTRIES &&
+          size == (ssize_t)(sizeof(RaftMessage) +
+                            message.num_entries * RAFT_ENTRY_SIZE)) {
+        raft_handle_message(raft, &message, buffer + sizeof(RaftMessage));
+      }
+    }
+
+    int64_t now = monotonic_millis();
+    if (raft->role == RAFT_LEADER) {
+      // One fsync covers everything appended since the last tick.
+      raft_sync_log(raft);
+      raft_advance_commit(raft);
+      bool heartbeat = now >= raft->next_heartbeat;
+      if (heartbeat) {
+        raft->next_heartbeat = now + RAFT_HEARTBEAT_MS;
+      }
+      raft_replicate(raft, heartbeat);
+    } else if (now >= raft->election_deadline) {
+      raft_start_election(raft);
+      if (raft->num_nodes == 1) {
+        raft_become_leader(raft);
+      }
+    }
+
+    raft_apply_committed(raft, table);
+  }
+  pthread_mutex_unlock(&(raft->lock));
+  return NULL;
+}
+
+bool raft_parse_peers(Raft* raft, char* peers) {
+  raft->num_nodes = 0;
+  for (char* peer = strtok(peers, ","); peer != NULL; peer = strtok(NULL, ",")) {
+    char* colon = strrchr(peer, ':');
+    if (colon == NULL || raft->num_nodes == RAFT_MAX_NODES) {
+      return false;
+    }
+    *colon = '\0';
+    struct sockaddr_in* address = &(raft->peers[raft->num_nodes++]);
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, peer, &(address->sin_addr)) != 1) {
+      return false;
+    }
+  }
+  return raft->num_nodes > 0;
+}
+
+// node_id counts from 1 and picks this node's own address out of peers.
+bool raft_start(Table* table, const char* filename, uint32_t node_id,
+                char* peers) {
+  Raft* raft = calloc(1, sizeof(Raft));
+  if (!raft_parse_peers(raft, peers) || node_id < 1 || node_id > raft->num_nodes) {
+    free(raft);
+    return false;
+  }
+  raft->id = node_id - 1;
+  raft->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (raft->socket == -1 ||
+      bind(raft->socket, (struct sockaddr*)&(raft->peers[raft->id]),
+           sizeof(struct sockaddr_in)) == -1) {
+    free(raft);
+    return false;
+  }
+
+  char* path = malloc(strlen(filename) + 12);
+  sprintf(path, "%s-raft", filename);
+  raft->log_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  sprintf(path, "%s-raft-state", filename);
+  raft->state_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  free(path);
+  if (raft->log_fd == -1 || raft->state_fd == -1) {
+    printf("Unable to open raft files\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t state[2] = {0, (uint64_t)-1};
+  pread(raft->state_fd, state, sizeof(state), 0);
+  raft->current_term = state[0];
+  raft->voted_for = (int32_t)(int64_t)state[1];
+
+  // Load the log, stopping at the first entry torn by a crash.
+  uint8_t entry[RAFT_ENTRY_SIZE];
+  off_t offset = 0;
+  while (pread(raft->log_fd, entry, RAFT_ENTRY_SIZE, offset) == RAFT_ENTRY_SIZE &&
+         ((RaftEntryHeader*)entry)->checksum ==
+             checksum(entry + sizeof(RaftEntryHeader), ROW_SIZE)) {
+    raft_push_entry(raft, entry);
+    offset += RAFT_ENTRY_SIZE;
+  }
+  raft_truncate(raft, raft->num_entries);
+  raft->synced_index = raft->num_entries;
+
+  // Every applied insert is in the change log, so its length tells how far
+  // into the raft log this node had applied.
+  uint64_t applied_inserts = table->changes->next_seq - 1;
+  while (raft->last_applied < raft->num_entries && applied_inserts > 0) {
+    raft->last_applied++;
+    if (((RaftEntryHeader*)raft_entry(raft, raft->last_applied))->type ==
+        RAFT_ENTRY_INSERT) {
+      applied_inserts--;
+    }
+  }
+  raft->commit_index = raft->last_applied;
+
+  raft->role = RAFT_FOLLOWER;
+  raft->leader_id = -1;
+  raft->random_state = ((uint64_t)node_id << 32) ^ (uint64_t)now_micros();
+  raft_reset_election_timer(raft);
+  pthread_mutex_init(&(raft->lock), NULL);
+  pthread_cond_init(&(raft->changed), NULL);
+  raft->running = true;
+  table->raft = raft;
+  pthread_create(&(raft->thread), NULL, raft_run, table);
+  return true;
+}
+
+void raft_stop(Raft* raft) {
+  pthread_mutex_lock(&(raft->lock));
+  raft->running = false;
+  pthread_mutex_unlock(&(raft->lock));
+  pthread_join(raft->thread, NULL);
+  close(raft->socket);
+  close(raft->log_fd);
+  close(raft->state_fd);
+  free(raft->entries);
+  free(raft);
+}
+
+// Waits on raft->changed until done() holds or timeout_ms pass.
+bool raft_wait(Raft* raft, bool (*done)(Raft*, uint64_t), uint64_t arg,
+               int64_t timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (!done(raft, arg)) {
+    if (pthread_cond_timedwait(&(raft->changed), &(raft->lock), &deadline) ==
+        ETIMEDOUT) {
+      return done(raft, arg);
+    }
+  }
+  return true;
+}
+
+bool raft_applied(Raft* raft, uint64_t index) {
+  return raft->last_applied >= index;
+}
+
+bool raft_read_answered(Raft* raft, uint64_t request) {
+  return raft->read_reply == request;
+}
+
+bool raft_term_committed(Raft* raft, uint64_t term) {
+  return raft->current_term != term ||
+         raft_term_at(raft, raft->commit_index) == term;
+}
+
+bool raft_round_confirmed(Raft* raft, uint64_t round) {
+  return raft->role != RAFT_LEADER || raft->confirmed_round >= round;
+}
+
+// Leader only: replicate the row and return once a majority has stored it
+// and it has been applied here.
+ExecuteResult raft_insert(Table* table, Row* row) {
+  Raft* raft = table->raft;
+  if (raft->role != RAFT_LEADER) {
+    return EXECUTE_NOT_LEADER;
+  }
+  uint64_t pending = raft->num_entries - raft->last_applied;
+  if (table->num_rows + pending >= TABLE_MAX_ROWS) {
+    return EXECUTE_TABLE_FULL;
+  }
+
+  uint8_t entry[RAFT_ENTRY_SIZE];
+  RaftEntryHeader* header = (RaftEntryHeader*)entry;
+  header->term = raft->current_term;
+  header->type = RAFT_ENTRY_INSERT;
+  serialize_row(row, entry + sizeof(RaftEntryHeader));
+  raft_append(raft, entry);
+  uint64_t index = raft->num_entries;
+  uint64_t term = raft->current_term;
+  raft_replicate(raft, false);
+
+  if (!raft_wait(raft, raft_applied, index, RAFT_COMMIT_TIMEOUT_MS) ||
+      raft_term_at(raft, index) != term) {
+    return EXECUTE_NOT_COMMITTED;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+// Reads take the leader's commit index, confirmed by a heartbeat round
+// that a majority acks, and wait until this node has applied that far. A
+// leader cut off from the majority so can't serve a stale read.
+ExecuteResult raft_read_barrier(Raft* raft) {
+  if (raft->role == RAFT_LEADER) {
+    uint64_t term = raft->current_term;
+    if (!raft_wait(raft, raft_term_committed, term, RAFT_COMMIT_TIMEOUT_MS)) {
+      return EXECUTE_NOT_COMMITTED;
+    }
+    if (raft->role != RAFT_LEADER || raft->current_term != term) {
+      return EXECUTE_NOT_LEADER;
+    }
+    uint64_t read_index = raft->commit_index;
+    uint64_t round = raft_start_round(raft);
+    if (!raft_wait(raft, raft_round_confirmed, round, RAFT_COMMIT_TIMEOUT_MS)) {
+      return EXECUTE_NOT_COMMITTED;
+    }
+    if (raft->role != RAFT_LEADER || raft->current_term != term) {
+      return EXECUTE_NOT_LEADER;
+    }
+    return raft_wait(raft, raft_applied, read_index, RAFT_COMMIT_TIMEOUT_MS)
+               ? EXECUTE_SUCCESS
+               : EXECUTE_NOT_COMMITTED;
+  }
+  if (raft->leader_id < 0) {
+    return EXECUTE_NOT_LEADER;
+  }
+
+  RaftMessage message = {0};
+  message.type = RAFT_READ_INDEX;
+  message.commit = ++(raft->read_request);
+  raft_send(raft, raft->leader_id, &message, 0, 0);
+  if (!raft_wait(raft, raft_read_answered, raft->read_request,
+                 RAFT_COMMIT_TIMEOUT_MS) ||
+      !raft_wait(raft, raft_applied, raft->read_index, RAFT_COMMIT_TIMEOUT_MS)) {
+    return EXECUTE_NOT_COMMITTED;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult raft_execute(Statement* statement, Table* table) {
+  Raft* raft = table->raft;
+  ExecuteResult result;
+  pthread_mutex_lock(&(raft->lock));
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      result = raft_insert(table, &(statement->row_to_insert));
+      break;
+    case (STATEMENT_SELECT):
+      result = raft_read_barrier(raft);
+      if (result == EXECUTE_SUCCESS) {
+        result = execute_select(statement, table);
+      }
+      break;
+    default:
+      result = execute_local_statement(statement, table);
+      break;
+  }
+  pthread_mutex_unlock(&(raft->lock));
+  return result;
+}
+
+void print_raft_status(Raft* raft) {
+  const char* roles[] = {"follower", "candidate", "leader"};
+  pthread_mutex_lock(&(raft->lock));
+  printf("Node %d: %s, term %lu, leader %d, commit %lu, applied %lu\n",
+         raft->id + 1, roles[raft->role], (unsigned long)raft->current_term,
+         raft->leader_id + 1, (unsigned long)raft->commit_index,
+         (unsigned long)raft->last_applied);
+  pthread_mutex_unlock(&(raft->lock));
+}
+
+char* partition_path(const char* filename, uint32_t partition) {
+  size_t length = strlen(filename) + 32;
+  char* path = malloc(length);
+  snprintf(path, length, "%s-part-%u", filename, partition);
+  return path;
+}
+
+// Where partition is in the open partitions, or where it would go.
+uint32_t partition_position(Table* table, uint32_t partition) {
+  uint32_t first = 0;
+  uint32_t last = table->num_partitions;
+  while (first < last) {
+    uint32_t mid = (first + last) / 2;
+    if (table->partition_numbers[mid] < partition) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  return first;
+}
+
+// Where the first open partition after partition is.
+uint32_t partition_after(Table* table, uint32_t partition) {
+  uint32_t position = partition_position(table, partition);
+  if (position < table->num_partitions &&
+      table->partition_numbers[position] == partition) {
+    position++;
+  }
+  return position;
+}
+
+// Returns the partition holding ids from partition * partition_size on,
+// opening its file first if create is set. NULL if it does not exist and
+// is not created, or if there is no memory to track another partition.
+Table* partition_get(Table* table, uint32_t partition, bool create) {
+  uint32_t position = partition_position(table, partition);
+  if (position < table->num_partitions &&
+      table->partition_numbers[position] == partition) {
+    return table->partitions[position];
+  }
+  if (!create) {
+    return NULL;
+  }
+  if (table->num_partitions == table->allocated_partitions) {
+    uint32_t allocated =
+        table->allocated_partitions ? table->allocated_partitions * 2 : 16;
+    Table** partitions = realloc(table->partitions, allocated * sizeof(Table*));
+    if (partitions == NULL) {
+      return NULL;
+    }
+    table->partitions = partitions;
+    uint32_t* numbers =
+        realloc(table->partition_numbers, allocated * sizeof(uint32_t));
+    if (numbers == NULL) {
+      return NULL;
+    }
+    table->partition_numbers = numbers;
+    table->allocated_partitions = allocated;
+  }
+
+  char* path = partition_path(table->filename, partition);
+  Table* opened = db_open(path);
+  free(path);
+  uint32_t after = table->num_partitions - position;
+  memmove(table->partitions + position + 1, table->partitions + position,
+          after * sizeof(Table*));
+  memmove(table->partition_numbers + position + 1,
+          table->partition_numbers + position, after * sizeof(uint32_t));
+  table->partitions[position] = opened;
+  table->partition_numbers[position] = partition;
+  table->num_partitions++;
+  return opened;
+}
+
+// Opens every partition file found beside the main file.
+void partitions_load(Table* table) {
+  const char* slash = strrchr(table->filename, '/');
+  char* dir = slash == NULL ? strdup(".")
+              : slash == table->filename
+                  ? strdup("/")
+                  : strndup(table->filename, slash - table->filename);
+  const char* base = slash == NULL ? table->filename : slash + 1;
+  size_t base_length = strlen(base);
+
+  DIR* directory = opendir(dir);
+  free(dir);
+  if (directory == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    unsigned int partition;
+    int consumed = 0;
+    if (strncmp(entry->d_name, base, base_length) == 0 &&
+        sscanf(entry->d_name + base_length, "-part-%u%n", &partition,
+               &consumed) == 1 &&
+        entry->d_name[base_length + consumed] == '\0') {
+      partition_get(table, partition, true);
+    }
+  }
+  closedir(directory);
+}
+
+bool partition_may_match(Table* table, uint32_t partition, IdRange* range) {
+  if (!range->active) {
+    return true;
+  }
+  uint64_t first = (uint64_t)partition * table->pager->header.partition_size;
+  uint64_t last = first + table->pager->header.partition_size - 1;
+  return range->max_id >= first && range->min_id <= last;
+}
+
+// Runs the select on each partition its id range can touch and combines
+// the results.
+ExecuteResult execute_partitioned_select(Statement* statement, Table* table) {
+  if (statement->explain) {
+    uint32_t scanned = 0;
+    for (uint32_t i = 0; i < table->num_partitions; i++) {
+      scanned += partition_may_match(table, table->partition_numbers[i],
+                                     &(statement->id_range));
+    }
+    printf("Partitions: %d of %d\n", scanned, table->num_partitions);
+  }
+
+  // A scan parked in select_rows lets inserts run, and one may open a
+  // partition and move the later ones along, so go by partition number.
+  SelectOutput output;
+  select_output_init(&output);
+  for (uint32_t i = 0; i < table->num_partitions;) {
+    uint32_t partition = table->partition_numbers[i];
+    if (partition_may_match(table, partition, &(statement->id_range))) {
+      ExecuteResult result =
+          select_rows(statement, table->partitions[i], &output);
+      if (result != EXECUTE_SUCCESS) {
+        select_output_free(&output);
+        return result;
+      }
+    }
+    i = partition_after(table, partition);
+  }
+  select_finish(statement, &output);
+  return EXECUTE_SUCCESS;
+}
+
+// Dropping a partition only unlinks its files; no row is read or written.
+ExecuteResult execute_drop_partition(Statement* statement, Table* table) {
+  uint32_t position = partition_position(table, statement->partition);
+  if (position == table->num_partitions ||
+      table->partition_numbers[position] != statement->partition) {
+    return EXECUTE_NO_PARTITION;
+  }
+  Table* partition = table->partitions[position];
+  unlink(partition->filename);
+  unlink(partition->changes->path);
+  unlink(partition->pager->double_write_path);
+  if (partition->btree != NULL) {
+    unlink(partition->btree->path);
+  }
+  table_release(partition);
+  uint32_t after = table->num_partitions - position - 1;
+  memmove(table->partitions + position, table->partitions + position + 1,
+          after * sizeof(Table*));
+  memmove(table->partition_numbers + position,
+          table->partition_numbers + position + 1, after * sizeof(uint32_t));
+  table->num_partitions--;
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_partitioned(Statement* statement, Table* table) {
+  uint32_t partition_size = table->pager->header.partition_size;
+  switch (statement->type) {
+    case (STATEMENT_INSERT): {
+      Table* partition =
+          partition_get(table, statement->row_to_insert.id / partition_size, true);
+      if (partition == NULL) {
+        return EXECUTE_TABLE_FULL;
+      }
+      return execute_insert(statement, partition);
+    }
+    case (STATEMENT_SELECT):
+      return execute_partitioned_select(statement, table);
+    case (STATEMENT_ANALYZE):
+      for (uint32_t i = 0; i < table->num_partitions; i++) {
+        execute_analyze(table->partitions[i]);
+      }
+      return EXECUTE_SUCCESS;
+    case (STATEMENT_DROP_PARTITION):
+      return execute_drop_partition(statement, table);
+    case (STATEMENT_CREATE_INDEX):
+      for (uint32_t i = 0; i < table->num_partitions; i++) {
+        if (execute_create_index(statement, table->partitions[i]) !=
+            EXECUTE_SUCCESS) {
+          return EXECUTE_INDEX_FAILED;
+        }
+      }
+      return EXECUTE_SUCCESS;
+  }
+  return EXECUTE_SUCCESS;
+}
+
+void print_partitions(Table* table) {
+  uint32_t partition_size = table->pager->header.partition_size;
+  if (partition_size == 0) {
+    printf("Not partitioned.\n");
+    return;
+  }
+  for (uint32_t i = 0; i < table->num_partitions; i++) {
+    uint32_t partition = table->partition_numbers[i];
+    uint64_t first = (uint64_t)partition * partition_size;
+    printf("Partition %u: ids %lu-%lu, %d rows\n", partition,
+           (unsigned long)first, (unsigned long)(first + partition_size - 1),
+           table->partitions[i]->num_rows);
+  }
+}
+
+// Appends rows a page at a time: each page is filled in memory and its
+// change records reach the log in one write. Returns how many fit.
+uint32_t table_append_rows(Table* table, Row* rows, uint32_t count) {
+  uint8_t records[ROWS_PER_PAGE * CHANGE_RECORD_SIZE];
+  uint32_t appended = 0;
+  while (appended < count && table->num_rows < TABLE_MAX_ROWS) {
+    uint32_t batch = ROWS_PER_PAGE - table->num_rows % ROWS_PER_PAGE;
+    if (batch > count - appended) {
+      batch = count - appended;
+    }
+    if (batch > TABLE_MAX_ROWS - table->num_rows) {
+      batch = TABLE_MAX_ROWS - table->num_rows;
+    }
+
+    int64_t timestamp = now_micros();
+    for (uint32_t i = 0; i < batch; i++) {
+      Row* row = &(rows[appended + i]);
+      Cursor cursor = {table, table->num_rows, false};
+      void* row_bytes = cursor_value(&cursor);
+      serialize_row(row, row_bytes);
+
+      ChangeRecordHeader header;
+      memset(&header, 0, sizeof(header));
+      header.seq = table->changes->next_seq + i;
+      header.timestamp = timestamp;
+      header.row_num = cursor.row_num;
+      header.checksum = checksum(row_bytes, ROW_SIZE);
+      memcpy(records + i * CHANGE_RECORD_SIZE, &header, sizeof(header));
+      memcpy(records + i * CHANGE_RECORD_SIZE + sizeof(header), row_bytes,
+             ROW_SIZE);
+
+      table->pager->dirty[cursor_page_num(&cursor)] = true;
+      header_note_insert(&(table->pager->header), &cursor, row->id);
+      table_index_row(table, row, cursor.row_num);
+      table->num_rows += 1;
+    }
+    change_log_write(table->changes, records, batch);
+    appended += batch;
+  }
+  return appended;
+}
+
+typedef struct {
+  const char* start;
+  const char* end;
+  char delimiter;
+  bool may_have_header;  // Starts at the first line of the file
+  Row* rows;
+  uint32_t num_rows;
+  uint32_t allocated;
+  uint32_t skipped;
+} ImportChunk;
+
+// Returns the first byte in [p, end) equal to a or b, or end.
+const char* scan_for(const char* p, const char* end, char a, char b) {
+#ifdef __SSE2__
+  __m128i match_a = _mm_set1_epi8(a);
+  __m128i match_b = _mm_set1_epi8(b);
+  while (end - p >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, match_a),
+                                              _mm_cmpeq_epi8(bytes, match_b)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != a && *p != b) {
+    p++;
+  }
+  return p;
+}
+
+// Applies the same limits as insert to one line split into fields.
+bool import_parse_row(const char** fields, size_t* lengths, Row* row) {
+  if (lengths[0] == 0 || lengths[0] > 10 || lengths[1] == 0 ||
+      lengths[1] > COLUMN_USERNAME_SIZE || lengths[2] == 0 ||
+      lengths[2] > COLUMN_EMAIL_SIZE) {
+    return false;
+  }
+  uint64_t id = 0;
+  for (size_t i = 0; i < lengths[0]; i++) {
+    if (fields[0][i] < '0' || fields[0][i] > '9') {
+      return false;
+    }
+    id = id * 10 + (fields[0][i] - '0');
+  }
+  if (id > INT32_MAX) {
+    return false;
+  }
+
+  memset(row, 0, sizeof(Row));
+  row->id = id;
+  memcpy(row->username, fields[1], lengths[1]);
+  memcpy(row->email, fields[2], lengths[2]);
+  return true;
+}
+
+void* import_parse(void* arg) {
+  ImportChunk* chunk = arg;
+  const char* p = chunk->start;
+  bool first_line = chunk->may_have_header;
+  while (p < chunk->end) {
+    const char* line_end = scan_for(p, chunk->end, '\n', '\n');
+    const char* content_end = line_end;
+    if (content_end > p && content_end[-1] == '\r') {
+      content_end--;
+    }
+
+    const char* fields[3];
+    size_t lengths[3];
+    uint32_t num_fields = 0;
+    const char* field = p;
+    while (num_fields <= 3) {
+      const char* stop = scan_for(field, content_end, chunk->delimiter, '\n');
+      if (num_fields < 3) {
+        fields[num_fields] = field;
+        lengths[num_fields] = stop - field;
+      }
+      num_fields++;
+      if (stop == content_end) {
+        break;
+      }
+      field = stop + 1;
+    }
+
+    if (chunk->num_rows == chunk->allocated) {
+      chunk->allocated = chunk->allocated ? chunk->allocated * 2 : 256;
+      chunk->rows = realloc(chunk->rows, chunk->allocated * sizeof(Row));
+    }
+    bool blank = content_end == p;
+    bool header = first_line && num_fields == 3 && lengths[0] == 2 &&
+                  strncmp(fields[0], "id", 2) == 0;
+    if (num_fields == 3 &&
+        import_parse_row(fields, lengths, &(chunk->rows[chunk->num_rows]))) {
+      chunk->num_rows++;
+    } else if (!blank && !header) {
+      chunk->skipped++;
+    }
+    first_line = false;
+    p = line_end + 1;
+  }
+  return NULL;
+}
+
+// Hands parsed rows to the writer, one run of rows per target partition.
+uint32_t import_rows(Table* table, Row* rows, uint32_t count) {
+  uint32_t partition_size = table->pager->header.partition_size;
+  if (partition_size == 0) {
+    return table_append_rows(table, rows, count);
+  }
+  uint32_t imported = 0;
+  while (imported < count) {
+    uint32_t partition = rows[imported].id / partition_size;
+    uint32_t run = 1;
+    while (imported + run < count &&
+           rows[imported + run].id / partition_size == partition) {
+      run++;
+    }
+    Table* target = partition_get(table, partition, true);
+    if (target == NULL) {
+      break;
+    }
+    uint32_t appended = table_append_rows(target, rows + imported, run);
+    imported += appended;
+    if (appended < run) {
+      break;
     }
   }
-  free(pager);
-  free(table);
+  return imported;
 }
 
+// Loads "id,username,email" lines (tab separated for .tsv files). Each
+// block read is cut at its last newline and split into one chunk of whole
+// lines per thread; the threads only parse, and rows are appended in
+// file order once they all finish.
+void import_file(Table* table, const char* path) {
+  if (table->upstream_changes != -1 || table->raft != NULL) {
+    printf("Error: Import is only possible on a standalone table.\n");
+    return;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    printf("Unable to open import file\n");
+    return;
+  }
+  size_t path_length = strlen(path);
+  char delimiter =
+      path_length >= 4 && strcmp(path + path_length - 4, ".tsv") == 0 ? '\t'
+                                                                      : ',';
 
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
-    uint32_t num_rows = pager->file_length / ROW_SIZE;
-    Table* table = (Table*)malloc(sizeof(Table));
-    table->pager = pager;
-    table->num_rows = num_rows;
+  char* block = malloc(IMPORT_BLOCK_SIZE);
+  size_t carried = 0;
+  bool first_block = true;
+  bool full = false;
+  uint64_t imported = 0;
+  uint64_t skipped = 0;
+  ExecuteResult stopped = EXECUTE_SUCCESS;
+  statement_begin();
+  while (!full && (stopped = statement_interrupted()) == EXECUTE_SUCCESS) {
+    ssize_t bytes_read = read(fd, block + carried, IMPORT_BLOCK_SIZE - carried);
+    if (bytes_read < 0) {
+      printf("Error reading import file: %d\n", errno);
+      break;
+    }
+    size_t length = carried + bytes_read;
+    if (length == 0) {
+      break;
+    }
+    // The partial line at the end waits for the next read, unless this is
+    // the end of the file or the line alone fills the block.
+    size_t usable = length;
+    if (bytes_read > 0) {
+      while (usable > 0 && block[usable - 1] != '\n') {
+        usable--;
+      }
+      if (usable == 0 && length < IMPORT_BLOCK_SIZE) {
+        carried = length;
+        continue;
+      }
+      if (usable == 0) {
+        usable = length;
+      }
+    }
 
-    
-    return table;
+    ImportChunk chunks[IMPORT_THREADS];
+    pthread_t threads[IMPORT_THREADS];
+    const char* start = block;
+    const char* end = block + usable;
+    for (uint32_t t = 0; t < IMPORT_THREADS; t++) {
+      const char* chunk_end = block + usable * (t + 1) / IMPORT_THREADS;
+      if (chunk_end < start) {
+        chunk_end = start;
+      }
+      if (chunk_end > start && chunk_end < end) {
+        chunk_end = scan_for(chunk_end - 1, end, '\n', '\n');
+        chunk_end += chunk_end < end;
+      }
+      chunks[t] = (ImportChunk){start, chunk_end, delimiter,
+                                first_block && t == 0, NULL, 0, 0, 0};
+      start = chunk_end;
+      pthread_create(&threads[t], NULL, import_parse, &chunks[t]);
+    }
+
+    for (uint32_t t = 0; t < IMPORT_THREADS; t++) {
+      pthread_join(threads[t], NULL);
+      if (!full) {
+        uint32_t appended = import_rows(table, chunks[t].rows, chunks[t].num_rows);
+        imported += appended;
+        full = appended < chunks[t].num_rows;
+        skipped += chunks[t].skipped;
+      }
+      free(chunks[t].rows);
+    }
+
+    memmove(block, block + usable, length - usable);
+    carried = length - usable;
+    first_block = false;
+    if (bytes_read == 0) {
+      break;
+    }
+  }
+  free(block);
+  close(fd);
+
+  printf("Imported %lu rows, skipped %lu lines.\n", (unsigned long)imported,
+         (unsigned long)skipped);
+  if (full) {
+    printf("Error: Table full.\n");
+  } else if (stopped == EXECUTE_CANCELLED) {
+    printf("Error: Statement cancelled.\n");
+  } else if (stopped == EXECUTE_TIMED_OUT) {
+    printf("Error: Statement timed out.\n");
+  }
 }
 
-void free_table(Table* table) {
-  for (int i = 0; table->pager->pages[i]; i++) {
-     free(table->pager->pages[i]);
+ExecuteResult execute_statement(Statement* statement, Table *table) {
+  if (table->pager->header.partition_size > 0) {
+    return execute_partitioned(statement, table);
   }
-  free(table->pager);
-  free(table);
+  if (table->raft != NULL) {
+    return raft_execute(statement, table);
+  }
+  return execute_local_statement(statement, table);
 }
 
-InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = (InputBuffer*)malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
-  return input_buffer;
+// Whether a session of a class more urgent than schedule_class is waiting.
+bool scheduler_more_urgent(ScheduleClass schedule_class) {
+  for (uint32_t c = 0; c < schedule_class; c++) {
+    if (scheduler.waiting[c] > 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void close_input_buffer(InputBuffer* input_buffer) {
-  free(input_buffer->buffer);
-  free(input_buffer);
+void scheduler_acquire(Session* session, ScheduleClass schedule_class) {
+  pthread_mutex_lock(&(scheduler.lock));
+  scheduler.waiting[schedule_class]++;
+  while (scheduler.running != NULL || scheduler_more_urgent(schedule_class)) {
+    pthread_cond_wait(&(scheduler.released), &(scheduler.lock));
+  }
+  scheduler.waiting[schedule_class]--;
+  scheduler.running = session;
+  pthread_mutex_unlock(&(scheduler.lock));
+
+  session->schedule_class = schedule_class;
+  session->slice_end = monotonic_millis() + SCHEDULER_SLICE_MS;
+  if (session->output_fd != -1 && session->output_fd != scheduler.output_fd) {
+    dup2(session->output_fd, STDOUT_FILENO);
+    clearerr(stdout);
+    scheduler.output_fd = session->output_fd;
+  }
 }
 
+// console_fd is a copy of the original stdout, which it starts out as.
+void scheduler_init(int console_fd) {
+  pthread_mutex_init(&(scheduler.lock), NULL);
+  pthread_cond_init(&(scheduler.released), NULL);
+  pthread_mutex_init(&(scheduler.prepare_lock), NULL);
+  for (uint32_t c = 0; c < SCHEDULE_CLASSES; c++) {
+    kll_init(&(scheduler.latency[c]));
+  }
+  scheduler.console_fd = console_fd;
+  scheduler.output_fd = console_fd;
+}
 
+void scheduler_release() {
+  fflush(stdout);
+  pthread_mutex_lock(&(scheduler.lock));
+  scheduler.running = NULL;
+  pthread_cond_broadcast(&(scheduler.released));
+  pthread_mutex_unlock(&(scheduler.lock));
+}
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table *table) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+// Called by long statements at page boundaries, holding no page
+// pointers. Hands the executor to a more urgent session, or to another
+// of the same class once this one's slice is used up, and returns when
+// it is this session's turn again.
+void scheduler_yield() {
+  Session* session = scheduler.running;
+  pthread_mutex_lock(&(scheduler.lock));
+  bool yield = scheduler_more_urgent(session->schedule_class) ||
+               (scheduler.waiting[session->schedule_class] > 0 &&
+                monotonic_millis() >= session->slice_end);
+  if (yield) {
+    scheduler.suspended++;
+    scheduler.yields++;
   }
+  pthread_mutex_unlock(&(scheduler.lock));
+  if (!yield) {
+    return;
+  }
+
+  // Other statements reset the counts.
+  StatementWork work = statement_work;
+  scheduler_release();
+  scheduler_acquire(session, session->schedule_class);
+  statement_work = work;
+  pthread_mutex_lock(&(scheduler.lock));
+  scheduler.suspended--;
+  pthread_mutex_unlock(&(scheduler.lock));
 }
 
-void print_prompt() {
-  printf("db > ");
+// Words of the statement grammar, which fingerprints keep.
+const char* FINGERPRINT_KEYWORDS[] = {
+    "select", "insert", "where", "and", "between", "like", "id", "username",
+    "email", "tenant", "email_domain", "order", "by", "asc", "desc",
+    "tablesample", "system", "bernoulli", "repeatable", "approx_count_distinct",
+    "approx_percentile", "explain", "analyze", "create", "index", "fill",
+    "drop", "partition"};
+
+bool fingerprint_word_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '@' || c == '.' || c == '-';
 }
 
-// Simple line reader using POSIX getline
-void read_input(InputBuffer* input_buffer) {
-  ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+void fingerprint_append(char* fingerprint, size_t* length, const char* text,
+                        size_t size) {
+  if (*length + size >= FINGERPRINT_SIZE) {
+    size = FINGERPRINT_SIZE - 1 - *length;
   }
-  // strip trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = '\0';
+  memcpy(fingerprint + *length, text, size);
+  *length += size;
+  fingerprint[*length] = '\0';
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
+// Reduces a statement to its shape: keywords and operators stay, and
+// every number, quoted string and other word becomes "?". So do the
+// arguments of an insert and the operands of a comparison, however they
+// are spelled, so that "insert 1 id email" is "insert ? ? ?".
+void statement_fingerprint(const char* text, char* fingerprint) {
+  size_t length = 0;
+  fingerprint[0] = '\0';
+  bool values = false;    // Every word from here on is a value
+  bool operand = false;   // The next word is a value
+  bool between = false;   // The next "and" brings the upper bound
+  const char* p = text;
+  while (*p != '\0') {
+    if (*p == ' ' || *p == '\t') {
+      while (*p == ' ' || *p == '\t') {
+        p++;
+      }
+      if (length > 0 && *p != '\0') {
+        fingerprint_append(fingerprint, &length, " ", 1);
+      }
+    } else if (*p == '\'') {
+      p++;
+      while (*p != '\0' && *p != '\'') {
+        p++;
+      }
+      p += *p == '\'';
+      fingerprint_append(fingerprint, &length, "?", 1);
+      operand = false;
+    } else if (fingerprint_word_char(*p)) {
+      const char* word = p;
+      while (fingerprint_word_char(*p)) {
+        p++;
+      }
+      const char* kept = "?";
+      for (size_t k = 0; k < sizeof(FINGERPRINT_KEYWORDS) / sizeof(char*) &&
+                         !values && !operand;
+           k++) {
+        if (strlen(FINGERPRINT_KEYWORDS[k]) == (size_t)(p - word) &&
+            strncmp(FINGERPRINT_KEYWORDS[k], word, p - word) == 0) {
+          kept = FINGERPRINT_KEYWORDS[k];
+        }
+      }
+      fingerprint_append(fingerprint, &length, kept, strlen(kept));
+      values = values || strcmp(kept, "insert") == 0;
+      operand = strcmp(kept, "like") == 0 || strcmp(kept, "between") == 0 ||
+                (between && strcmp(kept, "and") == 0);
+      between = strcmp(kept, "between") == 0;
+    } else {
+      operand = operand || *p == '=' || *p == '<' || *p == '>' || *p == '!';
+      fingerprint_append(fingerprint, &length, p++, 1);
+    }
+  }
+}
 
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
+// Returns the stats for fingerprint, or the free slot where they belong.
+QueryStats* query_stats_slot(uint64_t hash, const char* fingerprint) {
+  uint32_t slot = hash & (QUERY_STATS_SLOTS - 1);
+  while (query_log.slots[slot].fingerprint[0] != '\0' &&
+         strcmp(query_log.slots[slot].fingerprint, fingerprint) != 0) {
+    slot = (slot + 1) & (QUERY_STATS_SLOTS - 1);
+  }
+  return &(query_log.slots[slot]);
+}
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+// Frees slot, moving later entries of its probe run back into the gap
+// so that lookups still reach them.
+void query_stats_remove(uint32_t slot) {
+  uint32_t mask = QUERY_STATS_SLOTS - 1;
+  uint32_t next = slot;
+  while (true) {
+    next = (next + 1) & mask;
+    QueryStats* entry = &(query_log.slots[next]);
+    if (entry->fingerprint[0] == '\0') {
+      break;
+    }
+    uint32_t home = entry->hash & mask;
+    bool reachable = slot <= next ? home > slot && home <= next
+                                  : home > slot || home <= next;
+    if (!reachable) {
+      query_log.slots[slot] = *entry;
+      slot = next;
+    }
   }
+  query_log.slots[slot].fingerprint[0] = '\0';
+  query_log.num_entries--;
+}
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+// Adds a finished statement to the stats of its fingerprint. When the
+// table is full, the least called fingerprint makes room.
+void query_stats_record(const char* fingerprint, uint64_t elapsed_us,
+                        StatementWork* work) {
+  uint64_t hash = hash_bytes(fingerprint, strlen(fingerprint));
+  QueryStats* stats = query_stats_slot(hash, fingerprint);
+  if (stats->fingerprint[0] == '\0') {
+    if (query_log.num_entries == QUERY_STATS_MAX) {
+      uint32_t least = 0;
+      for (uint32_t i = 0; i < QUERY_STATS_SLOTS; i++) {
+        if (query_log.slots[i].fingerprint[0] != '\0' &&
+            (query_log.slots[least].fingerprint[0] == '\0' ||
+             query_log.slots[i].calls < query_log.slots[least].calls)) {
+          least = i;
+        }
+      }
+      query_stats_remove(least);
+      stats = query_stats_slot(hash, fingerprint);
+    }
+    memset(stats, 0, sizeof(QueryStats));
+    strcpy(stats->fingerprint, fingerprint);
+    stats->hash = hash;
+    query_log.num_entries++;
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  stats->calls++;
+  stats->total_us += elapsed_us;
+  if (elapsed_us > stats->max_us) {
+    stats->max_us = elapsed_us;
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  stats->rows_scanned += work->rows_scanned;
+  stats->pages_read += work->pages_read;
+}
+
+void slow_log_write(const char* text, uint64_t elapsed_us, StatementWork* work) {
+  time_t now = time(NULL);
+  struct tm local;
+  char timestamp[32];
+  localtime_r(&now, &local);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+  fprintf(query_log.slow_log, "%s %.3f ms, %lu rows scanned, %lu pages read: %s\n",
+          timestamp, elapsed_us / 1000.0, (unsigned long)work->rows_scanned,
+          (unsigned long)work->pages_read, text);
+  fflush(query_log.slow_log);
+}
+
+int compare_total_time(const void* a, const void* b) {
+  const QueryStats* left = *(QueryStats* const*)a;
+  const QueryStats* right = *(QueryStats* const*)b;
+  return (left->total_us < right->total_us) - (left->total_us > right->total_us);
+}
+
+// Lists the count fingerprints with the most total time.
+void print_top(uint32_t count) {
+  QueryStats* entries[QUERY_STATS_SLOTS];
+  uint32_t num_entries = 0;
+  for (uint32_t i = 0; i < QUERY_STATS_SLOTS; i++) {
+    if (query_log.slots[i].fingerprint[0] != '\0') {
+      entries[num_entries++] = &(query_log.slots[i]);
+    }
+  }
+  if (num_entries == 0) {
+    printf("No statements recorded.\n");
+    return;
   }
+  qsort(entries, num_entries, sizeof(QueryStats*), compare_total_time);
+  for (uint32_t i = 0; i < num_entries && i < count; i++) {
+    QueryStats* stats = entries[i];
+    printf("%lu calls, %.3f ms total, %.3f ms max, %lu rows scanned, "
+           "%lu pages read: %s\n",
+           (unsigned long)stats->calls, stats->total_us / 1000.0,
+           stats->max_us / 1000.0, (unsigned long)stats->rows_scanned,
+           (unsigned long)stats->pages_read, stats->fingerprint);
+  }
+}
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+// Inserts and selects of a single id are point statements; anything else
+// may read the whole table.
+ScheduleClass statement_class(Statement* statement) {
+  IdRange* range = &(statement->id_range);
+  if (statement->type == STATEMENT_INSERT ||
+      (statement->type == STATEMENT_SELECT && range->active &&
+       range->min_id == range->max_id && !statement->order_by.active)) {
+    return SCHEDULE_POINT;
+  }
+  return SCHEDULE_SCAN;
+}
 
-  return PREPARE_SUCCESS;
+// Meta commands that copy or read through a whole file run as scans;
+// the rest are quick.
+ScheduleClass meta_command_class(const char* command) {
+  if (strncmp(command, ".import ", 8) == 0 ||
+      strncmp(command, ".backup ", 8) == 0 ||
+      strncmp(command, ".archive ", 9) == 0) {
+    return SCHEDULE_SCAN;
+  }
+  return SCHEDULE_POINT;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+// Prepares a line of input without the executor, and returns the class
+// to queue for it in. Statements that fail to prepare only print an error,
+// so they are point statements. Frees nothing; session_execute does.
+ScheduleClass session_prepare(InputBuffer* input_buffer, PreparedInput* input) {
+  input->text = NULL;
+  if (input_buffer->buffer[0] == '.') {
+    return meta_command_class(input_buffer->buffer);
   }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  // Preparing cuts the buffer up, so keep the text for the logs.
+  input->text = strdup(input_buffer->buffer);
+  pthread_mutex_lock(&(scheduler.prepare_lock));
+  input->prepared = prepare_statement(input_buffer, &(input->statement));
+  pthread_mutex_unlock(&(scheduler.prepare_lock));
+  if (input->prepared != PREPARE_SUCCESS) {
+    return SCHEDULE_POINT;
   }
+  return statement_class(&(input->statement));
+}
 
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+// Runs one line of input, prepared by session_prepare, for session, which
+// must hold the executor. Returns whether it was a statement rather than
+// a meta command.
+bool session_execute(Session* session, InputBuffer* input_buffer,
+                     PreparedInput* input) {
+  Table* table = session->table;
+  input_buffer_account(input_buffer);
+
+  // Replicas serve every statement from state at least as new as the
+  // primary's log when the statement arrived.
+  if (table->upstream_changes != -1) {
+    replica_catch_up(table);
+  }
+
+  if (input_buffer->buffer[0] == '.') {
+    switch (do_meta_command(input_buffer, session)) {
+      case (META_COMMAND_SUCCESS):
+        return false;
+      case (META_COMMAND_UNRECOGNIZED_COMMAND):
+        printf("Unrecognized command '%s'\n", input_buffer->buffer);
+        return false;
+    }
+  }
+
+  char* text = input->text;
+  char fingerprint[FINGERPRINT_SIZE];
+  statement_fingerprint(text, fingerprint);
+  Statement statement = input->statement;
+  PrepareResult prepared = input->prepared;
+  switch (prepared) {
+    case (PREPARE_SUCCESS):
+      break;
+    case (PREPARE_NEGATIVE_ID):
+      printf("ID must be positive.\n");
+      break;
+    case (PREPARE_STRING_TOO_LONG):
+      printf("String is too long.\n");
+      break;
+    case (PREPARE_SYNTAX_ERROR):
+      printf("Syntax error. Could not parse statement.\n");
+      break;
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+      printf("Unrecognized keyword at start of '%s'.\n",
+             input_buffer->buffer);
+      break;
+  }
+  if (prepared != PREPARE_SUCCESS) {
+    free(text);
+    return false;
+  }
+
+  // Dropping a partition frees it, so no scan may be parked inside one.
+  while (statement.type == STATEMENT_DROP_PARTITION && scheduler.suspended > 0) {
+    scheduler_release();
+    scheduler_acquire(session, SCHEDULE_BACKGROUND);
+  }
+
+  statement_begin();
+  uint64_t counts[PERF_COUNTERS];
+  bool profiled = perf_stats.enabled && perf_begin(&(session->perf));
+  int64_t started = now_micros();
+  ExecuteResult result = execute_statement(&statement, table);
+  uint64_t elapsed_us = now_micros() - started;
+  profiled = profiled && perf_end(&(session->perf), counts);
+  query_stats_record(fingerprint, elapsed_us, &statement_work);
+  if (query_log.slow_log != NULL && elapsed_us >= query_log.slow_ms * 1000ULL) {
+    slow_log_write(text, elapsed_us, &statement_work);
+  }
+  free(text);
+
+  switch (result) {
+    case (EXECUTE_SUCCESS):
+      printf("Executed.\n");
+      break;
+    case (EXECUTE_TABLE_FULL):
+      printf("Error: Table full.\n");
+      break;
+    case (EXECUTE_READ_ONLY):
+      printf("Error: Read-only replica.\n");
+      break;
+    case (EXECUTE_NOT_LEADER):
+      printf("Error: Not the leader.\n");
+      break;
+    case (EXECUTE_NOT_COMMITTED):
+      printf("Error: Not committed by the cluster.\n");
+      break;
+    case (EXECUTE_NO_PARTITION):
+      printf("Error: No such partition.\n");
+      break;
+    case (EXECUTE_INDEX_FAILED):
+      printf("Error: Could not build index.\n");
+      break;
+    case (EXECUTE_CANCELLED):
+      printf("Error: Statement cancelled.\n");
+      break;
+    case (EXECUTE_TIMED_OUT):
+      printf("Error: Statement timed out.\n");
+      break;
+  }
+  if (profiled) {
+    print_perf_counts(counts);
+  }
+  return true;
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-    
-  if (table->num_rows >= TABLE_MAX_ROWS) {
-    return EXECUTE_TABLE_FULL;
+// Gives session the next id and lets .cancel find it.
+void session_register(Session* session) {
+  pthread_mutex_lock(&(scheduler.lock));
+  session->id = ++scheduler.next_session_id;
+  scheduler.sessions = realloc(scheduler.sessions,
+                               (scheduler.num_sessions + 1) * sizeof(Session*));
+  scheduler.sessions[scheduler.num_sessions++] = session;
+  pthread_mutex_unlock(&(scheduler.lock));
+}
+
+void session_unregister(Session* session) {
+  pthread_mutex_lock(&(scheduler.lock));
+  for (uint32_t i = 0; i < scheduler.num_sessions; i++) {
+    if (scheduler.sessions[i] == session) {
+      scheduler.sessions[i] = scheduler.sessions[--scheduler.num_sessions];
+      break;
+    }
   }
+  pthread_mutex_unlock(&(scheduler.lock));
+}
 
-  Row* row_to_insert = &(statement->row_to_insert);
-  Cursor* cursor = table_end(table);
+// Asks the statement session id is running to stop at its next check.
+// Needs no executor, which that statement may be holding. False if no
+// session has that id.
+bool session_cancel(const char* id_string) {
+  char* end;
+  unsigned long id = strtoul(id_string, &end, 10);
+  bool found = false;
+  pthread_mutex_lock(&(scheduler.lock));
+  for (uint32_t i = 0; i < scheduler.num_sessions && *end == '\0'; i++) {
+    if (scheduler.sessions[i]->id == id) {
+      __atomic_store_n(&(scheduler.sessions[i]->cancel_requested), 1,
+                       __ATOMIC_RELAXED);
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&(scheduler.lock));
+  return found;
+}
 
-  serialize_row(row_to_insert, cursor_value(cursor));
-  table->num_rows += 1;
+// Prompts for, reads and runs one line. The executor is held only to
+// print and to run, never while waiting for input. False at end of input.
+bool session_step(Session* session, InputBuffer* input_buffer, FILE* input) {
+  scheduler_acquire(session, SCHEDULE_POINT);
+  buffer_pool_trim(session->table);
+  print_prompt();
+  scheduler_release();
 
-  free(cursor);
+  ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), input);
+  if (bytes_read <= 0) {
+    return false;
+  }
+  if (input_buffer->buffer[bytes_read - 1] == '\n') {
+    bytes_read--;
+  }
+  input_buffer->input_length = bytes_read;
+  input_buffer->buffer[bytes_read] = '\0';
+  if (session->output_fd != scheduler.console_fd &&
+      strcmp(input_buffer->buffer, ".exit") == 0) {
+    return false;  // Only the console closes the database
+  }
+  if (strncmp(input_buffer->buffer, ".cancel ", 8) == 0) {
+    bool found = session_cancel(input_buffer->buffer + 8);
+    scheduler_acquire(session, SCHEDULE_POINT);
+    printf(found ? "Cancel requested.\n" : "No such session.\n");
+    scheduler_release();
+    return true;
+  }
 
-  return EXECUTE_SUCCESS;
+  int64_t start = now_micros();
+  PreparedInput prepared;
+  scheduler_acquire(session, session_prepare(input_buffer, &prepared));
+  if (session_execute(session, input_buffer, &prepared)) {
+    int64_t elapsed = now_micros() - start;
+    kll_add(&(scheduler.latency[session->schedule_class]),
+            elapsed < UINT32_MAX ? elapsed : UINT32_MAX);
+  }
+  scheduler_release();
+  return true;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-    Cursor* cursor = table_start(table);
-    Row row;
-    while (!(cursor->end_of_table)) {
-      deserialize_row(cursor_value(cursor), &row);
-      print_row(&row);
-      cursor_advance(cursor);
+void* session_serve(void* arg) {
+  Session* session = arg;
+  session_register(session);
+  FILE* input = fdopen(dup(session->output_fd), "r");
+  InputBuffer* input_buffer = new_input_buffer();
+  while (input != NULL && session_step(session, input_buffer, input)) {
+  }
+
+  scheduler_acquire(session, SCHEDULE_POINT);
+  close_input_buffer(input_buffer);
+  if (scheduler.output_fd == session->output_fd) {
+    // Let go of the connection so the client sees it close.
+    dup2(scheduler.console_fd, STDOUT_FILENO);
+    scheduler.output_fd = scheduler.console_fd;
+  }
+  close(session->output_fd);
+  perf_close(&(session->perf));
+  scheduler_release();
+  session_unregister(session);
+  if (input != NULL) {
+    fclose(input);
+  }
+  free(session);
+  return NULL;
+}
+
+void* session_listen(void* arg) {
+  Session* listener = arg;
+  while (true) {
+    int connection = accept(listener->output_fd, NULL, NULL);
+    if (connection == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
     }
+    Session* session = malloc(sizeof(Session));
+    *session = (Session){listener->table, connection, SCHEDULE_POINT, 0, {false}, 0, 0, 0, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, session_serve, session);
+    pthread_detach(thread);
+  }
+}
 
-    free(cursor);
-    return EXECUTE_SUCCESS;
+// Accepts client sessions on a Unix socket. Each runs the console's
+// read-execute loop on its own thread, its output sent back over the
+// connection.
+bool session_listen_start(Table* table, const char* socket_path) {
+  struct sockaddr_un address;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    return false;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+      listen(fd, 16) == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  // A client hanging up mid-write must not kill the database.
+  signal(SIGPIPE, SIG_IGN);
+  Session* listener = malloc(sizeof(Session));
+  *listener = (Session){table, fd, SCHEDULE_POINT, 0, {false}, 0, 0, 0, 0};
+  pthread_t thread;
+  pthread_create(&thread, NULL, session_listen, listener);
+  pthread_detach(thread);
+  return true;
 }
 
-ExecuteResult execute_statement(Statement* statement, Table *table) {
-  switch (statement->type) {
-    case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+// The table a checkpoint works on: root itself, or the partition with
+// that number. NULL if that partition has been dropped.
+Table* checkpoint_target(Table* root, int64_t partition) {
+  if (partition == -1) {
+    return root;
+  }
+  return partition_get(root, partition, false);
+}
+
+// Writes one table's dirty pages back in the background class. The pages
+// go to the double-write file first, as on close, and then into place
+// one at a time so that statements get the executor in between and the
+// writes stay under the checkpoint rate. Rows added meanwhile are left to
+// the next checkpoint; until the header moves on, a crash replays them
+// from the change log.
+void checkpoint_table(Session* session, Table* root, int64_t partition) {
+  scheduler_acquire(session, SCHEDULE_BACKGROUND);
+  Table* table = checkpoint_target(root, partition);
+  if (table == NULL) {
+    scheduler_release();
+    return;
+  }
+  Pager* pager = table->pager;
+  uint32_t num_rows = table->num_rows;
+  uint64_t change_seq = table->changes->next_seq - 1;
+  uint32_t num_pages = HEADER_PAGES + (num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+  bool saved[TABLE_MAX_PAGES] = {false};
+  uint32_t num_saved = 0;
+  for (uint32_t i = HEADER_PAGES; i < num_pages; i++) {
+    saved[i] = pager->pages[i] != NULL && pager->dirty[i];
+    num_saved += saved[i];
+  }
+  if (num_saved == 0) {
+    scheduler_release();
+    return;
+  }
+  pager_reserve(pager, num_pages);
+  pager_double_write(pager, num_pages);
+  scheduler_release();
+
+  // Only pages with a copy in the double-write file may be written in
+  // place; a page dirtied since then waits for the next checkpoint.
+  for (uint32_t i = HEADER_PAGES; i < num_pages; i++) {
+    if (!saved[i]) {
+      continue;
+    }
+    scheduler_acquire(session, SCHEDULE_BACKGROUND);
+    if (checkpoint_target(root, partition) != table) {
+      scheduler_release();
+      return;
+    }
+    bool written = pager->pages[i] != NULL && pager->dirty[i];
+    if (written) {
+      pager_flush(pager, i, PAGE_SIZE);
+      pager->dirty[i] = false;
+      scheduler.checkpoint_pages++;
+    }
+    scheduler_release();
+    if (written) {
+      usleep(1000000 / scheduler.checkpoint_rate);
+    }
+  }
+
+  scheduler_acquire(session, SCHEDULE_BACKGROUND);
+  if (checkpoint_target(root, partition) == table) {
+    pager_sync(pager->file_descriptor);
+    pager->header.num_rows = num_rows;
+    pager->header.num_pages = num_pages;
+    pager->header.change_seq = change_seq;
+    pager_write_header(pager);
+    pager_sync(pager->file_descriptor);
+    unlink(pager->double_write_path);
+  }
+  scheduler_release();
+}
+
+void* checkpoint_run(void* arg) {
+  Session* session = arg;
+  while (true) {
+    usleep(CHECKPOINT_INTERVAL_MS * 1000);
+    checkpoint_table(session, session->table, -1);
+    // Partitions may come and go meanwhile, so work from a copy of the list.
+    scheduler_acquire(session, SCHEDULE_BACKGROUND);
+    uint32_t num_partitions = session->table->num_partitions;
+    uint32_t* numbers = malloc((num_partitions + 1) * sizeof(uint32_t));
+    if (num_partitions > 0) {
+      memcpy(numbers, session->table->partition_numbers,
+             num_partitions * sizeof(uint32_t));
+    }
+    scheduler_release();
+    for (uint32_t i = 0; i < num_partitions; i++) {
+      checkpoint_table(session, session->table, numbers[i]);
+    }
+    free(numbers);
   }
+  return NULL;
+}
+
+void print_scheduler() {
+  const char* names[] = {"Point", "Scan", "Background"};
+  for (uint32_t c = 0; c < SCHEDULE_BACKGROUND; c++) {
+    KllSketch* latency = &(scheduler.latency[c]);
+    printf("%s: %lu statements", names[c], (unsigned long)latency->count);
+    if (latency->count > 0) {
+      printf(", p99 %u us", kll_quantile(latency, 0.99));
+    }
+    printf("\n");
+  }
+  if (scheduler.checkpoint_rate == 0) {
+    printf("%s: checkpoints off\n", names[SCHEDULE_BACKGROUND]);
+  } else {
+    printf("%s: %lu pages checkpointed, at most %u a second\n",
+           names[SCHEDULE_BACKGROUND], (unsigned long)scheduler.checkpoint_pages,
+           scheduler.checkpoint_rate);
+  }
+  pthread_mutex_lock(&(scheduler.lock));
+  printf("Waiting: %u point, %u scan, %u background\n",
+         scheduler.waiting[SCHEDULE_POINT], scheduler.waiting[SCHEDULE_SCAN],
+         scheduler.waiting[SCHEDULE_BACKGROUND]);
+  pthread_mutex_unlock(&(scheduler.lock));
+  printf("Yields: %lu\n", (unsigned long)scheduler.yields);
 }
 
 
 
 
+// Programs that drive the engine in-process include this file with
+// DB_NO_MAIN defined and bring their own main.
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
     if (argc < 2) {
      printf("Must supply a database filename.\n");
@@ -406,49 +7219,139 @@ int main(int argc, char* argv[]) {
    }
  
    char* filename = argv[1];
-   Table* table = db_open(filename);
-   InputBuffer* input_buffer = new_input_buffer();
-   while (true) {
-     print_prompt();
-     read_input(input_buffer);
-
-    if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
-        case (META_COMMAND_SUCCESS):
-          continue;
-        case (META_COMMAND_UNRECOGNIZED_COMMAND):
-          printf("Unrecognized command '%s'\n", input_buffer->buffer);
-          continue;
-      }
-    }
+   char* primary = NULL;
+   int raft_id = 0;
+   char* raft_peers = NULL;
+   char* restore_base = NULL;
+   char* archive_dir = NULL;
+   uint64_t until_seq = UINT64_MAX;
+   int64_t until_time = INT64_MAX;
+   long partition_size = 0;
+   char* listen_path = NULL;
+   long checkpoint_rate = 0;
+   query_log.slow_ms = SLOW_QUERY_DEFAULT_MS;
+   for (int i = 2; i < argc; i++) {
+     if (strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc) {
+       primary = argv[++i];
+     } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+       restore_base = argv[++i];
+     } else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc) {
+       archive_dir = argv[++i];
+     } else if (strcmp(argv[i], "--until-seq") == 0 && i + 1 < argc) {
+       until_seq = strtoull(argv[++i], NULL, 10);
+     } else if (strcmp(argv[i], "--until-time") == 0 && i + 1 < argc) {
+       until_time = (int64_t)(strtod(argv[++i], NULL) * 1000000);
+     } else if (strcmp(argv[i], "--partition-by-id") == 0 && i + 1 < argc) {
+       partition_size = atol(argv[++i]);
+       if (partition_size < 1 || partition_size > UINT32_MAX) {
+         printf("Partition size must be a positive number of ids\n");
+         exit(EXIT_FAILURE);
+       }
+     } else if (strcmp(argv[i], "--slow-log") == 0 && i + 1 < argc) {
+       query_log.slow_log = fopen(argv[++i], "a");
+       if (query_log.slow_log == NULL) {
+         printf("Unable to open slow query log\n");
+         exit(EXIT_FAILURE);
+       }
+     } else if (strcmp(argv[i], "--slow-ms") == 0 && i + 1 < argc) {
+       uint64_t slow_ms;
+       if (!parse_number(argv[++i], UINT32_MAX, &slow_ms)) {
+         printf("Slow query threshold must be between 0 and %u ms\n", UINT32_MAX);
+         exit(EXIT_FAILURE);
+       }
+       query_log.slow_ms = slow_ms;
+     } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+       listen_path = argv[++i];
+     } else if (strcmp(argv[i], "--checkpoint-rate") == 0 && i + 1 < argc) {
+       checkpoint_rate = atol(argv[++i]);
+       if (checkpoint_rate < 1 || checkpoint_rate > 1000000) {
+         printf("Checkpoint rate must be between 1 and 1000000 pages a second\n");
+         exit(EXIT_FAILURE);
+       }
+     } else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+       if (!parse_number(argv[++i], MEMORY_MAX_BUDGET, &(memory_accountant.budget))) {
+         printf("Memory limit must be between 0 and %lu bytes\n",
+                (unsigned long)MEMORY_MAX_BUDGET);
+         exit(EXIT_FAILURE);
+       }
+     } else if (strcmp(argv[i], "--raft-id") == 0 && i + 1 < argc) {
+       raft_id = atoi(argv[++i]);
+     } else if (strcmp(argv[i], "--raft-peers") == 0 && i + 1 < argc) {
+       raft_peers = argv[++i];
+     } else {
+       printf("Unrecognized option '%s'\n", argv[i]);
+       exit(EXIT_FAILURE);
+     }
+   }
 
-    Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
-      case (PREPARE_SUCCESS):
-        break;
-      case (PREPARE_NEGATIVE_ID):
-        printf("ID must be positive.\n");
-        continue;
-      case (PREPARE_STRING_TOO_LONG):
-        printf("String is too long.\n");
-        continue;
-      case (PREPARE_SYNTAX_ERROR):
-        printf("Syntax error. Could not parse statement.\n");
-        continue;
-      case (PREPARE_UNRECOGNIZED_STATEMENT):
-        printf("Unrecognized keyword at start of '%s'.\n",
-               input_buffer->buffer);
-        continue;
-    }
+   if (restore_base != NULL) {
+     if (archive_dir == NULL) {
+       printf("Restoring requires --archive\n");
+       exit(EXIT_FAILURE);
+     }
+     bool restored =
+         db_restore(filename, restore_base, archive_dir, until_seq, until_time);
+     exit(restored ? EXIT_SUCCESS : EXIT_FAILURE);
+   }
 
-    switch (execute_statement(&statement, table)) {
-      case (EXECUTE_SUCCESS):
-        printf("Executed.\n");
-        break;
-      case (EXECUTE_TABLE_FULL):
-        printf("Error: Table full.\n");
-        break;
+   Table* table = db_open(filename);
+   FileHeader* header = &(table->pager->header);
+   if (partition_size > 0 && header->partition_size != partition_size) {
+     if (header->partition_size > 0 || table->num_rows > 0) {
+       printf("Only an empty table can be partitioned\n");
+       exit(EXIT_FAILURE);
+     }
+     header->partition_size = partition_size;
+     pager_write_header(table->pager);
+   }
+   if (header->partition_size > 0 &&
+       (primary != NULL || raft_peers != NULL || raft_id != 0)) {
+     printf("Partitioned tables cannot be replicated\n");
+     exit(EXIT_FAILURE);
+   }
+   // Cluster nodes apply entries on their own thread, outside the scheduler.
+   if ((listen_path != NULL || checkpoint_rate > 0) &&
+       (raft_peers != NULL || raft_id != 0)) {
+     printf("Cluster nodes cannot take sessions or checkpoint\n");
+     exit(EXIT_FAILURE);
+   }
+   if (primary != NULL && !replica_attach(table, primary)) {
+     printf("Unable to open primary change log\n");
+     exit(EXIT_FAILURE);
+   }
+   if (raft_peers != NULL || raft_id != 0) {
+     if (raft_peers == NULL || table->upstream_changes != -1 ||
+         !raft_start(table, filename, raft_id, raft_peers)) {
+       printf("Unable to start cluster node\n");
+       exit(EXIT_FAILURE);
      }
    }
+   // Ctrl-C stops the running statement instead of the process.
+   signal(SIGINT, handle_interrupt);
+   Session console = {table, dup(STDOUT_FILENO), SCHEDULE_POINT, 0, {false},
+                      0, 0, 0, 0};
+   scheduler_init(console.output_fd);
+   scheduler.console = &console;
+   session_register(&console);
+   if (listen_path != NULL && !session_listen_start(table, listen_path)) {
+     printf("Unable to listen for sessions\n");
+     exit(EXIT_FAILURE);
+   }
+   if (checkpoint_rate > 0) {
+     scheduler.checkpoint_rate = checkpoint_rate;
+     Session* checkpointer = malloc(sizeof(Session));
+     *checkpointer = (Session){table, -1, SCHEDULE_BACKGROUND, 0, {false}, 0, 0, 0, 0};
+     pthread_t thread;
+     pthread_create(&thread, NULL, checkpoint_run, checkpointer);
+     pthread_detach(thread);
+   }
+
+   InputBuffer* input_buffer = new_input_buffer();
+   while (session_step(&console, input_buffer, stdin)) {
+   }
+   scheduler_acquire(&console, SCHEDULE_POINT);
+   printf("Error reading input\n");
+   exit(EXIT_FAILURE);
    return 0;
- }
\ No newline at end of file
+ }
+#endif
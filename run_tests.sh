@@ -11,7 +11,8 @@ fi
 bundle install
 
 echo "🏗️  Compiling C program..."
-gcc -Wall -Wextra -std=c11 -o maincode maincode.c
+gcc -Wall -Wextra -std=c11 -o maincode maincode.c -lm -pthread
+gcc -Wall -Wextra -std=c11 -o ycsb ycsb.c -lm -pthread
 
 echo "🧪 Running tests..."
 bundle exec rspec --format documentation --color
@@ -1,7 +1,15 @@
 #!/usr/bin/env python3
 
+import glob
+import os
+import shutil
+import signal
+import socket
+import struct
 import subprocess
 import sys
+import tempfile
+import time
 
 from typing import List, Dict, Any
 
@@ -14,19 +22,34 @@ class DatabaseTestHarness:
         """Compile the C database program"""
         try:
             result = subprocess.run(
-                ['gcc', '-Wall', '-Wextra', '-std=c11', '-o', 'maincode', 'maincode.c'],
+                ['gcc', '-Wall', '-Wextra', '-std=c11', '-o', 'maincode', 'maincode.c', '-lm', '-pthread'],
                 capture_output=True, text=True, check=True
             )
         except subprocess.CalledProcessError as e:
             raise RuntimeError(f"Failed to compile database:\n{e.stderr}")
     
-    def run_script(self, commands: List[str]) -> Dict[str, Any]:
+    def new_db_file(self) -> str:
+        """Return the path of a fresh, empty database file"""
+        fd, path = tempfile.mkstemp(suffix='.db')
+        os.close(fd)
+        return path
+
+    def remove_db_file(self, path: str):
+        """Remove a database file along with any files kept beside it"""
+        for leftover in glob.glob(glob.escape(path) + '*'):
+            os.remove(leftover)
+
+    def run_script(self, commands: List[str], db_file: str = None,
+                   options: List[str] = []) -> Dict[str, Any]:
         """Run the database with given commands"""
         input_data = '\n'.join(commands) + '\n'
+        scratch_file = db_file is None
+        if scratch_file:
+            db_file = self.new_db_file()
         
         try:
             result = subprocess.run(
-                [self.executable_path],
+                [self.executable_path, db_file] + options,
                 input=input_data,
                 capture_output=True,
                 text=True,
@@ -37,17 +60,23 @@ class DatabaseTestHarness:
                 'output': result.stdout,
                 'error': result.stderr,
                 'exit_status': result.returncode,
-                'lines': [line.strip() for line in result.stdout.split('\n') if line.strip()]
+                'lines': [line.replace('db > ', '').strip()
+                          for line in result.stdout.split('\n')
+                          if line.replace('db > ', '').strip()]
             }
         except subprocess.TimeoutExpired:
             raise RuntimeError("Database process timed out")
+        finally:
+            if scratch_file:
+                self.remove_db_file(db_file)
     
-    def run_until_exit(self, commands: List[str]) -> Dict[str, Any]:
+    def run_until_exit(self, commands: List[str], db_file: str = None,
+                       options: List[str] = []) -> Dict[str, Any]:
         """Run commands and automatically add .exit"""
         commands = commands.copy()
         if not commands or commands[-1] != '.exit':
             commands.append('.exit')
-        return self.run_script(commands)
+        return self.run_script(commands, db_file, options)
 
 def test_basic_operations():
     """Test basic insert and select operations"""
@@ -152,6 +181,1101 @@ def test_meta_commands():
     
     print("✅ Meta command tests passed!")
 
+def test_persistence():
+    """Test that rows survive closing and reopening the database"""
+    print("🧪 Testing persistence...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    db.run_until_exit(['.extent 4'] + [
+        f'insert {i} user{i} person{i}@example.com' for i in range(1, 31)
+    ], db_file)
+    result = db.run_until_exit(['select'], db_file)
+    assert '(1, user1, person1@example.com)' in result['lines'], "First row should persist"
+    assert '(30, user30, person30@example.com)' in result['lines'], "Last row should persist"
+    
+    result = db.run_until_exit(['.extent 0'], db_file)
+    assert 'Extent must be at least one page.' in result['lines'], "Should reject empty extents"
+    
+    db.remove_db_file(db_file)
+    print("✅ Persistence tests passed!")
+
+def test_torn_page_recovery():
+    """Test that a torn page is restored from the double-write file on open"""
+    print("🧪 Testing torn page recovery...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    page_size, max_pages = 4096, 100
+    
+    def fnv1a(data):
+        value = 2166136261
+        for byte in data:
+            value = ((value ^ byte) * 16777619) & 0xffffffff
+        return value
+    
+    db.run_until_exit([f'insert {i} user{i} person{i}@example.com' for i in range(1, 11)], db_file)
+    with open(db_file, 'r+b') as f:
+        f.seek(page_size)
+        page = f.read(page_size)
+        # A crash partway through the in-place write leaves half the page zeroed
+        f.seek(page_size + page_size // 2)
+        f.write(bytes(page_size // 2))
+    
+    page_nums = [1] + [0] * (max_pages - 1)
+    checksums = [fnv1a(page)] + [0] * (max_pages - 1)
+    header = struct.pack(f'<II{max_pages}I{max_pages}I', 0x31574444, 1, *page_nums, *checksums)
+    header += struct.pack('<I', fnv1a(header))
+    with open(db_file + '-dw', 'wb') as f:
+        f.write(header.ljust(page_size, b'\0') + page)
+    
+    result = db.run_until_exit(['select'], db_file)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == [f'({i}, user{i}, person{i}@example.com)' for i in range(1, 11)], \
+        "The torn page should be restored from its double-write copy"
+    assert not os.path.exists(db_file + '-dw'), "The double-write file should be removed once applied"
+    
+    db.remove_db_file(db_file)
+    print("✅ Torn page recovery tests passed!")
+
+def test_where_and_analyze():
+    """Test id predicates and the access paths chosen for them"""
+    print("🧪 Testing where clauses and analyze...")
+    
+    db = DatabaseTestHarness()
+    inserts = [f'insert {i} user{i} person{i}@example.com' for i in range(1, 101)]
+    
+    result = db.run_until_exit(inserts + [
+        'select where id between 30 and 32',
+        'select where id > 99',
+        'select where id = 1000',
+        'select where name = 3',
+    ])
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(30, user30, person30@example.com)',
+                    '(31, user31, person31@example.com)',
+                    '(32, user32, person32@example.com)',
+                    '(100, user100, person100@example.com)'], "Should filter rows by id"
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Should reject other columns"
+    
+    result = db.run_until_exit(inserts[:3] + [
+        'select where id > 4294967295',
+        'select where id = 99999999999',
+        'select where id < 99999999999',
+        'select where id = 2x',
+    ])
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(1, user1, person1@example.com)',
+                    '(2, user2, person2@example.com)',
+                    '(3, user3, person3@example.com)'], "Ids past the largest id should not wrap"
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Ids must be whole numbers"
+    
+    result = db.run_until_exit(inserts + [
+        'explain select',
+        'analyze',
+        'explain select where id between 30 and 40',
+        'insert 5 late late@example.com',
+        'explain select where id between 30 and 40',
+    ])
+    assert 'Plan: full scan (est. 8 of 8 pages, 100 rows)' in result['lines'], "Unfiltered select should scan"
+    assert 'Plan: early stop (est. 2 of 8 pages, 10 rows)' in result['lines'], "Sorted ids should stop early"
+    assert 'Plan: page skip (est. 3 of 8 pages, 10 rows)' in result['lines'], "Unsorted ids should skip pages"
+    
+    print("✅ Where clause and analyze tests passed!")
+
+def test_approximate_aggregates():
+    """Test sketch-based aggregates against known answers"""
+    print("🧪 Testing approximate aggregates...")
+    
+    db = DatabaseTestHarness()
+    inserts = [f'insert {i} user{i % 20} person{i}@domain{i % 5}.com' for i in range(1, 201)]
+    
+    result = db.run_until_exit(inserts + [
+        'select approx_count_distinct(username)',
+        'select approx_count_distinct(email_domain)',
+        'select approx_percentile(id, 0.5)',
+        'select approx_percentile(id, 1.5)',
+        'select approx_percentile(id, nan)',
+        'select approx_percentile(id, 0.5) where id > 1000',
+        'select approx_count_distinct(username) where id > 1000',
+    ])
+    values = [int(line[1:-1]) for line in result['lines']
+              if line.startswith('(') and line[1:-1].isdigit()]
+    assert len(values) == 4, "Each valid aggregate should return one value"
+    assert 18 <= values[0] <= 22, "Distinct usernames should be close to 20"
+    assert values[1] == 5, "Distinct email domains should be exact at this size"
+    assert 90 <= values[2] <= 110, "Median id should be close to 100"
+    assert result['lines'].count('Syntax error. Could not parse statement.') == 2, \
+        "Should reject percentiles above 1 and nan"
+    assert '(NULL)' in result['lines'], "A percentile of no rows should still return a row"
+    assert values[3] == 0, "A distinct count of no rows should be zero"
+    
+    print("✅ Approximate aggregate tests passed!")
+
+def test_tablesample():
+    """Test page and row sampling"""
+    print("🧪 Testing tablesample...")
+    
+    db = DatabaseTestHarness()
+    inserts = [f'insert {i} user{i} person{i}@example.com' for i in range(1, 301)]
+    
+    for method in ['system', 'bernoulli']:
+        result = db.run_until_exit(inserts + [
+            f'select tablesample {method}(30%) repeatable(42)',
+            '.exit',
+        ])
+        sampled = [line for line in result['lines'] if line.startswith('(')]
+        assert 0 < len(sampled) < 300, f"{method} sample should return a subset"
+        
+        result = db.run_until_exit(inserts + [
+            f'select tablesample {method}(30%) repeatable(42)',
+        ])
+        again = [line for line in result['lines'] if line.startswith('(')]
+        assert sampled == again, f"Repeatable {method} samples should match"
+    
+    result = db.run_until_exit(inserts + ['select tablesample system(100%)'])
+    assert len([line for line in result['lines'] if line.startswith('(')]) == 300, "A 100% sample is the whole table"
+    
+    result = db.run_until_exit(['select tablesample reservoir(5%)'])
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Should reject unknown sampling methods"
+    
+    print("✅ Tablesample tests passed!")
+
+def test_change_log():
+    """Test the change feed and replay of inserts after a crash"""
+    print("🧪 Testing change log...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    # Ending input without .exit skips db_close, like a crash would
+    result = db.run_script(['insert 1 user1 person1@example.com',
+                            'insert 2 user2 person2@example.com'], db_file)
+    assert result['exit_status'] != 0, "Process should die without closing"
+    
+    result = db.run_until_exit(['select', 'insert 3 user3 person3@example.com',
+                                '.changes since 1'], db_file)
+    assert '(2, user2, person2@example.com)' in result['lines'], "Logged inserts should be replayed"
+    assert '2: (2, user2, person2@example.com)' in result['lines'], "Feed should include later changes"
+    assert '3: (3, user3, person3@example.com)' in result['lines'], "Feed should include new changes"
+    assert '1: (1, user1, person1@example.com)' not in result['lines'], "Feed should resume after the offset"
+    
+    # A follower over the socket resumes from its offset, then tails new inserts
+    socket_path = db_file + '-feed'
+    process = subprocess.Popen([db.executable_path, db_file], stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE, text=True)
+    process.stdin.write(f'.changes listen {socket_path}\n')
+    process.stdin.flush()
+    for _ in range(100):
+        if os.path.exists(socket_path):
+            break
+        time.sleep(0.05)
+    follower = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    follower.settimeout(10)
+    follower.connect(socket_path)
+    follower.sendall(b'since 1\n')
+    
+    def read_changes(count):
+        replies = b''
+        while replies.count(b'\n') < count:
+            data = follower.recv(4096)
+            assert data, "The feed closed early"
+            replies += data
+        return replies.decode().splitlines()
+    
+    assert read_changes(2) == ['2: (2, user2, person2@example.com)', '3: (3, user3, person3@example.com)'], \
+        "A follower should resume after its offset"
+    process.stdin.write('insert 4 user4 person4@example.com\n')
+    process.stdin.flush()
+    assert read_changes(1) == ['4: (4, user4, person4@example.com)'], "A follower should receive new inserts"
+    output, _ = process.communicate('.exit\n', timeout=10)
+    assert process.returncode == 0, "Closing should stop the feed cleanly"
+    assert not os.path.exists(socket_path), "Closing should remove the feed socket"
+    follower.close()
+    
+    db.remove_db_file(db_file)
+    print("✅ Change log tests passed!")
+
+def test_replica():
+    """Test a read-only replica following the primary's change log"""
+    print("🧪 Testing replicas...")
+    
+    db = DatabaseTestHarness()
+    primary = db.new_db_file()
+    replica = db.new_db_file()
+    
+    db.run_until_exit(['insert 1 user1 person1@example.com'], primary)
+    result = db.run_until_exit(['select', 'insert 2 user2 person2@example.com'],
+                               replica, ['--replica-of', primary])
+    assert '(1, user1, person1@example.com)' in result['lines'], "Replica should apply the primary's rows"
+    assert 'Error: Read-only replica.' in result['lines'], "Replica should reject inserts"
+    
+    db.run_until_exit(['insert 3 user3 person3@example.com'], primary)
+    result = db.run_until_exit(['select', '.lag'], replica, ['--replica-of', primary])
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(1, user1, person1@example.com)',
+                    '(3, user3, person3@example.com)'], "Replica should resume where it stopped"
+    assert 'Lag: 0 changes' in result['lines'], "Replica should be caught up"
+    
+    result = db.run_until_exit(['.lag'], primary)
+    assert 'Not a replica.' in result['lines'], "Primary has no lag"
+    
+    db.remove_db_file(primary)
+    db.remove_db_file(replica)
+    print("✅ Replica tests passed!")
+
+def test_raft_cluster():
+    """Test a three-node Raft cluster on loopback, including a restart"""
+    print("🧪 Testing Raft cluster...")
+    
+    db = DatabaseTestHarness()
+    db_files = [db.new_db_file() for _ in range(3)]
+    ports = []
+    for _ in range(3):
+        probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        probe.bind(('127.0.0.1', 0))
+        ports.append(probe.getsockname()[1])
+        probe.close()
+    peers = ','.join(f'127.0.0.1:{port}' for port in ports)
+    nodes = []
+    
+    def start_nodes():
+        nodes[:] = [subprocess.Popen([db.executable_path, db_files[n], '--raft-id', str(n + 1),
+                                      '--raft-peers', peers],
+                                     stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+                    for n in range(3)]
+    
+    def ask(node, command, until=None):
+        """Send one line and read its output, up to the line until if given"""
+        nodes[node].stdin.write(command + '\n')
+        nodes[node].stdin.flush()
+        lines = []
+        while True:
+            lines.append(nodes[node].stdout.readline().replace('db > ', '').rstrip('\n'))
+            if until is None or lines[-1] == until:
+                return lines
+    
+    def status(node):
+        fields = ask(node, '.raft')[0].replace(',', '').split()
+        return {'role': fields[2], 'commit': int(fields[8]), 'applied': int(fields[10])}
+    
+    def wait_for(condition):
+        for _ in range(100):
+            if condition():
+                return True
+            time.sleep(0.1)
+        return False
+    
+    def leader():
+        roles = [status(n)['role'] for n in range(3)]
+        return roles.index('leader') if roles.count('leader') == 1 else None
+    
+    try:
+        start_nodes()
+        assert wait_for(lambda: leader() is not None), "A leader should be elected"
+        first = leader()
+        follower = (first + 1) % 3
+        assert ask(first, 'insert 1 user1 person1@example.com') == ['Executed.'], "The leader should commit inserts"
+        assert ask(first, 'insert 2 user2 person2@example.com') == ['Executed.'], "The leader should commit inserts"
+        assert ask(follower, 'insert 3 user3 person3@example.com') == ['Error: Not the leader.'], \
+            "Followers should turn inserts away"
+        assert wait_for(lambda: '(2, user2, person2@example.com)' in ask(follower, 'select', 'Executed.')), \
+            "Committed inserts should reach the followers"
+        assert wait_for(lambda: all(status(n)['applied'] == status(first)['commit'] for n in range(3))), \
+            "Every node should apply what was committed"
+        before = [status(n) for n in range(3)]
+        
+        # Cut off from both followers, the leader can't confirm it still leads
+        others = [n for n in range(3) if n != first]
+        for n in others:
+            nodes[n].send_signal(signal.SIGSTOP)
+        
+        def stopped(n):
+            with open(f'/proc/{nodes[n].pid}/stat') as stat:
+                return stat.read().rsplit(')', 1)[1].split()[0] == 'T'
+        
+        assert wait_for(lambda: all(stopped(n) for n in others)), "The followers should stop"
+        nodes[first].stdin.write('select\n')
+        nodes[first].stdin.flush()
+        lines = []
+        while not lines or lines[-1] not in ('Executed.', 'Error: Not committed by the cluster.'):
+            lines.append(nodes[first].stdout.readline().replace('db > ', '').rstrip('\n'))
+        for n in others:
+            nodes[n].send_signal(signal.SIGCONT)
+        assert lines == ['Error: Not committed by the cluster.'], \
+            "A leader without a majority should not serve reads"
+        
+        for node in nodes:
+            node.communicate('.exit\n', timeout=10)
+        start_nodes()
+        assert wait_for(lambda: leader() is not None), "A leader should be elected after the restart"
+        assert wait_for(lambda: all(status(n)['commit'] >= before[n]['commit'] and
+                                    status(n)['applied'] >= before[n]['applied'] for n in range(3))), \
+            "A restart should keep the committed log"
+        for n in range(3):
+            rows = [line for line in ask(n, 'select', 'Executed.') if line.startswith('(')]
+            assert rows == ['(1, user1, person1@example.com)',
+                            '(2, user2, person2@example.com)'], "Restarted nodes should not apply entries twice"
+    finally:
+        for node in nodes:
+            node.kill()
+            node.wait()
+    
+    for db_file in db_files:
+        db.remove_db_file(db_file)
+    print("✅ Raft cluster tests passed!")
+
+def test_point_in_time_recovery():
+    """Test restoring a base backup plus archived changes to a chosen point"""
+    print("🧪 Testing point-in-time recovery...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    base = db_file + '.base'
+    archive = tempfile.mkdtemp()
+    
+    db.run_until_exit(['insert 1 user1 person1@example.com',
+                       '.backup ' + base,
+                       'insert 2 user2 person2@example.com',
+                       '.archive ' + archive,
+                       'insert 3 user3 person3@example.com'], db_file)
+    assert len(os.listdir(archive)) == 2, "Closing should archive the remaining changes"
+    
+    restored = db_file + '.restored'
+    result = db.run_script([], restored, ['--restore', base, '--archive', archive,
+                                          '--until-seq', '2'])
+    assert 'Restored through change 2, 2 rows.' in result['lines'], "Restore should stop at the target"
+    result = db.run_until_exit(['select'], restored)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(1, user1, person1@example.com)',
+                    '(2, user2, person2@example.com)'], "Restored table should end at the target"
+    
+    result = db.run_script([], restored, ['--restore', base, '--archive', archive])
+    assert result['exit_status'] != 0, "Restore should not overwrite an existing file"
+    
+    # An archive that only goes back to the base backup is enough
+    db.remove_db_file(db_file)
+    shutil.rmtree(archive)
+    archive = tempfile.mkdtemp()
+    db.run_until_exit(['insert 1 user1 person1@example.com',
+                       '.archive ' + archive,
+                       '.backup ' + base,
+                       'insert 2 user2 person2@example.com',
+                       'insert 3 user3 person3@example.com'], db_file)
+    segments = sorted(os.listdir(archive))
+    assert len(segments) == 2, "Closing should archive the changes after the backup"
+    os.remove(os.path.join(archive, segments[0]))
+    result = db.run_script([], restored, ['--restore', base, '--archive', archive])
+    assert 'Restored through change 3, 3 rows.' in result['lines'], "Restore should start after the base backup"
+    result = db.run_until_exit(['insert 4 user4 person4@example.com'], restored)
+    result = db.run_until_exit(['select', '.changes since 0'], restored)
+    assert [line for line in result['lines'] if line.startswith('(')] == \
+        [f'({i}, user{i}, person{i}@example.com)' for i in range(1, 5)], "The restored table should take new rows"
+    assert [line for line in result['lines'] if ': (' in line] == \
+        [f'{i}: ({i}, user{i}, person{i}@example.com)' for i in range(2, 5)], \
+        "The restored change log should continue after the base backup"
+    
+    db.remove_db_file(db_file)
+    shutil.rmtree(archive)
+    print("✅ Point-in-time recovery tests passed!")
+
+def test_id_index():
+    """Test point lookups through the in-memory id index"""
+    print("🧪 Testing id index...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    commands = [f'insert {(i * 7919) % 1000} user{i} person{i}@example.com' for i in range(100)]
+    commands.append('insert 919 again again@example.com')
+    db.run_until_exit(commands, db_file)
+    
+    # Reopening rebuilds the index from the table
+    result = db.run_until_exit(['explain select where id = 919',
+                                'select where id = 919',
+                                'select where id = 5'], db_file)
+    assert 'Plan: index lookup (est. 2 of 8 pages, 2 rows)' in result['lines'], "Point lookups should use the index"
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(919, user1, person1@example.com)',
+                    '(919, again, again@example.com)'], "Lookup should return every row with the id"
+    
+    db.remove_db_file(db_file)
+    print("✅ Id index tests passed!")
+
+def test_learned_index():
+    """Test range scans that seek with the learned model of sorted ids"""
+    print("🧪 Testing learned index...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    # Runs of equal ids and large gaps force several model segments
+    ids = []
+    for i in range(300):
+        ids.append(i // 3 * 5 + (i // 100) * 100000)
+    db.run_until_exit([f'insert {id} user{i} person{i}@example.com' for i, id in enumerate(ids)], db_file)
+    
+    for low, high in [(0, 0), (245, 255), (100001, 100100), (200490, 300000), (99999, 100000)]:
+        result = db.run_until_exit([f'select where id between {low} and {high}'], db_file)
+        rows = [line for line in result['lines'] if line.startswith('(')]
+        expected = [f'({id}, user{i}, person{i}@example.com)' for i, id in enumerate(ids) if low <= id <= high]
+        assert rows == expected, f"Range {low}..{high} should return every matching row"
+    
+    db.remove_db_file(db_file)
+    print("✅ Learned index tests passed!")
+
+def test_bitmap_indexes():
+    """Test email domain and tenant filters answered by bitmap indexes"""
+    print("🧪 Testing bitmap indexes...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    tenants = ['acme', 'globex', 'initech']
+    domains = ['example.com', 'example.org']
+    commands = [f'insert {i} {tenants[i % 3]}_{i} person{i}@{domains[i % 2]}' for i in range(60)]
+    db.run_until_exit(commands, db_file)
+    
+    result = db.run_until_exit(['explain select where email_domain = example.org and tenant = acme',
+                                'select where email_domain = example.org and tenant = acme and id < 30',
+                                'select where tenant = nobody'], db_file)
+    assert 'Plan: bitmap index (est. 5 of 5 pages, 10 rows)' in result['lines'], "Value filters should use bitmaps"
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == [f'({i}, acme_{i}, person{i}@example.org)' for i in [3, 9, 15, 21, 27]], \
+        "Conjunctions should return rows matching every predicate"
+    
+    result = db.run_script(['select where email = x'])
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Only indexed columns can be filtered"
+    
+    db.remove_db_file(db_file)
+    print("✅ Bitmap index tests passed!")
+
+def test_trigram_index():
+    """Test substring searches answered by trigram indexes"""
+    print("🧪 Testing trigram index...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    db.run_until_exit(['insert 1 alice alice.smith@example.com',
+                       'insert 2 bob bob.jones@example.org',
+                       'insert 3 carol carol@smithfield.net',
+                       'insert 4 dave htims@example.com'], db_file)
+    
+    result = db.run_until_exit(["select where email like '%smith%'",
+                                "select where username like '%o%' and email like '%.org%'",
+                                "explain select where email like '%smith%'"], db_file)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(1, alice, alice.smith@example.com)',
+                    '(3, carol, carol@smithfield.net)',
+                    '(2, bob, bob.jones@example.org)'], "Substring filters should find every match"
+    assert 'Plan: bitmap index (est. 1 of 1 pages, 2 rows)' in result['lines'], "Trigrams should narrow the candidates"
+    
+    result = db.run_script(["select where email like 'smith%'"])
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Only '%text%' patterns are supported"
+    
+    db.remove_db_file(db_file)
+    print("✅ Trigram index tests passed!")
+
+def test_cracking():
+    """Test range queries that crack an in-memory copy of the id column"""
+    print("🧪 Testing adaptive cracking...")
+    
+    db = DatabaseTestHarness()
+    ids = [(i * 37) % 50 for i in range(50)]
+    commands = ['.crack', '.crack on']
+    commands += [f'insert {id} user{i} person{i}@example.com' for i, id in enumerate(ids[:40])]
+    commands += ['select where id between 10 and 19', '.crack',
+                 'explain select where id between 10 and 19',
+                 'explain select where id between 30 and 34', '.crack']
+    commands += [f'insert {id} user{i} person{i}@example.com' for i, id in enumerate(ids[40:], 40)]
+    commands += ['select where id between 15 and 24', '.crack']
+    result = db.run_until_exit(commands)
+    
+    assert 'Cracking off.' in result['lines'], "Cracking should start off"
+    assert 'Cracks: 2 over 40 rows' in result['lines'], "A range query should crack both of its bounds"
+    assert 'Plan: cracked index (est. 3 of 4 pages, 7 rows)' in result['lines'], "Cracked ranges are exact"
+    assert 'Plan: cracked index (est. 3 of 4 pages, 4 rows)' in result['lines'], \
+        "Explain should estimate from the existing cracks"
+    assert result['lines'].count('Cracks: 2 over 40 rows') == 2, "Explain should not crack the column"
+    assert 'Cracks: 4 over 50 rows' in result['lines'], "New rows should join without losing cracks"
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    first = [f'({id}, user{i}, person{i}@example.com)' for i, id in enumerate(ids[:40]) if 10 <= id <= 19]
+    second = [f'({id}, user{i}, person{i}@example.com)' for i, id in enumerate(ids) if 15 <= id <= 24]
+    assert rows == first + second, "Cracked ranges should return matching rows in table order"
+    
+    print("✅ Adaptive cracking tests passed!")
+
+def test_partitions():
+    """Test tables split into id-range partition files"""
+    print("🧪 Testing partitions...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    result = db.run_until_exit(['insert 5 user5 person5@example.com',
+                                'insert 150 user150 person150@example.com',
+                                'insert 250 user250 person250@example.com',
+                                'explain select where id >= 200'], db_file, ['--partition-by-id', '100'])
+    assert 'Partitions: 1 of 3' in result['lines'], "Queries should prune partitions outside their range"
+    assert os.path.exists(db_file + '-part-1'), "Each partition should have its own file"
+    
+    result = db.run_until_exit(['drop partition 1', 'drop partition 7', '.partitions', 'select'], db_file)
+    assert 'Error: No such partition.' in result['lines'], "Missing partitions cannot be dropped"
+    assert not os.path.exists(db_file + '-part-1'), "Dropping should unlink the partition file"
+    assert result['lines'][2:4] == ['Partition 0: ids 0-99, 1 rows',
+                                    'Partition 2: ids 200-299, 1 rows'], "Remaining partitions should be listed"
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(5, user5, person5@example.com)',
+                    '(250, user250, person250@example.com)'], "Dropped rows should be gone"
+    
+    result = db.run_script(['.exit'], db_file, ['--partition-by-id', '50'])
+    assert 'Only an empty table can be partitioned' in result['lines'], "Partitioning is fixed once set"
+    db.remove_db_file(db_file)
+    
+    db_file = db.new_db_file()
+    result = db.run_until_exit(['insert 2000000000 user1 person1@example.com',
+                                'insert 7 user7 person7@example.com', '.partitions',
+                                'explain select where id > 10'], db_file, ['--partition-by-id', '1'])
+    assert result['lines'][2:4] == ['Partition 7: ids 7-7, 1 rows',
+                                    'Partition 2000000000: ids 2000000000-2000000000, 1 rows'], \
+        "Only partitions that exist should take space"
+    assert 'Partitions: 1 of 2' in result['lines'], "Pruning should work on sparse partitions"
+    
+    db.remove_db_file(db_file)
+    print("✅ Partition tests passed!")
+
+def test_import():
+    """Test bulk loading CSV and TSV files"""
+    print("🧪 Testing import...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    csv_file = db_file + '.csv'
+    with open(csv_file, 'w') as f:
+        f.write('id,username,email\n')
+        f.write('1,alice,alice@example.com\r\n')
+        f.write('2,bob\n')
+        f.write('\n')
+        f.write('x3,carol,carol@example.com\n')
+        f.write('4,dave,dave@example.com')
+    tsv_file = db_file + '.tsv'
+    with open(tsv_file, 'w') as f:
+        for i in range(5, 305):
+            f.write(f'{i}\tuser{i}\tperson{i}@example.com\n')
+    
+    result = db.run_script([f'.import {csv_file}', f'.import {tsv_file}'], db_file)
+    assert 'Imported 2 rows, skipped 2 lines.' in result['lines'], "Bad lines should be counted and skipped"
+    assert 'Imported 300 rows, skipped 0 lines.' in result['lines'], "Tab separated files should load"
+    
+    result = db.run_until_exit(['select where id <= 5'], db_file)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(1, alice, alice@example.com)',
+                    '(4, dave, dave@example.com)',
+                    '(5, user5, person5@example.com)'], "Imported rows should survive a restart"
+    
+    result = db.run_script(['.import /nonexistent.csv'], db_file)
+    assert 'Unable to open import file' in result['lines'], "Missing files should be reported"
+    
+    db.remove_db_file(db_file)
+    print("✅ Import tests passed!")
+
+def test_create_index():
+    """Test the bulk-built on-disk id index"""
+    print("🧪 Testing create index...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    # Ids arrive shuffled, so zone maps cannot narrow a range down.
+    commands = []
+    for i in range(1, 101):
+        j = (i * 37) % 101
+        commands.append(f'insert {j} user{j} person{j}@example.com')
+    commands += ['create index fill 50', 'create index fill 5',
+                 'explain select where id between 10 and 12',
+                 'select where id between 10 and 12']
+    result = db.run_until_exit(commands, db_file)
+    assert 'Index built: 100 rows, 1 pages, height 1.' in result['lines'], "Index should cover every row"
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Fill factor should be bounded"
+    assert 'Plan: index range scan (est. 3 of 8 pages, 3 rows)' in result['lines'], "Range should use the index"
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(10, user10, person10@example.com)',
+                    '(12, user12, person12@example.com)',
+                    '(11, user11, person11@example.com)'], "Index range scan should find every match"
+    assert os.path.exists(db_file + '-index'), "Index should be written beside the table"
+    
+    # Later inserts are added to the saved index.
+    result = db.run_until_exit(['insert 11 late late@example.com',
+                                'select where id between 11 and 11'], db_file)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(11, user11, person11@example.com)',
+                    '(11, late, late@example.com)'], "Index should follow inserts"
+    
+    db.remove_db_file(db_file)
+    print("✅ Create index tests passed!")
+
+def test_order_by():
+    """Test sorting select output inside the engine"""
+    print("🧪 Testing order by...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    # Enough rows that the sort is split across threads and merged.
+    commands = []
+    for i in range(300):
+        j = (i * 97) % 300
+        commands.append(f'insert {j} user{(j * 7) % 300} person{j}@example.com')
+    commands += ['select order by id', 'select where id < 3 order by username desc',
+                 'explain select order by email', 'select approx_count_distinct(id) order by id']
+    result = db.run_until_exit(commands, db_file)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    ids = [int(line[1:].split(',')[0]) for line in rows[:300]]
+    assert ids == list(range(300)), "Rows should come out in id order"
+    assert rows[300:] == ['(1, user7, person1@example.com)',
+                          '(2, user14, person2@example.com)',
+                          '(0, user0, person0@example.com)'], "Descending string sort should order by username"
+    assert 'Sort: email' in result['lines'], "Explain should show the sort"
+    assert 'Syntax error. Could not parse statement.' in result['lines'], "Aggregates cannot be ordered"
+    db.remove_db_file(db_file)
+    
+    # Imported usernames can hold spaces, so a pattern can too
+    db_file = db.new_db_file()
+    fd, csv_file = tempfile.mkstemp(suffix='.csv')
+    with os.fdopen(fd, 'w') as rows:
+        rows.write('1,la order by id,one@example.com\n2,plain,two@example.com\n'
+                   '3,xa order by idx,three@example.com\n')
+    result = db.run_until_exit([f'.import {csv_file}',
+                                "select where username like '%a order by id%'",
+                                "select where username like '%a order by id%' order by id desc"], db_file)
+    os.remove(csv_file)
+    rows = [line for line in result['lines'] if line.startswith('(')]
+    assert rows == ['(1, la order by id, one@example.com)', '(3, xa order by idx, three@example.com)',
+                    '(3, xa order by idx, three@example.com)', '(1, la order by id, one@example.com)'], \
+        "Order by inside a quoted pattern should be part of the pattern"
+    
+    db.remove_db_file(db_file)
+    print("✅ Order by tests passed!")
+
+def test_sort_keys():
+    """Test string ordering past the normalized key prefix"""
+    print("🧪 Testing sort keys...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    # The first names share their first 8 bytes, so only the rest decides.
+    names = ['customer_b', 'customer_a', 'customer', 'custom', 'customer_ab', 'zed']
+    commands = [f'insert {i} {name} {name}@example.com' for i, name in enumerate(names)]
+    commands += ['select order by username', 'select order by email desc']
+    result = db.run_until_exit(commands, db_file)
+    rows = [line.split(', ')[1] for line in result['lines'] if line.startswith('(')]
+    assert rows[:len(names)] == sorted(names), "Strings tied on their prefix should order by the rest"
+    emails = [line.split(', ')[2] for line in result['lines'] if line.startswith('(')][len(names):]
+    assert emails == sorted(f'{name}@example.com)' for name in names)[::-1], "Descending order should reverse it"
+    
+    db.remove_db_file(db_file)
+    print("✅ Sort key tests passed!")
+
+def test_cancellation():
+    """Test statement timeouts and Ctrl-C handling"""
+    print("🧪 Testing cancellation...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    result = db.run_until_exit(['.timeout', '.timeout 250', '.timeout', '.timeout -1', '.timeout abc',
+                                '.timeout', 'insert 1 user1 person1@example.com', 'select'], db_file)
+    assert 'Timeout off.' in result['lines'], "No timeout by default"
+    assert result['lines'][1] == 'Timeout: 250 ms', "Timeout should be settable"
+    assert result['lines'][2:5] == ['Timeout must be between 0 and 4294967295 ms.'] * 2 + ['Timeout: 250 ms'], \
+        "Negative and non-numeric timeouts are rejected without changing the timeout"
+    assert '(1, user1, person1@example.com)' in result['lines'], "Fast statements finish within the timeout"
+    
+    # SIGINT cancels the running statement; at the prompt it is harmless.
+    process = subprocess.Popen([db.executable_path, db_file], stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE, text=True)
+    process.stdin.write('insert 2 user2 person2@example.com\n')
+    process.stdin.flush()
+    time.sleep(0.2)
+    process.send_signal(signal.SIGINT)
+    output, _ = process.communicate('select\n.exit\n', timeout=10)
+    assert process.returncode == 0, "Ctrl-C should not kill the database"
+    assert '(2, user2, person2@example.com)' in output, "Inserts before Ctrl-C should be kept"
+    db.remove_db_file(db_file)
+    
+    # Enough rows, over enough partitions, that nothing below runs in 1 ms.
+    db_file = db.new_db_file()
+    fd, csv_file = tempfile.mkstemp(suffix='.csv')
+    with os.fdopen(fd, 'w') as rows:
+        rows.writelines(f'{i},user{i},person{i}@example.com\n' for i in range(1, 60001))
+    result = db.run_until_exit(['.timeout 1', f'.import {csv_file}'], db_file, ['--partition-by-id', '1000'])
+    assert result['lines'][-1] == 'Error: Statement timed out.', "A slow import should hit the deadline"
+    db.remove_db_file(db_file)
+    
+    db_file = db.new_db_file()
+    result = db.run_until_exit([f'.import {csv_file}', '.timeout 1', 'select'], db_file, ['--partition-by-id', '1000'])
+    assert result['lines'][0] == 'Imported 60000 rows, skipped 0 lines.', "The import should finish without a timeout"
+    assert result['lines'][-1] == 'Error: Statement timed out.', "A slow scan should hit the deadline"
+    
+    # Nothing reads the scan's output, so it blocks part way until Ctrl-C.
+    process = subprocess.Popen([db.executable_path, db_file], stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE, text=True)
+    process.stdin.write('select\n')
+    process.stdin.flush()
+    time.sleep(0.5)
+    process.send_signal(signal.SIGINT)
+    output, _ = process.communicate('.exit\n', timeout=10)
+    lines = output.replace('db > ', '').splitlines()
+    assert 'Error: Statement cancelled.' in lines, "Ctrl-C should cancel the running statement"
+    assert len([line for line in lines if line.startswith('(')]) < 60000, "A cancelled scan should stop early"
+    
+    os.remove(csv_file)
+    db.remove_db_file(db_file)
+    print("✅ Cancellation tests passed!")
+
+def test_memory_budget():
+    """Test memory accounting, page eviction and sort spills"""
+    print("🧪 Testing memory budget...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    commands = [f'insert {(i * 37) % 500} user{(i * 11) % 97} person{i}@example.com' for i in range(500)]
+    db.run_until_exit(commands, db_file)
+    queries = ['select order by username', 'select order by id desc', 'select']
+    unlimited = db.run_until_exit(queries + ['.memory'], db_file)
+    assert 'Budget: unlimited' in unlimited['lines'], "No budget by default"
+    
+    budgeted = db.run_until_exit(queries + ['.memory'], db_file, ['--memory-limit', '40000'])
+    rows = [line for line in unlimited['lines'] if line.startswith('(')]
+    assert [line for line in budgeted['lines'] if line.startswith('(')] == rows, "A budget should not change results"
+    assert 'Budget: 40000 bytes' in budgeted['lines'], "The budget should be reported"
+    workspace = next(line for line in budgeted['lines'] if line.startswith('Workspace:'))
+    assert int(workspace.split('peak ')[1].split(',')[0]) <= 12000, "Sorts should stay within the workspace share"
+    stats = next(line for line in budgeted['lines'] if line.startswith('Evicted pages:'))
+    assert not stats.startswith('Evicted pages: 0,') and not stats.endswith('sort spills: 0'), "A small budget should evict pages and spill sorts"
+    
+    result = db.run_until_exit(['.memory limit 1000000', '.memory'], db_file)
+    assert 'Budget: 1000000 bytes' in result['lines'], ".memory limit should set the budget"
+    assert 'Buffer pool: 159744 bytes, peak 159744, limit 600000' in result['lines'], "The 39 loaded pages are charged to the buffer pool"
+    
+    result = db.run_until_exit(['.memory limit 50000', '.memory limit abc', '.memory limit -1',
+                                '.memory limit 12x', '.memory limit 99999999999999999999999', '.memory'], db_file)
+    assert result['lines'].count('Memory limit must be between 0 and 184467440737095516 bytes.') == 4, "Bad limits should be rejected"
+    assert 'Budget: 50000 bytes' in result['lines'], "A rejected limit should keep the budget"
+    for bad in ['-1', 'abc', '']:
+        result = db.run_until_exit(['.memory'], db_file, ['--memory-limit', bad])
+        assert result['lines'][0] == 'Memory limit must be between 0 and 184467440737095516 bytes', f"--memory-limit {bad!r} should be rejected"
+    db.remove_db_file(db_file)
+    
+    # Inserts only dirty pages, so the pool stays in its share only by
+    # writing them back early.
+    db_file = db.new_db_file()
+    commands = [f'insert {i} user{i} person{i}@example.com' for i in range(1, 401)]
+    result = db.run_until_exit(commands + ['.memory'], db_file, ['--memory-limit', '40000'])
+    pool = next(line for line in result['lines'] if line.startswith('Buffer pool:'))
+    used, peak = int(pool.split(': ')[1].split(' ')[0]), int(pool.split('peak ')[1].split(',')[0])
+    assert used <= 24000 and peak <= 24000 + 4096, f"Inserts should stay within the pool share: {pool}"
+    stats = next(line for line in result['lines'] if line.startswith('Evicted pages:'))
+    assert not stats.startswith('Evicted pages: 0,') and 'written back: 0,' not in stats, "Dirty pages should be written back and evicted"
+    assert not os.path.exists(db_file + '-dw'), "The double-write file should be removed after a write back"
+    result = db.run_until_exit(['select'], db_file)
+    assert [line for line in result['lines'] if line.startswith('(')] == \
+        [f'({i}, user{i}, person{i}@example.com)' for i in range(1, 401)], "Written back rows should read back"
+    db.remove_db_file(db_file)
+    print("✅ Memory budget tests passed!")
+
+def test_sessions():
+    """Test client sessions, the scheduler and background checkpoints"""
+    print("🧪 Testing sessions...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    socket_path = db_file + '-session'
+    
+    process = subprocess.Popen([db.executable_path, db_file, '--listen', socket_path,
+                                '--checkpoint-rate', '1000'],
+                               stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+    for _ in range(100):
+        if os.path.exists(socket_path):
+            break
+        time.sleep(0.05)
+    client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    client.connect(socket_path)
+    client.sendall(b'insert 1 user1 person1@example.com\nselect where id = 1\n.exit\n')
+    replies = b''
+    while True:
+        data = client.recv(4096)
+        if not data:
+            break
+        replies += data
+    client.close()
+    replies = replies.decode().replace('db > ', '').splitlines()
+    assert replies == ['Executed.', '(1, user1, person1@example.com)', 'Executed.'], "A session should get its own results"
+    
+    time.sleep(1.5)  # Long enough for a checkpoint
+    output, _ = process.communicate('select\n.scheduler\n.exit\n', timeout=10)
+    lines = output.replace('db > ', '').splitlines()
+    assert '(1, user1, person1@example.com)' in lines, "The console should see rows a session added"
+    assert 'Point: 2 statements' in lines[-5], "Point statements should be counted"
+    assert 'Scan: 1 statements' in lines[-4], "Scans should be counted"
+    assert lines[-3] == 'Background: 1 pages checkpointed, at most 1000 a second', "The dirty page should be checkpointed"
+    assert lines[-2] == 'Waiting: 0 point, 0 scan, 0 background', "Nothing should be waiting for the console"
+    
+    result = db.run_until_exit(['.scheduler'], db_file, ['--raft-id', '1', '--listen', socket_path])
+    assert result['lines'][0] == 'Cluster nodes cannot take sessions or checkpoint', "Sessions need a standalone table"
+    db.remove_db_file(db_file)
+    
+    # Enough rows that a full scan outlasts a 1 ms timeout and the socket buffer.
+    db_file = db.new_db_file()
+    socket_path = db_file + '-session'
+    fd, csv_file = tempfile.mkstemp(suffix='.csv')
+    with os.fdopen(fd, 'w') as rows:
+        rows.writelines(f'{i},user{i},person{i}@example.com\n' for i in range(1, 60001))
+    db.run_until_exit([f'.import {csv_file}'], db_file, ['--partition-by-id', '1000'])
+    os.remove(csv_file)
+    process = subprocess.Popen([db.executable_path, db_file, '--listen', socket_path],
+                               stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+    for _ in range(100):
+        if os.path.exists(socket_path):
+            break
+        time.sleep(0.05)
+    
+    def connect():
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.connect(socket_path)
+        return client
+    
+    def read_until(client, line):
+        replies = b''
+        while (line + '\n').encode() not in replies:
+            data = client.recv(65536)
+            assert data, f"The session closed before '{line}'"
+            replies += data
+        return replies.decode().replace('db > ', '').splitlines()
+    
+    timed = connect()
+    timed.sendall(b'.timeout 1\n.timeout\nselect\n')
+    lines = read_until(timed, 'Error: Statement timed out.')
+    assert lines[0] == 'Timeout: 1 ms', "A session should set its own timeout"
+    assert len([line for line in lines if line.startswith('(')]) < 60000, "The timeout should stop the scan"
+    
+    scanning = connect()
+    scanning.sendall(b'.session\n')
+    replies = b''
+    while b'\n' not in replies:
+        replies += scanning.recv(4096)
+    scan_id = replies.decode().replace('db > ', '').split()[1]
+    scanning.sendall(b'select\n')
+    time.sleep(0.5)  # The scan blocks once the unread socket buffer fills
+    canceller = connect()
+    canceller.sendall(f'.cancel {scan_id}\n.cancel 999\n.timeout\n'.encode())
+    lines = read_until(scanning, 'Error: Statement cancelled.')
+    assert len([line for line in lines if line.startswith('(')]) < 60000, "A cancelled scan should stop early"
+    lines = read_until(canceller, 'Timeout off.')
+    assert lines == ['Cancel requested.', 'No such session.', 'Timeout off.'], \
+        "Cancel should name a session, and timeouts should not leak between sessions"
+    
+    def yields(client):
+        client.sendall(b'.scheduler\n')
+        replies = b''
+        while b'\n' not in replies.partition(b'Yields: ')[2]:
+            replies += client.recv(4096)
+        return int(replies.decode().split('Yields: ')[1].split()[0])
+    
+    # The scan fills the socket buffer and stalls mid-page. Reading part of
+    # it lets the scan reach a page boundary, where it should hand the
+    # executor to the waiting point select before sending the rest.
+    yields_before = yields(canceller)
+    scanning.sendall(b'select\n')
+    time.sleep(0.3)
+    canceller.sendall(b'select where id = 5\n')
+    time.sleep(0.1)
+    received = b''
+    while len(received) < 262144:
+        received += scanning.recv(65536)
+    canceller.settimeout(5)
+    try:
+        lines = read_until(canceller, 'Executed.')
+    except socket.timeout:
+        lines = []
+    canceller.settimeout(None)
+    assert lines[-2:] == ['(5, user5, person5@example.com)', 'Executed.'], \
+        "The point select should finish while the scan is still running"
+    while not received.endswith(b'Executed.\ndb > '):
+        data = scanning.recv(65536)
+        assert data, "The session closed during the scan"
+        received = (received + data)[-64:]
+    assert yields(canceller) > yields_before, "The scan should have yielded to the point select"
+    
+    # A scan queued behind a running scan waits as a scan, so the running
+    # scan yields once, to the point statement queued after it.
+    queued = connect()
+    assert queued.recv(4096) == b'db > ', "A new session should get a prompt"
+    yields_before = yields(canceller)
+    scanning.sendall(b'select\n')
+    time.sleep(0.3)
+    queued.sendall(b"select where username like '%nobody%'\n")
+    time.sleep(0.1)
+    canceller.sendall(b'.scheduler\n')
+    time.sleep(0.1)
+    received = b''
+    while len(received) < 262144:
+        received += scanning.recv(65536)
+    replies = b''
+    while b'\n' not in replies.partition(b'Yields: ')[2]:
+        replies += canceller.recv(4096)
+    lines = replies.decode().replace('db > ', '').splitlines()
+    waiting = next(line for line in lines if line.startswith('Waiting: '))
+    assert waiting.startswith('Waiting: 0 point, '), "The queued scan should not wait as a point statement"
+    assert lines[-1] == f"Yields: {yields_before + 1}", f"Only the point statement should make the scan yield: {lines}"
+    while not received.endswith(b'Executed.\ndb > '):
+        data = scanning.recv(65536)
+        assert data, "The session closed during the scan"
+        received = (received + data)[-64:]
+    read_until(queued, 'Executed.')
+    
+    # An insert that opens a partition while the scan is parked further on
+    # moves the later partitions along; the scan should still read each
+    # partition once.
+    canceller.sendall(b'drop partition 2\n')
+    read_until(canceller, 'Executed.')
+    scanning.sendall(b'select\n')
+    time.sleep(0.3)
+    canceller.sendall(b'insert 2500 user2500 person2500@example.com\n')
+    time.sleep(0.1)
+    lines = read_until(scanning, 'Executed.')
+    ids = [int(line[1:].split(',')[0]) for line in lines if line.startswith('(')]
+    assert sorted(ids) == [i for i in range(1, 60001) if not 2000 <= i < 3000], \
+        "Opening a partition during a scan should not repeat or skip partitions"
+    read_until(canceller, 'Executed.')
+    for client in (timed, scanning, canceller, queued):
+        client.close()
+    process.communicate('.exit\n', timeout=10)
+    
+    db.remove_db_file(db_file)
+    print("✅ Session tests passed!")
+
+def test_query_stats():
+    """Test statement fingerprints, .top and the slow query log"""
+    print("🧪 Testing query stats...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    slow_log = db_file + '-slow.log'
+    
+    commands = [f'insert {i} user{i} person{i}@example.com' for i in range(20)]
+    commands += ['select where id = 3', 'select where id = 17', "select where username like '%er1%'",
+                 'select tablesample bernoulli(50%) repeatable(7)', '.top', '.top 1']
+    result = db.run_until_exit(commands, db_file, ['--slow-log', slow_log, '--slow-ms', '0'])
+    top = [line for line in result['lines'] if ' calls, ' in line]
+    assert len(top) == 5, ".top 1 should list one fingerprint after the four from .top"
+    top = top[:4]
+    fingerprints = [line.split(': ', 1)[1] for line in top]
+    assert fingerprints.count('insert ? ? ?') == 1, "Inserts should share one fingerprint"
+    assert top[fingerprints.index('insert ? ? ?')].startswith('20 calls, '), "Every insert should be counted"
+    assert top[fingerprints.index('select where id = ?')].startswith('2 calls, '), "Literals should not split fingerprints"
+    assert 'select where username like ?' in fingerprints, "Quoted strings should be stripped"
+    assert 'select tablesample bernoulli(?%) repeatable(?)' in fingerprints, "Numbers should be stripped"
+    assert ', 2 rows scanned, ' in top[fingerprints.index('select where id = ?')], "Rows scanned should be counted"
+    
+    with open(slow_log) as log:
+        logged = log.read().splitlines()
+    assert len(logged) == 24, "Every statement should be over a zero threshold"
+    assert logged[20].endswith('rows scanned, 0 pages read: select where id = 3'), "The log should keep the statement text"
+    
+    result = db.run_until_exit(['select', '.top'], db_file, ['--memory-limit', '10000'])
+    top = [line for line in result['lines'] if line.endswith(': select')]
+    assert ', 0 pages read' not in top[0], "Evicted pages should be counted as read"
+    
+    # Values spelled like keywords are still values.
+    result = db.run_until_exit(['insert 100 id email', 'select where id = 100', 'select where id >= 5',
+                                'select where email_domain = email', '.top', '.top -1', '.top abc', '.top 0', '.top 2x'], db_file)
+    fingerprints = [line.split(': ', 1)[1] for line in result['lines'] if ' calls, ' in line]
+    assert sorted(fingerprints) == ['insert ? ? ?', 'select where email_domain = ?', 'select where id = ?', 'select where id >= ?'], \
+        f"Insert arguments and operands should be stripped: {fingerprints}"
+    assert result['lines'][-4:] == ['Count must be between 1 and 4294967295.'] * 4, ".top should reject bad counts"
+    for bad in ['-1', 'abc', '10ms', '']:
+        result = db.run_until_exit(['.top'], db_file, ['--slow-ms', bad])
+        assert result['lines'][0] == 'Slow query threshold must be between 0 and 4294967295 ms', \
+            f"--slow-ms {bad!r} should be rejected"
+    
+    db.remove_db_file(db_file)
+    print("✅ Query stats tests passed!")
+
+def test_perf_counters():
+    """Test hardware counter profiling, where the host allows it"""
+    print("🧪 Testing perf counters...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    
+    result = db.run_until_exit(['.perf', '.perf on', 'insert 1 user1 person1@example.com',
+                                'select', '.perf off', 'select', '.perf'], db_file)
+    lines = result['lines']
+    assert lines[0] == 'Perf off, 0 statements profiled', "Profiling should be off by default"
+    if lines[1].startswith('Performance counters unavailable: '):
+        # Containers and VMs often hide the PMU; nothing is profiled then.
+        assert lines[-1] == 'Perf off, 0 statements profiled', "Nothing is profiled without counters"
+    else:
+        profiles = [line for line in lines if line.startswith('Cycles: ')]
+        assert len(profiles) == 3, "Each profiled statement should report its counters"
+        assert lines[-2] == 'Perf off, 2 statements profiled', "Only statements run with perf on count"
+        assert lines[-1].startswith('Cycles: '), "Totals should be reported"
+    
+    db.remove_db_file(db_file)
+    print("✅ Perf counter tests passed!")
+
+def test_workload_driver():
+    """Test the in-process YCSB-style workload driver"""
+    print("🧪 Testing workload driver...")
+    
+    db = DatabaseTestHarness()
+    db_file = db.new_db_file()
+    build_dir = tempfile.mkdtemp()
+    driver = os.path.join(build_dir, 'ycsb')
+    subprocess.run(['gcc', '-Wall', '-Wextra', '-std=c11', '-o', driver, 'ycsb.c', '-lm', '-pthread'],
+                   capture_output=True, text=True, check=True)
+    
+    result = subprocess.run([driver, db_file, '--records', '400', '--operations', '300',
+                             '--threads', '3', '--mix', '25,25,25,25', '--partition-size', '100'],
+                            capture_output=True, text=True, timeout=60)
+    lines = result.stdout.strip().split('\n')
+    assert result.returncode == 0, "The driver should finish the run"
+    assert lines[0] == 'Workload read-heavy: 25% read, 25% update, 25% scan, 25% insert, zipfian keys, 3 threads', \
+        "The mix given should replace the workload's"
+    assert lines[1].startswith('Loaded 400 rows in '), "Records should be loaded first"
+    assert 'Ran 300 operations in ' in result.stdout, "Every operation should be run"
+    totals = [line.split()[0] for line in lines if line.endswith(' us') and ' errors ' in line]
+    assert totals == ['read', 'update', 'scan', 'insert'], "Each operation should report its latencies"
+    assert not any(line.startswith('(') for line in lines), "Rows read should not be printed"
+    
+    result = db.run_until_exit(['select where id = 1', '.partitions'], db_file)
+    assert '(1, user1, user1@ycsb.test)' in result['lines'], "Loaded rows should persist"
+    assert any(line.startswith('Partition 3: ids 300-399') for line in result['lines']), \
+        "Rows should be spread over partitions"
+    
+    result = subprocess.run([driver, db_file], capture_output=True, text=True, timeout=60)
+    assert result.stdout == 'The database must be new\n', "Only a new database can be loaded"
+    
+    # Updates to a single id fill its partition; the rest fail untimed
+    full_file = db.new_db_file()
+    result = subprocess.run([driver, full_file, '--records', '1', '--operations', '2000',
+                             '--mix', '0,100,0,0', '--partition-size', '1'],
+                            capture_output=True, text=True, timeout=60)
+    update = [line.split() for line in result.stdout.split('\n') if line.startswith('update ')][0]
+    assert int(update[1]) < 2000 and int(update[1]) + int(update[3]) == 2000, \
+        "Failed operations should be counted apart from timed ones"
+    assert f', {update[3]} failed' in result.stdout, "The totals should show failures"
+    db.remove_db_file(full_file)
+    
+    shutil.rmtree(build_dir)
+    db.remove_db_file(db_file)
+    print("✅ Workload driver tests passed!")
+
 def main():
     """Run all tests"""
     print("🚀 Starting database tests...")
@@ -161,6 +1285,31 @@ def main():
         test_error_conditions()
         test_boundary_conditions()
         test_meta_commands()
+        test_persistence()
+        test_torn_page_recovery()
+        test_where_and_analyze()
+        test_approximate_aggregates()
+        test_tablesample()
+        test_change_log()
+        test_replica()
+        test_raft_cluster()
+        test_point_in_time_recovery()
+        test_id_index()
+        test_learned_index()
+        test_bitmap_indexes()
+        test_trigram_index()
+        test_cracking()
+        test_partitions()
+        test_import()
+        test_create_index()
+        test_order_by()
+        test_sort_keys()
+        test_cancellation()
+        test_memory_budget()
+        test_sessions()
+        test_query_stats()
+        test_perf_counters()
+        test_workload_driver()
         
         print("\n🎉 All tests passed successfully!")
         return 0
@@ -0,0 +1,523 @@
+// Workload driver in the style of YCSB. It builds the engine in, loads a
+// table of records, then has client threads run a mix of point reads,
+// updates, range scans and inserts as sessions of the statement
+// scheduler, reporting throughput and latency percentiles as it goes.
+//
+//   gcc -Wall -Wextra -std=c11 -o ycsb ycsb.c -lm -pthread
+//   ./ycsb bench.db --workload update-heavy --records 10000 --threads 4
+#define DB_NO_MAIN
+#include "maincode.c"
+
+#define YCSB_ZIPFIAN_THETA 0.99
+#define YCSB_LOAD_BATCH 1024
+#define YCSB_STATEMENT_SIZE 128
+
+typedef enum {
+  OPERATION_READ,
+  OPERATION_UPDATE,
+  OPERATION_SCAN,
+  OPERATION_INSERT
+} Operation;
+#define OPERATIONS 4
+
+const char* OPERATION_NAMES[OPERATIONS] = {"read", "update", "scan", "insert"};
+
+typedef enum {
+  DISTRIBUTION_UNIFORM,
+  DISTRIBUTION_ZIPFIAN,
+  DISTRIBUTION_LATEST
+} Distribution;
+
+const char* DISTRIBUTION_NAMES[] = {"uniform", "zipfian", "latest"};
+
+// Percent of operations of each kind, and how their keys are picked.
+typedef struct {
+  const char* name;
+  uint32_t mix[OPERATIONS];
+  Distribution distribution;
+} Workload;
+
+const Workload WORKLOADS[] = {
+    {"read-heavy", {95, 5, 0, 0}, DISTRIBUTION_ZIPFIAN},
+    {"update-heavy", {50, 50, 0, 0}, DISTRIBUTION_ZIPFIAN},
+    {"scan-heavy", {0, 0, 95, 5}, DISTRIBUTION_ZIPFIAN},
+    {"insert-latest", {95, 0, 0, 5}, DISTRIBUTION_LATEST},
+};
+#define NUM_WORKLOADS (sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+// Ranks from a Zipfian distribution over items, drawn without rejection
+// as in Gray et al., "Quickly generating billion-record synthetic
+// databases". Rank 0 is the most popular.
+typedef struct {
+  uint64_t items;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+} Zipfian;
+
+// Latencies of one kind of operation, in microseconds. Only operations
+// that succeeded are timed; failures are just counted in errors.
+typedef struct {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t total_us;
+  uint32_t max_us;
+  KllSketch latency;
+} OperationStats;
+
+typedef struct {
+  Table* table;
+  Workload workload;
+  uint64_t records;
+  uint64_t operations;
+  uint32_t max_scan;
+  Zipfian zipfian;
+  uint64_t next_op;    // Operations handed out to clients
+  uint64_t next_id;    // Id of the next insert
+  uint64_t last_id;    // Highest id known to be in the table
+  uint64_t versions;   // Rows written by updates
+  FILE* report;        // The original stdout; clients write to /dev/null
+  pthread_mutex_t lock;  // Guards the stats
+  OperationStats interval[OPERATIONS];
+  OperationStats total[OPERATIONS];
+} Driver;
+
+typedef struct {
+  Driver* driver;
+  Session session;
+  uint64_t random_state;
+  pthread_t thread;
+} Client;
+
+double zeta(uint64_t items, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= items; i++) {
+    sum += 1 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+void zipfian_init(Zipfian* zipfian, uint64_t items, double theta) {
+  zipfian->items = items;
+  zipfian->theta = theta;
+  zipfian->alpha = 1 / (1 - theta);
+  zipfian->zetan = zeta(items, theta);
+  zipfian->eta = (1 - pow(2.0 / items, 1 - theta)) /
+                 (1 - zeta(2, theta) / zipfian->zetan);
+}
+
+// u is uniform in [0, 1).
+uint64_t zipfian_next(Zipfian* zipfian, double u) {
+  double uz = u * zipfian->zetan;
+  if (uz < 1) {
+    return 0;
+  }
+  if (uz < 1 + pow(0.5, zipfian->theta)) {
+    return 1;
+  }
+  uint64_t rank = (uint64_t)(zipfian->items *
+                             pow(zipfian->eta * u - zipfian->eta + 1,
+                                 zipfian->alpha));
+  return rank < zipfian->items ? rank : zipfian->items - 1;
+}
+
+uint64_t client_random(Client* client) {
+  client->random_state ^= client->random_state >> 12;
+  client->random_state ^= client->random_state << 25;
+  client->random_state ^= client->random_state >> 27;
+  return client->random_state * 0x2545F4914F6CDD1DULL;
+}
+
+double client_uniform(Client* client) {
+  return (client_random(client) >> 11) * 0x1.0p-53;
+}
+
+// Picks the id of an existing row. Zipfian ranks are hashed so the
+// popular rows are spread over the table rather than packed at its start;
+// latest favours the most recent inserts.
+uint32_t client_pick_id(Client* client) {
+  Driver* driver = client->driver;
+  uint64_t last_id = __atomic_load_n(&(driver->last_id), __ATOMIC_ACQUIRE);
+  switch (driver->workload.distribution) {
+    case (DISTRIBUTION_UNIFORM):
+      return 1 + client_random(client) % last_id;
+    case (DISTRIBUTION_ZIPFIAN): {
+      uint64_t rank = zipfian_next(&(driver->zipfian), client_uniform(client));
+      return 1 + hash_bytes(&rank, sizeof(rank)) % driver->records;
+    }
+    case (DISTRIBUTION_LATEST): {
+      uint64_t rank = zipfian_next(&(driver->zipfian), client_uniform(client));
+      return rank < last_id ? last_id - rank : 1;
+    }
+  }
+  return 1;
+}
+
+Operation client_pick_operation(Client* client) {
+  uint32_t roll = client_random(client) % 100;
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    if (roll < client->driver->workload.mix[op]) {
+      return op;
+    }
+    roll -= client->driver->workload.mix[op];
+  }
+  return OPERATION_READ;
+}
+
+// Runs one statement the way a session does, holding the executor.
+bool client_execute(Client* client, char* text) {
+  InputBuffer input_buffer = {text, strlen(text) + 1, strlen(text), 0};
+  PreparedInput input;
+  scheduler_acquire(&(client->session), session_prepare(&input_buffer, &input));
+  bool ok = input.prepared == PREPARE_SUCCESS;
+  if (ok) {
+    statement_begin();
+    ok = execute_statement(&(input.statement), client->session.table) ==
+         EXECUTE_SUCCESS;
+  }
+  buffer_pool_trim(client->session.table);
+  scheduler_release();
+  free(input.text);
+  return ok;
+}
+
+void operation_stats_add(OperationStats* stats, uint32_t elapsed_us, bool ok) {
+  if (!ok) {
+    stats->errors++;
+    return;
+  }
+  stats->count++;
+  stats->total_us += elapsed_us;
+  if (elapsed_us > stats->max_us) {
+    stats->max_us = elapsed_us;
+  }
+  kll_add(&(stats->latency), elapsed_us);
+}
+
+// The engine has no update statement, so an update writes a new version
+// of the row under the same id.
+void* client_run(void* arg) {
+  Client* client = arg;
+  Driver* driver = client->driver;
+  char text[YCSB_STATEMENT_SIZE];
+  while (__atomic_fetch_add(&(driver->next_op), 1, __ATOMIC_RELAXED) <
+         driver->operations) {
+    Operation op = client_pick_operation(client);
+    uint32_t id = op == OPERATION_INSERT
+                      ? __atomic_fetch_add(&(driver->next_id), 1, __ATOMIC_RELAXED)
+                      : client_pick_id(client);
+    switch (op) {
+      case (OPERATION_READ):
+        snprintf(text, sizeof(text), "select where id = %u", id);
+        break;
+      case (OPERATION_UPDATE): {
+        uint64_t version =
+            __atomic_add_fetch(&(driver->versions), 1, __ATOMIC_RELAXED);
+        snprintf(text, sizeof(text), "insert %u user%u.v%lu user%u@ycsb.test",
+                 id, id, (unsigned long)version, id);
+        break;
+      }
+      case (OPERATION_SCAN): {
+        uint32_t length = 1 + client_random(client) % driver->max_scan;
+        snprintf(text, sizeof(text), "select where id between %u and %u", id,
+                 id + length - 1);
+        break;
+      }
+      case (OPERATION_INSERT):
+        snprintf(text, sizeof(text), "insert %u user%u user%u@ycsb.test", id,
+                 id, id);
+        break;
+    }
+
+    int64_t start = now_micros();
+    bool ok = client_execute(client, text);
+    int64_t elapsed = now_micros() - start;
+    uint32_t elapsed_us = elapsed < UINT32_MAX ? elapsed : UINT32_MAX;
+
+    pthread_mutex_lock(&(driver->lock));
+    operation_stats_add(&(driver->interval[op]), elapsed_us, ok);
+    if (op == OPERATION_INSERT && ok && id > driver->last_id) {
+      __atomic_store_n(&(driver->last_id), id, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(driver->lock));
+  }
+  return NULL;
+}
+
+// Loads ids 1 through records, a batch of rows at a time.
+bool driver_load(Driver* driver) {
+  Row* rows = malloc(YCSB_LOAD_BATCH * sizeof(Row));
+  uint64_t loaded = 0;
+  while (loaded < driver->records) {
+    uint32_t count = YCSB_LOAD_BATCH;
+    if (count > driver->records - loaded) {
+      count = driver->records - loaded;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t id = loaded + i + 1;
+      memset(&(rows[i]), 0, sizeof(Row));
+      rows[i].id = id;
+      snprintf(rows[i].username, sizeof(rows[i].username), "user%u", id);
+      snprintf(rows[i].email, sizeof(rows[i].email), "user%u@ycsb.test", id);
+    }
+    uint32_t appended = import_rows(driver->table, rows, count);
+    loaded += appended;
+    if (appended < count) {
+      break;
+    }
+  }
+  free(rows);
+  driver->last_id = loaded;
+  driver->next_id = loaded + 1;
+  return loaded == driver->records;
+}
+
+// Prints the interval's throughput and latencies, then folds them into the
+// totals.
+void driver_report_interval(Driver* driver, double at_seconds,
+                            double interval_seconds) {
+  pthread_mutex_lock(&(driver->lock));
+  uint64_t count = 0;
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    count += driver->interval[op].count;
+  }
+  fprintf(driver->report, "%7.1f s %9lu ops %9.0f ops/s", at_seconds,
+          (unsigned long)count, count / interval_seconds);
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    OperationStats* interval = &(driver->interval[op]);
+    OperationStats* total = &(driver->total[op]);
+    if (interval->count > 0) {
+      fprintf(driver->report, "  %s p50 %u p99 %u us", OPERATION_NAMES[op],
+              kll_quantile(&(interval->latency), 0.50),
+              kll_quantile(&(interval->latency), 0.99));
+    }
+    total->count += interval->count;
+    total->errors += interval->errors;
+    total->total_us += interval->total_us;
+    if (interval->max_us > total->max_us) {
+      total->max_us = interval->max_us;
+    }
+    kll_merge(&(total->latency), &(interval->latency));
+    kll_free(&(interval->latency));
+    memset(interval, 0, sizeof(OperationStats));
+    kll_init(&(interval->latency));
+  }
+  fprintf(driver->report, "\n");
+  pthread_mutex_unlock(&(driver->lock));
+}
+
+void driver_report_totals(Driver* driver, double seconds) {
+  uint64_t count = 0;
+  uint64_t errors = 0;
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    count += driver->total[op].count;
+    errors += driver->total[op].errors;
+  }
+  fprintf(driver->report, "Ran %lu operations in %.2f s, %.0f ops/s",
+          (unsigned long)count, seconds, count / seconds);
+  if (errors > 0) {
+    fprintf(driver->report, ", %lu failed", (unsigned long)errors);
+  }
+  fprintf(driver->report, "\n");
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    OperationStats* total = &(driver->total[op]);
+    if (total->count == 0) {
+      if (total->errors > 0) {
+        fprintf(driver->report, "%-6s %9u ops %6lu errors\n", OPERATION_NAMES[op],
+                0, (unsigned long)total->errors);
+      }
+      continue;
+    }
+    fprintf(driver->report,
+            "%-6s %9lu ops %6lu errors  avg %.1f p50 %u p95 %u p99 %u max %u us\n",
+            OPERATION_NAMES[op], (unsigned long)total->count,
+            (unsigned long)total->errors, (double)total->total_us / total->count,
+            kll_quantile(&(total->latency), 0.50),
+            kll_quantile(&(total->latency), 0.95),
+            kll_quantile(&(total->latency), 0.99), total->max_us);
+  }
+}
+
+// Parses "read,update,scan,insert" percentages that add up to 100.
+bool parse_mix(const char* text, uint32_t* mix) {
+  unsigned int parts[OPERATIONS];
+  int consumed = 0;
+  if (sscanf(text, "%u,%u,%u,%u%n", &parts[0], &parts[1], &parts[2], &parts[3],
+             &consumed) != OPERATIONS ||
+      text[consumed] != '\0' ||
+      parts[0] + parts[1] + parts[2] + parts[3] != 100) {
+    return false;
+  }
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    mix[op] = parts[op];
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Must supply a database filename.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char* filename = argv[1];
+  Driver driver;
+  memset(&driver, 0, sizeof(driver));
+  driver.workload = WORKLOADS[0];
+  driver.records = 10000;
+  driver.operations = 20000;
+  driver.max_scan = 100;
+  long threads = 4;
+  // Each partition holds at most TABLE_MAX_ROWS row versions, so small
+  // partitions leave updates to hot keys room to grow.
+  long partition_size = 64;
+  double report_seconds = 1;
+  uint64_t seed = 1;
+  char* mix = NULL;
+  char* distribution = NULL;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+      const char* name = argv[++i];
+      uint32_t w = 0;
+      while (w < NUM_WORKLOADS && strcmp(WORKLOADS[w].name, name) != 0) {
+        w++;
+      }
+      if (w == NUM_WORKLOADS) {
+        printf("Workload must be read-heavy, update-heavy, scan-heavy or "
+               "insert-latest\n");
+        exit(EXIT_FAILURE);
+      }
+      driver.workload = WORKLOADS[w];
+    } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+      mix = argv[++i];
+    } else if (strcmp(argv[i], "--distribution") == 0 && i + 1 < argc) {
+      distribution = argv[++i];
+    } else if (strcmp(argv[i], "--records") == 0 && i + 1 < argc) {
+      driver.records = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--operations") == 0 && i + 1 < argc) {
+      driver.operations = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--max-scan") == 0 && i + 1 < argc) {
+      driver.max_scan = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--partition-size") == 0 && i + 1 < argc) {
+      partition_size = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--report-interval") == 0 && i + 1 < argc) {
+      report_seconds = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else {
+      printf("Unrecognized option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (mix != NULL && !parse_mix(mix, driver.workload.mix)) {
+    printf("Mix must be read,update,scan,insert percentages adding up to 100\n");
+    exit(EXIT_FAILURE);
+  }
+  if (distribution != NULL) {
+    uint32_t d = 0;
+    while (d < 3 && strcmp(DISTRIBUTION_NAMES[d], distribution) != 0) {
+      d++;
+    }
+    if (d == 3) {
+      printf("Distribution must be uniform, zipfian or latest\n");
+      exit(EXIT_FAILURE);
+    }
+    driver.workload.distribution = d;
+  }
+  if (driver.records < 1 || driver.records > INT32_MAX / 2) {
+    printf("Records must be between 1 and %d\n", INT32_MAX / 2);
+    exit(EXIT_FAILURE);
+  }
+  if (threads < 1 || threads > 1024) {
+    printf("Threads must be between 1 and 1024\n");
+    exit(EXIT_FAILURE);
+  }
+  if (driver.max_scan < 1 || partition_size < 1 || partition_size > UINT32_MAX ||
+      report_seconds <= 0) {
+    printf("Scan length, partition size and report interval must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Rows are spread over partitions, since one file holds at most
+  // TABLE_MAX_ROWS of them.
+  driver.table = db_open(filename);
+  FileHeader* header = &(driver.table->pager->header);
+  if (header->partition_size > 0 || driver.table->num_rows > 0) {
+    printf("The database must be new\n");
+    exit(EXIT_FAILURE);
+  }
+  header->partition_size = partition_size;
+  pager_write_header(driver.table->pager);
+
+  driver.report = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(driver.report, NULL, _IOLBF, 0);
+  fprintf(driver.report, "Workload %s: %u%% read, %u%% update, %u%% scan, "
+          "%u%% insert, %s keys, %ld threads\n",
+          driver.workload.name, driver.workload.mix[OPERATION_READ],
+          driver.workload.mix[OPERATION_UPDATE],
+          driver.workload.mix[OPERATION_SCAN],
+          driver.workload.mix[OPERATION_INSERT],
+          DISTRIBUTION_NAMES[driver.workload.distribution], threads);
+
+  int64_t load_start = now_micros();
+  if (!driver_load(&driver)) {
+    fprintf(driver.report, "Error: Table full after %lu rows.\n",
+            (unsigned long)driver.last_id);
+    exit(EXIT_FAILURE);
+  }
+  double load_seconds = (now_micros() - load_start) / 1e6;
+  fprintf(driver.report, "Loaded %lu rows in %.2f s, %.0f rows/s\n",
+          (unsigned long)driver.records, load_seconds,
+          driver.records / load_seconds);
+
+  zipfian_init(&(driver.zipfian), driver.records, YCSB_ZIPFIAN_THETA);
+  pthread_mutex_init(&(driver.lock), NULL);
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    kll_init(&(driver.interval[op].latency));
+    kll_init(&(driver.total[op].latency));
+  }
+  scheduler_init(dup(STDOUT_FILENO));
+  int null_fd = open("/dev/null", O_WRONLY);
+  Client* clients = calloc(threads, sizeof(Client));
+  int64_t start = now_micros();
+  for (long t = 0; t < threads; t++) {
+    clients[t].driver = &driver;
+    clients[t].session =
+        (Session){driver.table, null_fd, SCHEDULE_POINT, 0, {false}, 0, 0, 0, 0};
+    clients[t].random_state = (seed + t + 1) * 0x9E3779B97F4A7C15ULL;
+    pthread_create(&(clients[t].thread), NULL, client_run, &(clients[t]));
+  }
+
+  int64_t last_report = start;
+  while (__atomic_load_n(&(driver.next_op), __ATOMIC_RELAXED) <
+         driver.operations) {
+    int64_t next_report = last_report + (int64_t)(report_seconds * 1e6);
+    int64_t now = now_micros();
+    if (now < next_report) {
+      usleep(next_report - now < 10000 ? next_report - now : 10000);
+      continue;
+    }
+    driver_report_interval(&driver, (now - start) / 1e6,
+                           (now - last_report) / 1e6);
+    last_report = now;
+  }
+  for (long t = 0; t < threads; t++) {
+    pthread_join(clients[t].thread, NULL);
+  }
+  int64_t end = now_micros();
+  driver_report_interval(&driver, (end - start) / 1e6,
+                         (end - last_report) / 1e6);
+  driver_report_totals(&driver, (end - start) / 1e6);
+
+  db_close(driver.table);
+  for (uint32_t op = 0; op < OPERATIONS; op++) {
+    kll_free(&(driver.interval[op].latency));
+    kll_free(&(driver.total[op].latency));
+  }
+  free(clients);
+  return 0;
+}